@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <expected>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+
+#include "SafeFD.h"
+#include "Socket.h"
+
+
+//Lo activa el manejador de SIGHUP: el hilo escritor reabre el fichero del registro (rotacion)
+std::atomic<bool> reopen_access_log{false};
+
+
+//Que hacer con una entrada cuando el buffer esta lleno
+enum class log_full_policy{
+  drop,
+  block,
+};
+
+
+//Entrada del registro de accesos. Tamano fijo para poder copiarla al buffer circular sin
+//reservar memoria; las rutas mas largas se recortan
+struct access_entry{
+  std::chrono::system_clock::time_point time;
+  std::chrono::microseconds duration{0};
+  uint64_t bytes{0};
+  client_address client;
+  uint16_t status{0};
+  uint16_t path_length{0};
+  std::array<char, 208> path;
+
+  void set_path(std::string_view target) noexcept{
+    path_length = static_cast<uint16_t>(std::min(target.size(), path.size()));
+    std::memcpy(path.data(), target.data(), path_length);
+  }
+};
+
+
+//Registro de accesos asincrono. El hilo que atiende peticiones deja cada entrada en un buffer
+//circular de un productor y un consumidor sin bloqueos ni llamadas al sistema; un hilo escritor
+//lo vacia cada poco y escribe todas las lineas pendientes con un solo write()
+class AccessLog{
+ public:
+  static constexpr size_t capacity{4096};
+  static constexpr std::chrono::milliseconds flush_interval{20};
+
+  //Con path "-" se escribe por la salida de error
+  static std::expected<std::unique_ptr<AccessLog>, int> open(const std::string& path, log_full_policy policy){
+    std::unique_ptr<AccessLog> log(new AccessLog(path, policy));
+    int result = log->reopen();
+    if(result != EXIT_SUCCESS) return std::unexpected(result);
+    log->writer_ = std::jthread([raw = log.get()](std::stop_token stop){
+      raw->write_loop(stop);
+    });
+    return log;
+  }
+
+  AccessLog(const AccessLog&) = delete;
+  AccessLog& operator=(const AccessLog&) = delete;
+
+  //Al destruirse el hilo escritor vacia lo que quede antes de terminar
+  ~AccessLog() = default;
+
+  //Solo lo llama el hilo que atiende las peticiones. Devuelve false si la entrada se descarta
+  bool push(const access_entry& entry) noexcept{
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    while(head - tail_.load(std::memory_order_acquire) == capacity){
+      if(policy_ == log_full_policy::drop) return false;
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    entries_[head % capacity] = entry;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  AccessLog(std::string path, log_full_policy policy) : path_{std::move(path)}, policy_{policy}, entries_{new access_entry[capacity]} {}
+
+  int reopen(){
+    if(path_ == "-") return EXIT_SUCCESS;
+    SafeFD fd(::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644));
+    if(!fd.is_valid()) return errno;
+    fd_ = std::move(fd);
+    return EXIT_SUCCESS;
+  }
+
+  [[nodiscard]] int output() const noexcept{
+    return path_ == "-" ? STDERR_FILENO : fd_.get();
+  }
+
+  void write_loop(std::stop_token stop){
+    std::string batch;
+    batch.reserve(capacity * 128);
+    while(true){
+      bool stopping = stop.stop_requested();
+      if(reopen_access_log.exchange(false)){
+        int result = reopen();
+        if(result != EXIT_SUCCESS) std::cerr << "Error reopening access log: " << std::strerror(result) << '\n';
+      }
+
+      uint64_t tail = tail_.load(std::memory_order_relaxed);
+      uint64_t head = head_.load(std::memory_order_acquire);
+      for(; tail != head; tail++) format_entry(batch, entries_[tail % capacity]);
+      tail_.store(tail, std::memory_order_release);
+
+      size_t written{0};
+      while(written < batch.size()){
+        ssize_t size = write(output(), batch.data() + written, batch.size() - written);
+        if(size < 0 && errno == EINTR) continue;
+        if(size <= 0) break;
+        written += static_cast<size_t>(size);
+      }
+      batch.clear();
+
+      if(stopping) return;
+      std::this_thread::sleep_for(flush_interval);
+    }
+  }
+
+  //time=... client=ip:puerto path="..." status=... bytes=... duration_us=...
+  //Una IPv6 va entre corchetes y un cliente de un socket Unix es client=unix
+  static void format_entry(std::string& out, const access_entry& entry){
+    char buffer[64];
+    auto since_epoch = entry.time.time_since_epoch();
+    time_t seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+    auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() % 1000;
+    tm utc;
+    gmtime_r(&seconds, &utc);
+    size_t length = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+    out.append("time=").append(buffer, length);
+    out.push_back('.');
+    append_number(out, static_cast<uint64_t>(milliseconds), 3);
+    out.append("Z client=");
+
+    const client_address& client = entry.client;
+    if(client.family == AF_INET || client.family == AF_INET6){
+      char ip[INET6_ADDRSTRLEN]{};
+      inet_ntop(client.family, client.ip.data(), ip, sizeof(ip));
+      if(client.family == AF_INET6) out.append("[").append(ip).append("]:");
+      else out.append(ip).push_back(':');
+      append_number(out, ntohs(client.port));
+    }
+    else out.append("unix");
+
+    //Las comillas, barras invertidas y bytes no imprimibles de la ruta se escapan como \xHH
+    out.append(" path=\"");
+    for(size_t i = 0; i < entry.path_length; i++){
+      unsigned char c = static_cast<unsigned char>(entry.path[i]);
+      if(c < 0x20 || c >= 0x7f || c == '"' || c == '\\'){
+        static constexpr std::string_view digits{"0123456789abcdef"};
+        out.append("\\x").push_back(digits[c >> 4]);
+        out.push_back(digits[c & 0xf]);
+      }
+      else out.push_back(static_cast<char>(c));
+    }
+    out.append("\" status=");
+    append_number(out, entry.status);
+    out.append(" bytes=");
+    append_number(out, entry.bytes);
+    out.append(" duration_us=");
+    append_number(out, static_cast<uint64_t>(entry.duration.count()));
+    out.push_back('\n');
+  }
+
+  static void append_number(std::string& out, uint64_t value, size_t width = 0){
+    char buffer[24];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    size_t length = static_cast<size_t>(end - buffer);
+    if(length < width) out.append(width - length, '0');
+    out.append(buffer, end);
+  }
+
+  std::string path_;
+  log_full_policy policy_;
+  SafeFD fd_;
+  std::unique_ptr<access_entry[]> entries_;
+  //head_ solo lo escribe el productor y tail_ solo el hilo escritor
+  alignas(64) std::atomic<uint64_t> head_{0};
+  alignas(64) std::atomic<uint64_t> tail_{0};
+  //El ultimo miembro: se destruye (y se espera al hilo) antes que el buffer y el fichero
+  std::jthread writer_;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+//Cuenta las reservas de memoria dinamica del proceso sustituyendo todas las formas del
+//operator new global: simples y de arrays, nothrow y alineadas, cada una con su delete. Hay
+//que sustituirlas todas porque la biblioteca estandar no garantiza que pasen por la simple
+//(las alineadas usan aligned_alloc) y con ASan cada forma que no se sustituye la pone ASan,
+//que no la cuenta y no admite que la libere nuestro delete. Solo se cuentan las del codigo
+//C++: no las de malloc directo de bibliotecas de C como OpenSSL o zlib. Se publica en las
+//metricas para comprobar que atender peticiones en regimen estable no reserva memoria (ver
+//bench/allocations.sh). Es solo para esa prueba: cada reserva paga un incremento atomico y
+//ASan deja de detectar un delete que no corresponde a su new. Por eso solo la incluye el
+//programa del servidor compilado con DOCSERVER_COUNT_ALLOCATIONS (server-allocations en
+//compile.sh), una vez
+std::atomic<uint64_t> heap_allocations{0};
+
+
+uint64_t allocation_count() noexcept{
+  return heap_allocations.load(std::memory_order_relaxed);
+}
+
+
+//Como el operator new de la biblioteca: reintenta tras el new_handler y si no hay lanza bad_alloc
+void* counted_allocate(std::size_t size){
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if(size == 0) size = 1;
+  while(true){
+    if(void* memory = std::malloc(size)) return memory;
+    std::new_handler handler = std::get_new_handler();
+    if(handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+}
+
+
+//aligned_alloc pide un tamano multiplo de la alineacion
+void* counted_allocate(std::size_t size, std::align_val_t alignment){
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  std::size_t align = static_cast<std::size_t>(alignment);
+  if(align < sizeof(void*)) align = sizeof(void*);
+  if(size == 0) size = 1;
+  size = (size + align - 1) / align * align;
+  while(true){
+    if(void* memory = std::aligned_alloc(align, size)) return memory;
+    std::new_handler handler = std::get_new_handler();
+    if(handler == nullptr) throw std::bad_alloc();
+    handler();
+  }
+}
+
+
+//Las formas nothrow llaman a las que lanzan, como pide el estandar
+template <typename... Alignment>
+void* counted_allocate_nothrow(std::size_t size, Alignment... alignment) noexcept{
+  try{
+    return counted_allocate(size, alignment...);
+  }
+  catch(const std::bad_alloc&){
+    return nullptr;
+  }
+}
+
+
+void* operator new(std::size_t size){
+  return counted_allocate(size);
+}
+
+
+void* operator new[](std::size_t size){
+  return counted_allocate(size);
+}
+
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept{
+  return counted_allocate_nothrow(size);
+}
+
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept{
+  return counted_allocate_nothrow(size);
+}
+
+
+void* operator new(std::size_t size, std::align_val_t alignment){
+  return counted_allocate(size, alignment);
+}
+
+
+void* operator new[](std::size_t size, std::align_val_t alignment){
+  return counted_allocate(size, alignment);
+}
+
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept{
+  return counted_allocate_nothrow(size, alignment);
+}
+
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept{
+  return counted_allocate_nothrow(size, alignment);
+}
+
+
+//Todas reservan con malloc o aligned_alloc, asi que todas liberan con free
+void operator delete(void* memory) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete(void* memory, std::size_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory, std::size_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete(void* memory, std::align_val_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory, std::align_val_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept{
+  std::free(memory);
+}
+
+
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept{
+  std::free(memory);
+}
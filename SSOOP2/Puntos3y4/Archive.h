@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <optional>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "SafeFD.h"
+#include "SafeMap.h"
+
+
+//Archivo de contenido: todo el arbol de basedir en un solo fichero, generado con docpack, que
+//el servidor proyecta en memoria una vez y del que sirve cada fichero como un trozo de la
+//proyeccion, sin abrir nada por peticion. Formato (en el orden de bytes de la maquina que lo
+//genera, que es la misma que lo sirve):
+//  archive_header
+//  archive_entry[entry_count], una por casilla del hash perfecto minimo
+//  uint32_t[bucket_count], el desplazamiento de cada cubeta
+//  cadenas de las entradas
+//  contenido de los ficheros: los de una pagina o mas alineados a pagina y los pequenos
+//  juntos, para que compartan paginas
+//El indice es un hash perfecto minimo de tipo hash-and-displace (CHD): la ruta va a una
+//cubeta y el desplazamiento de la cubeta, elegido al generar el archivo, lleva cada ruta de
+//la cubeta a una casilla distinta. Buscar cuesta un hash y una comparacion de la ruta, que
+//hace falta porque una ruta que no esta tambien cae en alguna casilla
+constexpr std::array<char, 8> archive_magic{'D', 'O', 'C', 'P', 'A', 'C', 'K', '1'};
+constexpr size_t archive_page{4096};
+
+
+struct archive_header{
+  std::array<char, 8> magic;
+  uint64_t entry_count;
+  uint64_t bucket_count;
+  uint64_t entries_offset;
+  uint64_t buckets_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  //Tamano total, para detectar un archivo truncado
+  uint64_t file_size;
+};
+
+
+struct archive_entry{
+  uint64_t data_offset;
+  uint64_t size;
+  int64_t mtime;
+  //Desde strings_offset: la ruta (relativa a basedir, sin "/" inicial), el tipo de contenido
+  //y las cabeceras ETag y Last-Modified ya formadas, seguidas
+  uint64_t strings;
+  uint32_t path_length;
+  uint16_t type_length;
+  uint16_t validators_length;
+  //Posicion del ETag (con comillas) y de la fecha dentro de las cabeceras
+  uint16_t etag_offset;
+  uint16_t etag_length;
+  uint16_t last_modified_offset;
+  uint16_t last_modified_length;
+};
+
+
+//FNV-1a de 64 bits
+constexpr uint64_t archive_hash(std::string_view path) noexcept{
+  uint64_t hash{0xcbf29ce484222325};
+  for(char c : path){
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+
+//Casilla de una ruta con hash hash en una cubeta con desplazamiento displacement, mezclando
+//ambos con el finalizador de splitmix64
+constexpr uint64_t archive_slot(uint64_t hash, uint32_t displacement, uint64_t entry_count) noexcept{
+  uint64_t z = hash + (static_cast<uint64_t>(displacement) + 1) * 0x9e3779b97f4a7c15;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return (z ^ (z >> 31)) % entry_count;
+}
+
+
+//Fichero del archivo: todo apunta dentro de la proyeccion, que vive lo que el Archive
+struct archived_file{
+  std::string_view data;
+  std::string_view type;
+  //"ETag: ...\r\nLast-Modified: ...\r\n"
+  std::string_view validators;
+  std::string_view etag;
+  std::string_view last_modified;
+  time_t mtime{0};
+};
+
+
+class Archive{
+ public:
+  //Solo se comprueba la cabecera, asi que abrirlo no depende del numero de ficheros. Una
+  //entrada que se sale del archivo se detecta al buscarla. Falla con EINVAL si no es un
+  //archivo de docpack o esta truncado
+  static std::expected<Archive, int> open(const std::string& path){
+    SafeFD fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(!fd.is_valid()) return std::unexpected(errno);
+    struct stat file_stat;
+    if(fstat(fd.get(), &file_stat) < 0) return std::unexpected(errno);
+    auto size = static_cast<size_t>(file_stat.st_size);
+    if(size < sizeof(archive_header)) return std::unexpected(EINVAL);
+    void* mem = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if(mem == MAP_FAILED) return std::unexpected(errno);
+    SafeMap map(std::string_view(static_cast<const char*>(mem), size));
+
+    archive_header header;
+    std::memcpy(&header, mem, sizeof(header));
+    if(header.magic != archive_magic || header.file_size != size) return std::unexpected(EINVAL);
+    if(!within(header.entries_offset, header.entry_count, sizeof(archive_entry), size)
+       || !within(header.buckets_offset, header.bucket_count, sizeof(uint32_t), size)
+       || !within(header.strings_offset, header.strings_size, 1, size)
+       || (header.entry_count > 0 && header.bucket_count == 0)){
+      return std::unexpected(EINVAL);
+    }
+    //Las entradas y los desplazamientos estan alineados en el archivo y mmap alinea a pagina
+    if(header.entries_offset % alignof(archive_entry) != 0 || header.buckets_offset % alignof(uint32_t) != 0) return std::unexpected(EINVAL);
+    return Archive(std::move(map), header);
+  }
+
+  //path viene de canonical_path
+  [[nodiscard]] std::optional<archived_file> find(std::string_view path) const noexcept{
+    if(header_.entry_count == 0) return std::nullopt;
+    uint64_t hash = archive_hash(path);
+    std::string_view data = map_.get();
+    const auto* buckets = reinterpret_cast<const uint32_t*>(data.data() + header_.buckets_offset);
+    const auto* entries = reinterpret_cast<const archive_entry*>(data.data() + header_.entries_offset);
+    const archive_entry& entry = entries[archive_slot(hash, buckets[hash % header_.bucket_count], header_.entry_count)];
+
+    size_t strings_length = size_t{entry.path_length} + entry.type_length + entry.validators_length;
+    if(!within(entry.strings, strings_length, 1, header_.strings_size) || !within(entry.data_offset, entry.size, 1, data.size())) return std::nullopt;
+    if(entry.etag_offset + size_t{entry.etag_length} > entry.validators_length
+       || entry.last_modified_offset + size_t{entry.last_modified_length} > entry.validators_length){
+      return std::nullopt;
+    }
+    std::string_view strings = data.substr(header_.strings_offset + entry.strings, strings_length);
+    if(strings.substr(0, entry.path_length) != path) return std::nullopt;
+
+    archived_file file;
+    file.data = data.substr(entry.data_offset, entry.size);
+    file.type = strings.substr(entry.path_length, entry.type_length);
+    file.validators = strings.substr(entry.path_length + size_t{entry.type_length}, entry.validators_length);
+    file.etag = file.validators.substr(entry.etag_offset, entry.etag_length);
+    file.last_modified = file.validators.substr(entry.last_modified_offset, entry.last_modified_length);
+    file.mtime = entry.mtime;
+    return file;
+  }
+
+  [[nodiscard]] size_t entry_count() const noexcept{
+    return header_.entry_count;
+  }
+
+ private:
+  Archive(SafeMap map, const archive_header& header) noexcept : map_{std::move(map)}, header_{header} {}
+
+  //count elementos de size bytes desde offset caben en total bytes, sin desbordar
+  static constexpr bool within(uint64_t offset, uint64_t count, uint64_t size, uint64_t total) noexcept{
+    return offset <= total && count <= (total - offset) / size;
+  }
+
+  SafeMap map_;
+  archive_header header_;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+//Memoria de la respuesta en curso de una conexion: las cadenas que se forman al preparar la
+//respuesta (la ruta normalizada, los validadores de una variante, los prefijos de los
+//rangos...) se reparten de un bloque fijo sin llamar a malloc y se liberan todas de golpe con
+//reset al terminar la respuesta. Lo que no cabe en el bloque se pide al heap y tambien se
+//devuelve en reset
+class RequestArena{
+ public:
+  static constexpr size_t block_size{4096};
+
+  RequestArena() : resource_(block_.data(), block_.size(), std::pmr::new_delete_resource()) {}
+
+  //El recurso apunta al bloque: la arena no se puede copiar ni mover
+  RequestArena(const RequestArena&) = delete;
+  RequestArena& operator=(const RequestArena&) = delete;
+
+  [[nodiscard]] std::pmr::memory_resource* resource() noexcept{
+    return &resource_;
+  }
+
+  void reset() noexcept{
+    resource_.release();
+  }
+
+ private:
+  alignas(std::max_align_t) std::array<std::byte, block_size> block_;
+  std::pmr::monotonic_buffer_resource resource_;
+};
+
+
+//Buffers de las conexiones cerradas de un trabajador, para las siguientes: una conexion nueva
+//toma los de una que ya ha terminado con la memoria que esta llego a reservar, asi que, una vez
+//servidas las primeras, abrir y cerrar conexiones tampoco reserva memoria. Se guardan como
+//mucho max_free de cada clase y no los que han crecido por encima de max_capacity (una
+//respuesta muy grande generada en memoria), que se liberan
+class BufferPool{
+ public:
+  BufferPool(size_t max_free, size_t max_capacity) : max_free_{max_free}, max_capacity_{max_capacity}{
+    //Las listas no crecen despues: devolver un buffer nunca reserva
+    strings_.reserve(max_free);
+    arenas_.reserve(max_free);
+  }
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+  BufferPool(BufferPool&&) noexcept = default;
+  BufferPool& operator=(BufferPool&&) noexcept = default;
+
+  //Un string vacio, con la capacidad de uno devuelto si lo hay
+  std::string take_string() noexcept{
+    if(strings_.empty()) return {};
+    std::string buffer = std::move(strings_.back());
+    strings_.pop_back();
+    return buffer;
+  }
+
+  void give(std::string&& buffer) noexcept{
+    if(buffer.capacity() > max_capacity_ || strings_.size() == max_free_) return;
+    buffer.clear();
+    strings_.push_back(std::move(buffer));
+  }
+
+  std::unique_ptr<RequestArena> take_arena(){
+    if(arenas_.empty()) return std::make_unique<RequestArena>();
+    std::unique_ptr<RequestArena> arena = std::move(arenas_.back());
+    arenas_.pop_back();
+    return arena;
+  }
+
+  void give(std::unique_ptr<RequestArena>&& arena) noexcept{
+    if(!arena || arenas_.size() == max_free_) return;
+    arena->reset();
+    arenas_.push_back(std::move(arena));
+  }
+
+ private:
+  size_t max_free_;
+  size_t max_capacity_;
+  std::vector<std::string> strings_;
+  std::vector<std::unique_ptr<RequestArena>> arenas_;
+};
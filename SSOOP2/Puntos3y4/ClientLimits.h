@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <new>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <cerrno>
+
+#include "SafeMap.h"
+
+
+//Las tablas por cliente tienen un numero fijo de casillas indexadas por un hash de la clave
+//del cliente (ver client_key), sin guardarla: dos clientes que caen en la misma casilla
+//comparten sus limites. Con 65536 casillas es raro mientras los clientes activos a la vez
+//sean unos pocos miles
+constexpr size_t client_slots{65536};
+
+
+//Casilla de la clave por hash multiplicativo. Un cliente sin clave (de un socket Unix) no
+//tiene casilla: recibe client_slots y no cuenta en los limites por cliente
+constexpr size_t client_slot(std::optional<uint64_t> key) noexcept{
+  if(!key) return client_slots;
+  return (*key * 0x9E3779B97F4A7C15u) >> 48;
+}
+
+
+enum class limit_exceeded{
+  //Se ha alcanzado el maximo de conexiones del trabajador
+  server,
+  //Se ha alcanzado el maximo de conexiones del cliente
+  client,
+};
+
+
+class ConnectionLimits;
+
+
+//Conexion contada en los limites de un ConnectionLimits. Se descuenta al destruirse
+class connection_permit{
+ public:
+  connection_permit() noexcept = default;
+  connection_permit(ConnectionLimits* limits, size_t slot) noexcept : limits_{limits}, slot_{slot} {}
+  connection_permit(connection_permit&& other) noexcept : limits_{std::exchange(other.limits_, nullptr)}, slot_{other.slot_} {}
+
+  connection_permit& operator=(connection_permit&& other) noexcept{
+    if(this != &other){
+      release();
+      limits_ = std::exchange(other.limits_, nullptr);
+      slot_ = other.slot_;
+    }
+    return *this;
+  }
+
+  ~connection_permit(){
+    release();
+  }
+
+ private:
+  void release() noexcept;
+
+  ConnectionLimits* limits_{nullptr};
+  size_t slot_{0};
+};
+
+
+//Conexiones abiertas de un trabajador, en total y por cliente. Es local a cada trabajador (un
+//trabajador que muere no deja cuentas sin descontar); con SO_REUSEPORT las conexiones de un
+//cliente se reparten entre los trabajadores, que aplican cada uno el limite por su cuenta
+class ConnectionLimits{
+ public:
+  //0 en cualquiera de los dos deja ese limite sin aplicar
+  ConnectionLimits(size_t max_connections, size_t max_per_client)
+      : max_connections_{max_connections}, max_per_client_{max_per_client}, per_client_(max_per_client > 0 ? client_slots : 0) {}
+
+  ConnectionLimits(const ConnectionLimits&) = delete;
+  ConnectionLimits& operator=(const ConnectionLimits&) = delete;
+
+  std::expected<connection_permit, limit_exceeded> admit(std::optional<uint64_t> key){
+    if(max_connections_ > 0 && connections_ >= max_connections_) return std::unexpected(limit_exceeded::server);
+    size_t slot = client_slot(key);
+    if(max_per_client_ > 0 && slot < client_slots){
+      if(per_client_[slot] >= max_per_client_) return std::unexpected(limit_exceeded::client);
+      per_client_[slot]++;
+    }
+    connections_++;
+    return connection_permit(this, slot);
+  }
+
+  [[nodiscard]] size_t connections() const noexcept{
+    return connections_;
+  }
+
+ private:
+  friend class connection_permit;
+
+  void release(size_t slot) noexcept{
+    connections_--;
+    if(max_per_client_ > 0 && slot < client_slots) per_client_[slot]--;
+  }
+
+  size_t max_connections_;
+  size_t max_per_client_;
+  size_t connections_{0};
+  std::vector<uint32_t> per_client_;
+};
+
+
+void connection_permit::release() noexcept{
+  if(limits_ != nullptr) limits_->release(slot_);
+  limits_ = nullptr;
+}
+
+
+//Limite de peticiones por segundo de cada cliente, comun a todos los trabajadores: la tabla esta
+//en memoria compartida anonima, creada antes de lanzarlos, como las metricas. Es un token
+//bucket de rate peticiones por segundo y capacidad burst implementado como GCRA: cada
+//casilla guarda solo el instante teorico de la siguiente peticion (TAT) y se actualiza con
+//un compare_exchange, sin cerrojos entre procesos
+class RateLimiter{
+ public:
+  //rate 0 desactiva el limite
+  static std::expected<RateLimiter, int> create(unsigned rate, unsigned burst){
+    if(rate == 0) return RateLimiter(SafeMap(), 0, 0);
+    size_t size = sizeof(std::atomic<uint64_t>) * client_slots;
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return std::unexpected(errno);
+    for(size_t i = 0; i < client_slots; i++) new (static_cast<std::atomic<uint64_t>*>(mem) + i) std::atomic<uint64_t>(0);
+    uint64_t interval = 1000000000 / rate;
+    return RateLimiter(SafeMap(std::string_view(static_cast<char*>(mem), size)), interval, interval * (std::max(burst, 1u) - 1));
+  }
+
+  //Gasta un token del cliente. Si no quedan devuelve false y en retry_after el tiempo hasta
+  //que haya uno. Los clientes sin clave no tienen limite
+  bool take(std::optional<uint64_t> key, std::chrono::nanoseconds& retry_after) const noexcept{
+    size_t slot = client_slot(key);
+    if(interval_ == 0 || slot == client_slots) return true;
+    std::atomic<uint64_t>& tat = slots()[slot];
+    //El reloj monotono es el mismo para todos los procesos
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    uint64_t current = tat.load(std::memory_order_relaxed);
+    while(true){
+      uint64_t start = std::max(current, now);
+      if(start - now > tolerance_){
+        retry_after = std::chrono::nanoseconds(start - now - tolerance_);
+        return false;
+      }
+      if(tat.compare_exchange_weak(current, start + interval_, std::memory_order_relaxed)) return true;
+    }
+  }
+
+ private:
+  RateLimiter(SafeMap region, uint64_t interval, uint64_t tolerance) noexcept : region_{std::move(region)}, interval_{interval}, tolerance_{tolerance} {}
+
+  [[nodiscard]] std::atomic<uint64_t>* slots() const noexcept{
+    return reinterpret_cast<std::atomic<uint64_t>*>(const_cast<char*>(region_.get().data()));
+  }
+
+  SafeMap region_;
+  //Nanosegundos entre tokens y adelanto maximo del TAT sobre el reloj (burst - 1 tokens)
+  uint64_t interval_;
+  uint64_t tolerance_;
+};
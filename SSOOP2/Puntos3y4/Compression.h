@@ -0,0 +1,163 @@
+#pragma once
+
+#include <expected>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unistd.h>
+#include <zlib.h>
+#include <cerrno>
+
+#include "FileCache.h"
+
+
+//Comprime data en formato gzip (deflate con cabecera gzip) con el nivel de zlib level
+std::expected<std::string, int> gzip_compress(std::string_view data, int level){
+  z_stream stream{};
+  //15 bits de ventana + 16 para que zlib escriba la cabecera y el pie de gzip
+  if(deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return std::unexpected(ENOMEM);
+  std::string output(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  stream.next_out = reinterpret_cast<Bytef*>(output.data());
+  stream.avail_out = static_cast<uInt>(output.size());
+  int result = deflate(&stream, Z_FINISH);
+  output.resize(stream.total_out);
+  deflateEnd(&stream);
+  if(result != Z_STREAM_END) return std::unexpected(EIO);
+  return output;
+}
+
+
+//Lee el fichero entero. Con --mmap ya esta en memoria; si no, se lee con pread
+std::expected<std::string, int> read_file(const file_entry& file){
+  if(!file.map.get().empty()) return std::string(file.map.get());
+  std::string data(file.size, '\0');
+  size_t done{0};
+  while(done < file.size){
+    ssize_t size = pread(file.fd.get(), data.data() + done, file.size - done, static_cast<off_t>(done));
+    if(size < 0 && errno == EINTR) continue;
+    if(size < 0) return std::unexpected(errno);
+    if(size == 0) return std::unexpected(EIO);
+    done += static_cast<size_t>(size);
+  }
+  return data;
+}
+
+
+//Variantes codificadas de un fichero en una version concreta (inodo y fecha de modificacion)
+struct encoded_variants{
+  ino_t inode{0};
+  timespec mtime{};
+  //Existen los hermanos precomprimidos fichero.zst y fichero.gz
+  bool zstd_sibling{false};
+  bool gzip_sibling{false};
+  //Cuerpo comprimido al vuelo; vacio si todavia no se ha pedido o no compensa
+  std::shared_ptr<const std::string> gzip;
+  bool gzip_tried{false};
+};
+
+
+//Cache LRU de variantes codificadas por ruta con un presupuesto de memoria en bytes. Una
+//entrada solo vale para la version del fichero con la que se creo: si el FileCache devuelve
+//otra (cambio el inodo o la fecha) se descarta y se vuelven a buscar los hermanos. Los
+//cuerpos comprimidos se comparten con shared_ptr como los ficheros del FileCache
+class EncodingCache{
+ public:
+  //Dice si existe el fichero de la ruta dada (un hermano precomprimido)
+  using probe = std::function<bool(const std::string& path)>;
+
+  EncodingCache(size_t budget, size_t min_size, int level, probe exists)
+      : budget_{budget}, min_size_{min_size}, level_{level}, exists_{std::move(exists)} {}
+
+  EncodingCache(const EncodingCache&) = delete;
+  EncodingCache& operator=(const EncodingCache&) = delete;
+
+  //Variantes de path en la version de file. La referencia vale hasta la siguiente llamada.
+  //Un acierto no reserva memoria
+  encoded_variants& get(std::string_view path, const file_entry& file){
+    auto it = entries_.find(path);
+    if(it != entries_.end()){
+      encoded_variants& cached = it->second.variants;
+      if(cached.inode == file.inode && cached.mtime.tv_sec == file.mtime.tv_sec && cached.mtime.tv_nsec == file.mtime.tv_nsec){
+        lru_.splice(lru_.begin(), lru_, it->second.position);
+        return cached;
+      }
+      remove(it);
+    }
+
+    std::string key(path);
+    encoded_variants variants;
+    variants.inode = file.inode;
+    variants.mtime = file.mtime;
+    variants.zstd_sibling = exists_(key + ".zst");
+    variants.gzip_sibling = exists_(key + ".gz");
+    make_room(cost(path, variants));
+    lru_.push_front(key);
+    auto [inserted, ok] = entries_.emplace(std::move(key), node{std::move(variants), lru_.begin()});
+    used_ += cost(path, inserted->second.variants);
+    return inserted->second.variants;
+  }
+
+  //Cuerpo de file comprimido con gzip, comprimiendolo la primera vez. Devuelve nullptr si
+  //el fichero es menor que el umbral, no cabe en la cache o comprimido no ocupa menos
+  std::shared_ptr<const std::string> gzip(std::string_view path, const file_entry& file){
+    encoded_variants& variants = get(path, file);
+    if(variants.gzip_tried) return variants.gzip;
+    variants.gzip_tried = true;
+    if(file.size < min_size_ || file.size > budget_ / 4) return nullptr;
+
+    std::expected<std::string, int> data = read_file(file);
+    if(!data) return nullptr;
+    std::expected<std::string, int> compressed = gzip_compress(data.value(), level_);
+    if(!compressed || compressed.value().size() >= file.size) return nullptr;
+    compressed.value().shrink_to_fit();
+
+    //get() puede haber expulsado otras entradas, pero no esta, que es la mas reciente
+    std::shared_ptr<const std::string> body = std::make_shared<const std::string>(std::move(compressed.value()));
+    make_room(body->size());
+    auto it = entries_.find(path);
+    if(it == entries_.end()) return body;
+    it->second.variants.gzip = body;
+    used_ += body->size();
+    return body;
+  }
+
+  [[nodiscard]] size_t used() const noexcept{
+    return used_;
+  }
+
+ private:
+  struct node{
+    encoded_variants variants;
+    std::list<std::string>::iterator position;
+  };
+
+  static size_t cost(std::string_view path, const encoded_variants& variants){
+    return path.size() + sizeof(node) + (variants.gzip ? variants.gzip->size() : 0);
+  }
+
+  //Expulsa las entradas menos usadas hasta que quepan size bytes mas, sin tocar la primera
+  void make_room(size_t size){
+    while(lru_.size() > 1 && used_ + size > budget_){
+      remove(entries_.find(lru_.back()));
+    }
+  }
+
+  void remove(string_map<node>::iterator it){
+    used_ -= cost(it->first, it->second.variants);
+    lru_.erase(it->second.position);
+    entries_.erase(it);
+  }
+
+  size_t budget_;
+  size_t min_size_;
+  int level_;
+  probe exists_;
+  size_t used_{0};
+  std::list<std::string> lru_;
+  string_map<node> entries_;
+};
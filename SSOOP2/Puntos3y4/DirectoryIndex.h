@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <format>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+
+#include "SafeFD.h"
+#include "Http.h"
+#include "PathResolver.h"
+
+
+//Cabecera de cada registro que devuelve getdents64; el nombre (terminado en nulo) va justo
+//despues de d_type y el registro ocupa d_reclen bytes
+struct dirent64_header{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+};
+constexpr size_t dirent64_name_offset{offsetof(dirent64_header, d_type) + 1};
+
+
+//Como openat2, se llama directamente: glibc solo trae envoltorio desde la version 2.30
+long sys_getdents64(int fd, char* buffer, size_t size){
+  return syscall(SYS_getdents64, fd, buffer, size);
+}
+
+
+struct directory_entry{
+  bool directory{false};
+  size_t size{0};
+  time_t mtime{0};
+
+  bool operator==(const directory_entry&) const = default;
+};
+
+//Ordenadas por nombre, que es el orden del listado
+using directory_entries = std::map<std::string, directory_entry, std::less<>>;
+
+
+enum class listing_format{
+  html,
+  json,
+  //Una linea por entrada, para las peticiones simples
+  text,
+};
+constexpr size_t listing_formats{3};
+
+
+//Listado ya generado, compartido con la cache como los cuerpos comprimidos
+struct directory_listing{
+  std::shared_ptr<const std::string> body;
+  //Con comillas, listo para la cabecera. Es el de la cache y vale hasta la siguiente llamada a get
+  std::string_view etag;
+};
+
+
+//Los ficheros ocultos (.htpasswd, .git...) no aparecen en los listados, aunque se puedan pedir
+bool hidden_entry(std::string_view name){
+  return name.starts_with('.');
+}
+
+
+void append_html_escaped(std::string& out, std::string_view text){
+  for(char c : text){
+    switch(c){
+      case '&': out.append("&amp;"); break;
+      case '<': out.append("&lt;"); break;
+      case '>': out.append("&gt;"); break;
+      case '"': out.append("&quot;"); break;
+      case '\'': out.append("&#39;"); break;
+      default: out.push_back(c);
+    }
+  }
+}
+
+
+//Codifica como %XX todo lo que no sea un caracter no reservado (RFC 3986, 2.3), para usar
+//un nombre de fichero como segmento de una URL
+void append_url_encoded(std::string& out, std::string_view text){
+  constexpr std::string_view hex{"0123456789ABCDEF"};
+  for(char c : text){
+    auto byte = static_cast<unsigned char>(c);
+    if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') out.push_back(c);
+    else{
+      out.push_back('%');
+      out.push_back(hex[byte >> 4]);
+      out.push_back(hex[byte & 0xF]);
+    }
+  }
+}
+
+
+void append_json_escaped(std::string& out, std::string_view text){
+  for(char c : text){
+    auto byte = static_cast<unsigned char>(c);
+    if(c == '"' || c == '\\'){
+      out.push_back('\\');
+      out.push_back(c);
+    }
+    else if(byte < 0x20) out.append(std::format("\\u{0:04x}", byte));
+    else out.push_back(c);
+  }
+}
+
+
+//Genera el listado del directorio relative (de canonical_path) en el formato indicado. Los
+//directorios van primero y todos por orden de nombre
+std::string render_listing(std::string_view relative, const directory_entries& entries, listing_format format){
+  std::string path = relative.empty() ? std::string("/") : std::format("/{0}/", relative);
+  std::string out;
+  out.reserve(entries.size() * (format == listing_format::html ? 192 : 96) + 512);
+  auto each = [&](auto&& visit){
+    for(bool directories : {true, false}){
+      for(const auto& [name, entry] : entries){
+        if(entry.directory == directories) visit(name, entry);
+      }
+    }
+  };
+
+  if(format == listing_format::text){
+    each([&](const std::string& name, const directory_entry& entry){
+      out.append(name).append(entry.directory ? "/\n" : "\n");
+    });
+  }
+  else if(format == listing_format::json){
+    out.append("{\"path\":\"");
+    append_json_escaped(out, path);
+    out.append("\",\"entries\":[");
+    bool first{true};
+    each([&](const std::string& name, const directory_entry& entry){
+      out.append(first ? "{\"name\":\"" : ",{\"name\":\"");
+      first = false;
+      append_json_escaped(out, name);
+      out.append(entry.directory ? "\",\"type\":\"directory\",\"size\":" : "\",\"type\":\"file\",\"size\":");
+      out.append(std::to_string(entry.size)).append(",\"mtime\":").append(std::to_string(entry.mtime)).append("}");
+    });
+    out.append("]}\n");
+  }
+  else{
+    out.append("<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ");
+    append_html_escaped(out, path);
+    out.append("</title></head>\n<body><h1>Index of ");
+    append_html_escaped(out, path);
+    out.append("</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Last modified</th></tr>\n");
+    if(!relative.empty()) out.append("<tr><td><a href=\"../\">../</a></td><td>-</td><td></td></tr>\n");
+    each([&](const std::string& name, const directory_entry& entry){
+      out.append("<tr><td><a href=\"");
+      append_url_encoded(out, name);
+      out.append(entry.directory ? "/\">" : "\">");
+      append_html_escaped(out, name);
+      out.append(entry.directory ? "/</a></td><td>-" : "</a></td><td>");
+      if(!entry.directory) out.append(std::to_string(entry.size));
+      out.append("</td><td>").append(http_date(entry.mtime)).append("</td></tr>\n");
+    });
+    out.append("</table>\n</body></html>\n");
+  }
+  return out;
+}
+
+
+//Cache LRU de listados de directorio por ruta. Cada directorio se lee una vez con getdents64
+//(con un stat por entrada) y despues se vigila con inotify: cada evento actualiza solo la
+//entrada afectada, asi que un directorio con cientos de miles de ficheros no se vuelve a leer
+//entero cuando cambia uno. Los listados se generan al pedirlos y se guardan hasta el
+//siguiente cambio. Los eventos se recogen, sin bloquear, al principio de cada get. Si no se
+//puede usar inotify, cada get compara la fecha de modificacion del directorio, que cambia al
+//crear, borrar o renombrar entradas pero no cuando cambia el contenido de un fichero
+class DirectoryCache{
+ public:
+  DirectoryCache(const PathResolver& resolver, size_t max_directories)
+      : resolver_{resolver}, max_directories_{std::max<size_t>(max_directories, 1)}, inotify_{inotify_init1(IN_NONBLOCK | IN_CLOEXEC)} {}
+
+  DirectoryCache(const DirectoryCache&) = delete;
+  DirectoryCache& operator=(const DirectoryCache&) = delete;
+
+  //relative viene de canonical_path. Falla con el errno de abrir o leer el directorio. Un
+  //listado ya generado se devuelve sin reservar memoria
+  std::expected<directory_listing, int> get(std::string_view relative, listing_format format){
+    apply_events();
+    auto it = directories_.find(relative);
+    if(it != directories_.end() && !current(it->first, it->second)){
+      remove(it);
+      it = directories_.end();
+    }
+    if(it == directories_.end()){
+      std::string key(relative);
+      std::expected<node, int> loaded = load(key);
+      if(!loaded) return std::unexpected(loaded.error());
+      while(directories_.size() >= max_directories_) remove(directories_.find(lru_.back()));
+      lru_.push_front(key);
+      loaded.value().position = lru_.begin();
+      it = directories_.emplace(std::move(key), std::move(loaded.value())).first;
+    }
+    else lru_.splice(lru_.begin(), lru_, it->second.position);
+
+    node& cached = it->second;
+    auto index = static_cast<size_t>(format);
+    if(!cached.bodies[index]){
+      std::string body = render_listing(relative, cached.entries, format);
+      cached.etags[index] = std::format("\"{0:x}-{1:x}\"", std::hash<std::string_view>{}(body), body.size());
+      cached.bodies[index] = std::make_shared<const std::string>(std::move(body));
+    }
+    return directory_listing{cached.bodies[index], cached.etags[index]};
+  }
+
+ private:
+  struct node{
+    directory_entries entries;
+    std::list<std::string>::iterator position;
+    //Vigilancia de inotify (-1 si no la hay) y fecha de modificacion del directorio al leerlo
+    int watch{-1};
+    timespec mtime{};
+    //Se han perdido eventos o el directorio se ha borrado o movido: hay que volver a leerlo
+    bool stale{false};
+    std::array<std::shared_ptr<const std::string>, listing_formats> bodies;
+    std::array<std::string, listing_formats> etags;
+  };
+
+  static constexpr uint32_t watch_events{IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE
+                                         | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR};
+
+  static std::string entry_path(const std::string& relative, std::string_view name){
+    return relative.empty() ? std::string(name) : std::format("{0}/{1}", relative, name);
+  }
+
+  static void fill_entry(const struct stat& entry_stat, directory_entry& entry){
+    entry.directory = S_ISDIR(entry_stat.st_mode);
+    entry.size = entry.directory ? 0 : static_cast<size_t>(entry_stat.st_size);
+    entry.mtime = entry_stat.st_mtim.tv_sec;
+  }
+
+  bool current(const std::string& relative, const node& cached) const{
+    if(cached.stale) return false;
+    if(cached.watch >= 0) return true;
+    struct stat dir_stat;
+    if(resolver_.stat(relative, dir_stat) != EXIT_SUCCESS) return false;
+    return dir_stat.st_mtim.tv_sec == cached.mtime.tv_sec && dir_stat.st_mtim.tv_nsec == cached.mtime.tv_nsec;
+  }
+
+  std::expected<node, int> load(const std::string& relative){
+    std::expected<SafeFD, int> dir = resolver_.open(relative, O_RDONLY | O_DIRECTORY);
+    if(!dir) return std::unexpected(dir.error());
+    node loaded;
+    struct stat dir_stat;
+    if(fstat(dir.value().get(), &dir_stat) < 0) return std::unexpected(errno);
+    loaded.mtime = dir_stat.st_mtim;
+    //La vigilancia empieza antes de leer: lo que cambie durante la lectura llega como evento.
+    //Se vigila el directorio ya abierto, no la ruta, que podria haber cambiado
+    if(inotify_.is_valid()){
+      std::string proc_path = std::format("/proc/self/fd/{0}", dir.value().get());
+      loaded.watch = inotify_add_watch(inotify_.get(), proc_path.c_str(), watch_events);
+      if(loaded.watch >= 0) watches_.emplace(loaded.watch, relative);
+    }
+    int result = read_entries(dir.value(), loaded.entries);
+    if(result != EXIT_SUCCESS){
+      unwatch(loaded.watch, relative);
+      return std::unexpected(result);
+    }
+    return loaded;
+  }
+
+  //Lee todas las entradas con getdents64 y un buffer grande, para pocas llamadas al sistema
+  //aunque el directorio sea enorme. Las que no se pueden consultar (p.ej. enlaces rotos) se
+  //omiten, ya que tampoco se podrian servir
+  int read_entries(const SafeFD& dir, directory_entries& entries){
+    std::vector<char> buffer(1 << 18);
+    while(true){
+      long size = sys_getdents64(dir.get(), buffer.data(), buffer.size());
+      if(size < 0){
+        if(errno == EINTR) continue;
+        return errno;
+      }
+      if(size == 0) return EXIT_SUCCESS;
+      for(size_t pos = 0; pos < static_cast<size_t>(size);){
+        dirent64_header header;
+        std::memcpy(&header, buffer.data() + pos, sizeof(header));
+        const char* name = buffer.data() + pos + dirent64_name_offset;
+        pos += header.d_reclen;
+        if(hidden_entry(name)) continue;
+        struct stat entry_stat;
+        if(fstatat(dir.get(), name, &entry_stat, 0) < 0) continue;
+        fill_entry(entry_stat, entries[name]);
+      }
+    }
+  }
+
+  void apply_events(){
+    if(!inotify_.is_valid()) return;
+    alignas(inotify_event) std::array<char, 1 << 16> buffer;
+    while(true){
+      ssize_t size = read(inotify_.get(), buffer.data(), buffer.size());
+      if(size < 0 && errno == EINTR) continue;
+      if(size <= 0) return;
+      for(size_t pos = 0; pos < static_cast<size_t>(size);){
+        inotify_event event;
+        std::memcpy(&event, buffer.data() + pos, sizeof(event));
+        //El nombre va relleno con nulos hasta len bytes
+        std::string_view name = event.len > 0 ? std::string_view(buffer.data() + pos + sizeof(event)) : std::string_view();
+        pos += sizeof(event) + event.len;
+        apply_event(event.wd, event.mask, name);
+      }
+    }
+  }
+
+  void apply_event(int watch, uint32_t mask, std::string_view name){
+    if(mask & IN_Q_OVERFLOW){
+      for(auto& [path, cached] : directories_) cached.stale = true;
+      return;
+    }
+    //El mismo directorio puede estar en la cache con varias rutas si se llega por un enlace
+    auto [first, last] = watches_.equal_range(watch);
+    for(auto it = first; it != last; ++it){
+      auto found = directories_.find(it->second);
+      if(found == directories_.end()) continue;
+      node& cached = found->second;
+      if(mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) cached.stale = true;
+      else if(!name.empty() && !hidden_entry(name)) update_entry(found->first, cached, name);
+    }
+  }
+
+  //Vuelve a consultar una sola entrada: si ya no existe se quita del listado
+  void update_entry(const std::string& relative, node& cached, std::string_view name){
+    struct stat entry_stat;
+    auto it = cached.entries.find(name);
+    if(resolver_.stat(entry_path(relative, name), entry_stat) != EXIT_SUCCESS){
+      if(it == cached.entries.end()) return;
+      cached.entries.erase(it);
+    }
+    else{
+      directory_entry entry;
+      fill_entry(entry_stat, entry);
+      if(it != cached.entries.end() && it->second == entry) return;
+      cached.entries.insert_or_assign(std::string(name), entry);
+    }
+    for(auto& body : cached.bodies) body.reset();
+  }
+
+  void unwatch(int watch, const std::string& relative){
+    if(watch < 0) return;
+    auto [first, last] = watches_.equal_range(watch);
+    for(auto it = first; it != last; ++it){
+      if(it->second == relative){
+        watches_.erase(it);
+        break;
+      }
+    }
+    //Tras IN_IGNORED la vigilancia ya no existe y esto falla sin consecuencias
+    if(!watches_.contains(watch)) inotify_rm_watch(inotify_.get(), watch);
+  }
+
+  void remove(string_map<node>::iterator it){
+    unwatch(it->second.watch, it->first);
+    lru_.erase(it->second.position);
+    directories_.erase(it);
+  }
+
+  const PathResolver& resolver_;
+  size_t max_directories_;
+  SafeFD inotify_;
+  std::list<std::string> lru_;
+  string_map<node> directories_;
+  std::unordered_multimap<int, std::string> watches_;
+};
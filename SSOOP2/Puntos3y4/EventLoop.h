@@ -0,0 +1,738 @@
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <string_view>
+#include <expected>
+#include <functional>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <cerrno>
+#include <cstring>
+
+#include "SafeFD.h"
+#include "SafeMap.h"
+#include "Socket.h"
+#include "FileCache.h"
+#include "Http.h"
+#include "HttpParser.h"
+#include "Metrics.h"
+#include "AccessLog.h"
+#include "ClientLimits.h"
+#include "Tls.h"
+#include "Arena.h"
+#include "FsPool.h"
+
+
+//Lo activa SIGTERM en un trabajador: deja de aceptar conexiones, termina las respuestas en
+//curso sin mantener las conexiones abiertas y sale cuando no queda ninguna o vence drain_timeout
+std::atomic<bool> stop_serving{false};
+
+
+//Trozo del fichero que se envia en una respuesta: prefix (desde memoria) seguido de length
+//bytes del fichero a partir de offset
+struct body_segment{
+  std::string_view prefix;
+  size_t offset{0};
+  size_t length{0};
+};
+
+
+//Rango pedido con Range. En una respuesta multipart/byteranges prefix lleva el separador y
+//las cabeceras de la parte, en la arena de la respuesta; el separador final va en un ultimo
+//rango de longitud 0
+struct file_range{
+  size_t offset{0};
+  size_t length{0};
+  std::pmr::string prefix;
+};
+
+
+//Respuesta preparada para un cliente: la cabecera y el cuerpo, que puede venir de un
+//fichero de la cache (se envia con sendfile o desde su proyeccion en memoria), de un
+//buffer generado o de la salida de un programa en ejecucion. Las cadenas temporales de la
+//respuesta se reservan en arena, que se vacia con clear
+struct response{
+  std::string header;
+  std::shared_ptr<const file_entry> file;
+  std::string buffer;
+  //Cuerpo compartido con una cache: una variante comprimida o un listado de directorio
+  std::shared_ptr<const std::string> shared_body;
+  //Cuerpo dentro del archivo de contenido, que esta proyectado mientras viva el trabajador
+  std::string_view archived;
+  //Salida del programa child, que se reenvia con splice hasta EOF. Como su longitud no se
+  //conoce de antemano la conexion se cierra al terminar. Si sigue en marcha pasado deadline
+  //se mata su grupo de procesos; started es cuando se lanzo
+  SafeFD pipe;
+  pid_t child{-1};
+  std::chrono::steady_clock::time_point deadline;
+  std::chrono::steady_clock::time_point started;
+  //Mantener la conexion abierta para la siguiente peticion tras enviar esta
+  bool keep_alive{false};
+  //La peticion traia datos que no se leen (un cuerpo): se descartan antes de cerrar
+  bool discard_input{false};
+  //Codigo de estado, para las metricas y el registro de accesos
+  uint16_t status{0};
+  //Arena de la conexion (ver BufferPool), o nada para reservar en el heap. Va antes que
+  //ranges, que puede tener memoria suya
+  std::unique_ptr<RequestArena> arena;
+  //Partes del fichero que se envian (206); vacio para enviarlo entero
+  std::vector<file_range> ranges;
+
+  [[nodiscard]] std::pmr::memory_resource* memory() const noexcept{
+    return arena ? arena->resource() : std::pmr::get_default_resource();
+  }
+
+  //Los rangos se envian siempre desde el descriptor, aunque el fichero este proyectado
+  [[nodiscard]] bool use_sendfile() const noexcept{
+    return file && (file->map.get().empty() || !ranges.empty());
+  }
+
+  [[nodiscard]] size_t segment_count() const noexcept{
+    return ranges.empty() ? 1 : ranges.size();
+  }
+
+  [[nodiscard]] body_segment segment(size_t i) const noexcept{
+    if(ranges.empty()) return body_segment{{}, 0, file->size};
+    return body_segment{ranges[i].prefix, ranges[i].offset, ranges[i].length};
+  }
+
+  //Bytes del cuerpo que se envia desde el fichero, contando los prefijos de las partes
+  [[nodiscard]] size_t file_body_size() const noexcept{
+    size_t size{0};
+    for(size_t i = 0; i < segment_count(); i++){
+      body_segment part = segment(i);
+      size += part.prefix.size() + part.length;
+    }
+    return size;
+  }
+
+  //El cuerpo no esta en memoria y se envia despues de la cabecera
+  [[nodiscard]] bool body_follows() const noexcept{
+    return use_sendfile() || pipe.is_valid();
+  }
+
+  [[nodiscard]] std::string_view body() const noexcept{
+    //Con rangos el fichero se envia desde el descriptor aunque este proyectado
+    if(file) return ranges.empty() ? file->map.get() : std::string_view();
+    if(shared_body) return *shared_body;
+    if(archived.data() != nullptr) return archived;
+    return buffer;
+  }
+
+  //Deja la respuesta vacia conservando la memoria de header, buffer y ranges para la
+  //siguiente y vacia la arena: lo que se reservo en ella ya no se usa
+  void clear() noexcept{
+    header.clear();
+    file.reset();
+    buffer.clear();
+    shared_body.reset();
+    archived = {};
+    pipe = SafeFD();
+    child = -1;
+    keep_alive = false;
+    discard_input = false;
+    status = 0;
+    ranges.clear();
+    if(arena) arena->reset();
+  }
+};
+
+
+//Estados por los que pasa cada conexion dentro del bucle de eventos
+enum class connection_state{
+  //Solo con TLS, antes de la primera peticion
+  handshake,
+  reading_request,
+  //El manejador espera a que la reserva de hilos de fs cargue un fichero; la peticion sigue
+  //en el buffer y se vuelve a atender al reanudar la conexion
+  waiting_file,
+  writing_header,
+  writing_body,
+  done,
+};
+
+
+struct event_loop_options{
+  //Tamano maximo de la linea de peticion mas las cabeceras
+  size_t max_header_size{8192};
+  //Tiempo que una conexion persistente puede esperar la siguiente peticion
+  std::chrono::seconds idle_timeout{5};
+  //Peticiones que se atienden como mucho en una misma conexion
+  size_t max_requests{100};
+  //Tiempo maximo para recibir entera una peticion ya empezada
+  std::chrono::seconds request_timeout{10};
+  //Tiempo maximo sin que el cliente acepte datos de la respuesta
+  std::chrono::seconds send_timeout{30};
+  //Tiempo maximo para terminar las respuestas en curso tras SIGTERM
+  std::chrono::seconds drain_timeout{10};
+  bool verbose{false};
+  //Con un contexto TLS todas las conexiones empiezan con un handshake; el plazo para
+  //terminarlo es request_timeout
+  const TlsContext* tls{nullptr};
+  //Reserva de hilos de fs del manejador, si la hay: el bucle vigila su notifier y reanuda las
+  //conexiones que quedan en waiting_file
+  FsPool* fs_pool{nullptr};
+};
+
+
+//Buffers de conexiones cerradas que guarda cada trabajador (ver BufferPool) y capacidad a
+//partir de la cual se liberan en vez de guardarse
+constexpr size_t pooled_buffers{1024};
+constexpr size_t pooled_buffer_capacity{64 * 1024};
+
+
+struct connection{
+  SafeFD fd;
+  //Sesion TLS sobre fd, o nullptr. Se destruye antes que fd para poder enviar close_notify
+  std::unique_ptr<TlsSession> tls;
+  sockaddr_storage client_addr{};
+  connection_state state{connection_state::reading_request};
+  //Puede contener varias peticiones encadenadas (pipelining); parser avanza por la primera
+  std::string request;
+  HttpParser parser;
+  response resp;
+  size_t sent{0};
+  //Trozo del fichero que se esta enviando (ver response::segment)
+  size_t part{0};
+  size_t served{0};
+  //El cliente ha cerrado su extremo: se atiende lo que quede en el buffer y se cierra
+  bool closing{false};
+  //La peticion en curso ya ha esperado en waiting_file: al volver a analizarla no se cuenta otra vez
+  bool deferred{false};
+  std::chrono::steady_clock::time_point last_active;
+  //Cuando llego el primer byte de la peticion en curso
+  std::chrono::steady_clock::time_point request_started;
+  //Tuberia de resp registrada en epoll, o -1
+  int watched_pipe{-1};
+  //Cuando se completo el analisis de la peticion en curso y cuando se empezo a enviar su respuesta
+  std::chrono::steady_clock::time_point parsed_at;
+  std::chrono::steady_clock::time_point sending_at;
+  //Entrada del registro de accesos de la peticion en curso; la ruta se copia al analizarla
+  access_entry log_entry;
+  //Cuenta la conexion en los limites del trabajador mientras exista
+  connection_permit permit;
+};
+
+
+//Los nodos salen de un pool del trabajador, que los reutiliza al cerrar y abrir conexiones
+using connection_map = std::pmr::unordered_map<int, connection>;
+//Tuberias de salida de programas registradas en epoll y la conexion a la que pertenecen
+using pipe_map = std::unordered_map<int, int>;
+
+
+//Da a una conexion nueva los buffers y la arena de una ya cerrada, si los hay
+void equip_connection(connection& conn, BufferPool& buffers){
+  conn.request = buffers.take_string();
+  conn.resp.header = buffers.take_string();
+  conn.resp.buffer = buffers.take_string();
+  conn.resp.arena = buffers.take_arena();
+}
+
+
+//Guarda los buffers y la arena de una conexion que se cierra para las siguientes
+void recycle_connection(connection& conn, BufferPool& buffers){
+  if(conn.resp.discard_input) discard_unread(conn.fd);
+  conn.resp.clear();
+  buffers.give(std::move(conn.request));
+  buffers.give(std::move(conn.resp.header));
+  buffers.give(std::move(conn.resp.buffer));
+  buffers.give(std::move(conn.resp.arena));
+}
+
+
+//Lo que recibe el manejador de peticiones. Si status no es complete la peticion no es
+//valida y sus campos estan vacios. Si keep_alive_allowed es false la respuesta no debe
+//mantener la conexion. connection identifica la conexion para reanudarla (ver FsPool), o es
+//-1 si el motor no lo admite; resumed indica que la peticion ya ha esperado una vez
+struct request_context{
+  parse_status status;
+  const http_request& request;
+  const sockaddr_storage& client_addr;
+  bool keep_alive_allowed;
+  int connection{-1};
+  bool resumed{false};
+};
+
+
+//Rellena resp (vacia) a partir de la peticion. Un error indica un fallo inesperado del
+//servidor; una cabecera vacia indica que no hay nada que enviar al cliente. EINPROGRESS
+//indica que la respuesta depende de una tarea de la reserva de hilos de fs, al final de la
+//cual se reanuda la conexion para volver a atender la peticion
+using request_handler = std::function<std::expected<void, int>(const request_context& context, response& resp)>;
+
+
+std::expected<SafeFD, int> make_epoll(){
+  int fd = epoll_create1(EPOLL_CLOEXEC);
+  if(fd < 0) return std::unexpected(errno);
+  return SafeFD(fd);
+}
+
+
+int epoll_add(const SafeFD& epoll, int fd, uint32_t events){
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if(epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &event) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Analiza lo que ya hay en el buffer de la conexion. Devuelve incomplete si faltan datos
+std::expected<parse_status, int> parse_buffered(connection& conn, http_request& request, worker_metrics& metrics){
+  //Sin nada pendiente un cierre del cliente no es un error de la peticion
+  if(conn.closing && conn.request.empty()) return std::unexpected(ECONNRESET);
+  auto start = std::chrono::steady_clock::now();
+  parse_status status = conn.parser.parse(conn.request, request, conn.closing);
+  if(status != parse_status::incomplete && !conn.deferred){
+    conn.parsed_at = std::chrono::steady_clock::now();
+    metrics.parse.record(conn.parsed_at - start);
+  }
+  return status;
+}
+
+
+//Lee del socket y analiza hasta tener una peticion completa en el buffer (o hasta EAGAIN,
+//en modo edge-triggered). Devuelve incomplete si hay que esperar mas datos
+std::expected<parse_status, int> read_request(connection& conn, http_request& request, worker_metrics& metrics){
+  char buffer[4096];
+  while(true){
+    std::expected<parse_status, int> status = parse_buffered(conn, request, metrics);
+    if(!status || status.value() != parse_status::incomplete) return status;
+
+    ssize_t size{0};
+    if(conn.tls){
+      std::expected<size_t, int> received = conn.tls->receive(buffer, sizeof(buffer));
+      if(!received && received.error() == EAGAIN) return parse_status::incomplete;
+      if(!received) return std::unexpected(received.error());
+      size = static_cast<ssize_t>(received.value());
+    }
+    else size = recv(conn.fd.get(), buffer, sizeof(buffer), 0);
+    if(size < 0){
+      if(errno == EAGAIN) return parse_status::incomplete;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    if(size == 0) conn.closing = true;
+    else{
+      if(conn.request.empty()) conn.request_started = std::chrono::steady_clock::now();
+      conn.request.append(buffer, static_cast<size_t>(size));
+    }
+  }
+}
+
+
+//Anota una respuesta ya enviada, de bytes en total, en las metricas y en el registro de accesos
+void record_response(connection& conn, worker_metrics& metrics, AccessLog* access_log, size_t bytes){
+  auto sent_at = std::chrono::steady_clock::now();
+  metrics.send.record(sent_at - conn.sending_at);
+  metrics.request.record(sent_at - conn.parsed_at);
+  if(access_log == nullptr) return;
+  access_entry& entry = conn.log_entry;
+  entry.time = std::chrono::system_clock::now();
+  entry.duration = std::chrono::duration_cast<std::chrono::microseconds>(sent_at - conn.parsed_at);
+  entry.bytes = bytes;
+  entry.client = client_address::from(conn.client_addr);
+  entry.status = conn.resp.status;
+  if(!access_log->push(entry)) metrics.access_log_dropped.add();
+}
+
+
+//Envia los trozos del fichero de resp desde el trozo part, del que ya se han enviado sent
+//bytes contando su prefijo. Devuelve true al terminar y false si el socket no admite mas
+//datos por ahora; part y sent indican entonces por donde seguir. tls es la sesion del socket, o nullptr
+std::expected<bool, int> send_file_segments(const SafeFD& socket, TlsSession* tls, const response& resp, size_t& part, size_t& sent){
+  for(; part < resp.segment_count(); part++, sent = 0){
+    body_segment segment = resp.segment(part);
+    if(sent < segment.prefix.size()){
+      //El prefijo se retiene con MSG_MORE salvo que sea lo ultimo de la respuesta
+      bool last = segment.length == 0 && part + 1 == resp.segment_count();
+      std::expected<bool, int> complete = send_vectored(socket, tls, segment.prefix, {}, sent, last ? 0 : MSG_MORE);
+      if(!complete || !complete.value()) return complete;
+    }
+    size_t offset = segment.offset + sent - segment.prefix.size();
+    std::expected<bool, int> complete = send_file_body(socket, tls, resp.file->fd, offset, segment.offset + segment.length);
+    sent = segment.prefix.size() + offset - segment.offset;
+    if(!complete || !complete.value()) return complete;
+  }
+  return true;
+}
+
+
+//Pasa la peticion ya analizada al manejador y la quita del buffer. La conexion queda en
+//writing_header con la respuesta preparada, en done si no hay nada que enviar o en
+//waiting_file, con la peticion aun en el buffer, si el manejador tiene que esperar
+std::expected<void, int> dispatch_request(connection& conn, parse_status status, const http_request& request, const event_loop_options& options,
+                                          worker_metrics& metrics, AccessLog* access_log, const request_handler& handler){
+  //Tras una peticion mal formada no se puede saber donde empieza la siguiente. Al cerrar el
+  //servidor cada conexion termina con la respuesta en curso
+  bool keep_alive_allowed = status == parse_status::complete && conn.served + 1 < options.max_requests
+                         && !stop_serving.load(std::memory_order_relaxed);
+  std::expected<void, int> handled = handler(request_context{status, request, conn.client_addr, keep_alive_allowed, conn.fd.get(), conn.deferred}, conn.resp);
+  if(!handled && handled.error() == EINPROGRESS){
+    conn.resp.clear();
+    conn.parser.reset();
+    conn.deferred = true;
+    conn.state = connection_state::waiting_file;
+    return {};
+  }
+  if(!handled) return std::unexpected(handled.error());
+  conn.deferred = false;
+  if(access_log != nullptr) conn.log_entry.set_path(request.target);
+  conn.request.erase(0, request.length);
+  conn.parser.reset();
+  conn.served++;
+  conn.sending_at = std::chrono::steady_clock::now();
+  //La siguiente peticion encadenada ya ha empezado a llegar
+  if(!conn.request.empty()) conn.request_started = conn.sending_at;
+  if(conn.resp.header.empty()){
+    metrics.request.record(conn.sending_at - conn.parsed_at);
+    conn.state = connection_state::done;
+    return {};
+  }
+  conn.state = connection_state::writing_header;
+  return {};
+}
+
+
+//Avanza la maquina de estados de la conexion todo lo posible sin bloquear, encadenando
+//las peticiones que ya esten en el buffer. Devuelve un error si hay que cerrar la conexion.
+//Sin access_log no se registran los accesos
+std::expected<void, int> process_connection(connection& conn, const event_loop_options& options, worker_metrics& metrics, AccessLog* access_log,
+                                            const request_handler& handler){
+  while(true){
+    if(conn.state == connection_state::handshake){
+      std::expected<bool, int> established = conn.tls->handshake();
+      if(!established){
+        //Clientes que no hablan TLS o no aceptan el certificado: no es un fallo del servidor
+        metrics.tls_failed_handshakes.add();
+        if(options.verbose) std::cerr << "TLS handshake failed: " << tls_error_string() << std::endl;
+        return std::unexpected(ECONNRESET);
+      }
+      if(!established.value()) return {};
+      metrics.tls_handshake.record(std::chrono::steady_clock::now() - conn.request_started);
+      metrics.tls_handshakes.add();
+      if(conn.tls->resumed()) metrics.tls_resumed.add();
+      if(conn.tls->kernel_send()) metrics.tls_kernel_send.add();
+      conn.state = connection_state::reading_request;
+    }
+    if(conn.state == connection_state::reading_request){
+      http_request request;
+      std::expected<parse_status, int> status = read_request(conn, request, metrics);
+      if(!status) return std::unexpected(status.error());
+      if(status.value() == parse_status::incomplete) return {};
+      std::expected<void, int> dispatched = dispatch_request(conn, status.value(), request, options, metrics, access_log, handler);
+      if(!dispatched) return dispatched;
+      if(conn.state == connection_state::done) return {};
+    }
+    //Sigue al reanudarla
+    if(conn.state == connection_state::waiting_file) return {};
+    if(conn.state == connection_state::writing_header){
+      //Un cuerpo en memoria sale junto a la cabecera en un solo sendmsg. Si va despues (por
+      //sendfile o splice), la cabecera se retiene con MSG_MORE para que comparta segmento
+      bool body_follows = conn.resp.body_follows();
+      std::expected<bool, int> complete = send_vectored(conn.fd, conn.tls.get(), conn.resp.header, body_follows ? std::string_view() : conn.resp.body(),
+                                                        conn.sent, body_follows ? MSG_MORE : 0);
+      if(!complete) return std::unexpected(complete.error());
+      if(!complete.value()) return {};
+      conn.sent = 0;
+      conn.state = connection_state::writing_body;
+    }
+    if(conn.state == connection_state::writing_body){
+      size_t body_bytes = conn.resp.body().size();
+      if(conn.resp.use_sendfile()){
+        std::expected<bool, int> complete = send_file_segments(conn.fd, conn.tls.get(), conn.resp, conn.part, conn.sent);
+        if(!complete) return std::unexpected(complete.error());
+        if(!complete.value()) return {};
+        conn.sent = 0;
+        conn.part = 0;
+        body_bytes = conn.resp.file_body_size();
+      }
+      else if(conn.resp.pipe.is_valid()){
+        std::expected<bool, int> complete = send_pipe_body(conn.fd, conn.tls.get(), conn.resp.pipe, conn.sent);
+        if(!complete) return std::unexpected(complete.error());
+        if(!complete.value()) return {};
+        body_bytes = conn.sent;
+        conn.sent = 0;
+        metrics.cgi.record(std::chrono::steady_clock::now() - conn.resp.started);
+      }
+      record_response(conn, metrics, access_log, conn.resp.header.size() + body_bytes);
+      if(!conn.resp.keep_alive){
+        conn.state = connection_state::done;
+        return {};
+      }
+      //Conexion persistente: vaciar la respuesta y pasar a la siguiente peticion
+      conn.resp.clear();
+      conn.state = connection_state::reading_request;
+    }
+  }
+}
+
+
+//Cierra la conexion, olvida su tuberia y guarda sus buffers en buffers; al cerrar los
+//descriptores el kernel los saca del epoll
+void close_connection(connection_map& connections, pipe_map& pipes, BufferPool& buffers, connection_map::iterator it){
+  if(it->second.watched_pipe >= 0) pipes.erase(it->second.watched_pipe);
+  recycle_connection(it->second, buffers);
+  connections.erase(it);
+}
+
+
+//Registra en epoll la tuberia de la respuesta en curso para enterarse de cuando el programa
+//escribe. Una respuesta con tuberia siempre cierra la conexion, asi que cada conexion
+//registra como mucho una
+void watch_pipe(const SafeFD& epoll, pipe_map& pipes, int client_fd, connection& conn){
+  if(!conn.resp.pipe.is_valid() || conn.watched_pipe >= 0) return;
+  int result = epoll_add(epoll, conn.resp.pipe.get(), EPOLLIN | EPOLLET);
+  if(result != EXIT_SUCCESS){
+    std::cerr << "Error registering pipe: " << std::strerror(result) << std::endl;
+    return;
+  }
+  conn.watched_pipe = conn.resp.pipe.get();
+  pipes[conn.watched_pipe] = client_fd;
+}
+
+
+//Plazos de una conexion: idle_timeout esperando una peticion nueva, request_timeout para
+//recibir entera una peticion ya empezada (un cliente que envia la cabecera byte a byte no
+//retiene la conexion indefinidamente) y send_timeout sin que acepte datos de la respuesta
+bool connection_expired(const connection& conn, const event_loop_options& options, std::chrono::steady_clock::time_point now){
+  if(conn.state == connection_state::handshake) return now - conn.request_started > options.request_timeout;
+  if(conn.state == connection_state::reading_request){
+    if(conn.request.empty()) return now - conn.last_active > options.idle_timeout;
+    return now - conn.request_started > options.request_timeout;
+  }
+  return conn.state != connection_state::done && now - conn.last_active > options.send_timeout;
+}
+
+
+//Respuesta inmediata, sin leer la peticion, a una conexion que supera los limites del trabajador
+void reject_connection(const SafeFD& socket, limit_exceeded reason){
+  static constexpr std::string_view server_busy{"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"};
+  static constexpr std::string_view client_busy{"HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n"};
+  std::string_view response = reason == limit_exceeded::server ? server_busy : client_busy;
+  //Cabe en el buffer de un socket recien aceptado. Leer lo que ya haya llegado de la
+  //peticion evita que al cerrar se envie un RST que puede descartar la respuesta
+  send(socket.get(), response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+  shutdown(socket.get(), SHUT_WR);
+  discard_unread(socket);
+}
+
+
+//Mata el programa de la respuesta, que ha superado su plazo. La respuesta ya ha empezado
+//como un 200 sin longitud, que terminaria limpiamente al cerrarse la tuberia: se anota como
+//504 y la conexion, que hay que cerrar, se cierra con un RST para que el cliente no tome
+//lo recibido por la respuesta entera
+void kill_program(connection& conn, worker_metrics& metrics, AccessLog* access_log){
+  kill(-conn.resp.child, SIGKILL);
+  conn.resp.child = -1;
+  conn.resp.status = 504;
+  metrics.cgi_timeouts.add();
+  size_t bytes = conn.state == connection_state::writing_body ? conn.resp.header.size() + conn.sent : conn.sent;
+  record_response(conn, metrics, access_log, bytes);
+  set_reset_on_close(conn.fd);
+}
+
+
+//Tareas periodicas: cerrar las conexiones que superan sus plazos (ver connection_expired),
+//matar los programas que superan el suyo (ver kill_program) y recoger los que ya han terminado
+void sweep_connections(connection_map& connections, pipe_map& pipes, BufferPool& buffers, const event_loop_options& options,
+                       worker_metrics& metrics, AccessLog* access_log){
+  auto now = std::chrono::steady_clock::now();
+  for(auto it = connections.begin(); it != connections.end();){
+    connection& conn = it->second;
+    if(conn.resp.child > 0 && now > conn.resp.deadline){
+      kill_program(conn, metrics, access_log);
+      auto killed = it++;
+      close_connection(connections, pipes, buffers, killed);
+      continue;
+    }
+    if(connection_expired(conn, options, now)){
+      if(conn.state != connection_state::reading_request) set_reset_on_close(conn.fd);
+      auto expired = it++;
+      close_connection(connections, pipes, buffers, expired);
+    }
+    else it++;
+  }
+  while(waitpid(-1, nullptr, WNOHANG) > 0){}
+}
+
+
+//Al cerrar el servidor: cierra las conexiones persistentes que esperan la siguiente peticion
+//sin haber recibido nada de ella. Las nuevas se atienden: su peticion puede no haberse leido aun
+void close_idle_connections(connection_map& connections, pipe_map& pipes, BufferPool& buffers){
+  for(auto it = connections.begin(); it != connections.end();){
+    if(it->second.state == connection_state::reading_request && it->second.served > 0 && it->second.request.empty()){
+      auto idle = it++;
+      close_connection(connections, pipes, buffers, idle);
+    }
+    else it++;
+  }
+}
+
+
+//Acepta todas las conexiones pendientes hasta EAGAIN y las registra en epoll con memoria de
+//buffers; las que superan los limites del trabajador se rechazan enseguida
+void accept_connections(const SafeFD& socket, const SafeFD& epoll, connection_map& connections, BufferPool& buffers, const event_loop_options& options,
+                        worker_metrics& metrics, ConnectionLimits& limits, std::chrono::steady_clock::time_point now){
+  while(true){
+    sockaddr_storage client_addr{};
+    auto start = std::chrono::steady_clock::now();
+    std::expected<SafeFD, int> new_fd = accept_connection(socket, client_addr, options.verbose, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(new_fd){
+      metrics.accept.record(std::chrono::steady_clock::now() - start);
+      metrics.connections.add();
+    }
+    else{
+      if(new_fd.error() != EAGAIN && new_fd.error() != EINTR){
+        std::cerr << "Error accepting connection: " << std::strerror(new_fd.error()) << std::endl;
+      }
+      if(new_fd.error() == EINTR) continue;
+      return;
+    }
+    std::expected<connection_permit, limit_exceeded> permit = limits.admit(client_key(client_addr));
+    if(!permit){
+      metrics.rejected_connections.add();
+      //Con TLS no se puede responder sin handshake: solo se cierra
+      if(options.tls == nullptr) reject_connection(new_fd.value(), permit.error());
+      continue;
+    }
+    int client_fd = new_fd.value().get();
+    int registered = epoll_add(epoll, client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    if(registered != EXIT_SUCCESS){
+      std::cerr << "Error registering connection: " << std::strerror(registered) << std::endl;
+      continue;
+    }
+    connection conn;
+    conn.fd = std::move(new_fd.value());
+    conn.client_addr = client_addr;
+    conn.parser = HttpParser(options.max_header_size);
+    conn.last_active = now;
+    conn.permit = std::move(permit.value());
+    if(options.tls != nullptr){
+      std::expected<std::unique_ptr<TlsSession>, int> session = options.tls->accept(conn.fd);
+      if(!session){
+        std::cerr << "Error creating TLS session: " << std::strerror(session.error()) << std::endl;
+        continue;
+      }
+      conn.tls = std::move(session.value());
+      conn.state = connection_state::handshake;
+      conn.request_started = now;
+    }
+    equip_connection(conn, buffers);
+    connections.insert_or_assign(client_fd, std::move(conn));
+  }
+}
+
+
+//Bucle de eventos con epoll en modo edge-triggered: un solo hilo atiende todas las
+//conexiones de todos los sockets de escucha sin bloquearse en ninguna y anota sus tiempos en
+//metrics y cada respuesta en access_log, si lo hay. La memoria de las conexiones se reutiliza
+//de unas a otras: en regimen estable atender peticiones no reserva memoria. Las conexiones que superan limits se
+//rechazan al aceptarlas. Las que esperan a la reserva de hilos de fs se reanudan cuando avisa. Tras stop_serving deja de vigilar los sockets y, cuando termina las
+//conexiones en curso (o vence drain_timeout), devuelve EXIT_SUCCESS; si no, solo retorna si
+//falla el propio epoll
+int run_event_loop(const std::vector<SafeFD>& sockets, const event_loop_options& options, worker_metrics& metrics, ConnectionLimits& limits,
+                   AccessLog* access_log, const request_handler& handler){
+  std::expected<SafeFD, int> epoll = make_epoll();
+  if(!epoll) return epoll.error();
+
+  for(const SafeFD& socket : sockets){
+    int result = set_nonblocking(socket);
+    if(result != EXIT_SUCCESS) return result;
+    result = epoll_add(epoll.value(), socket.get(), EPOLLIN | EPOLLET);
+    if(result != EXIT_SUCCESS) return result;
+  }
+  int fs_notifier = options.fs_pool != nullptr ? options.fs_pool->notifier() : -1;
+  if(fs_notifier >= 0){
+    int result = epoll_add(epoll.value(), fs_notifier, EPOLLIN | EPOLLET);
+    if(result != EXIT_SUCCESS) return result;
+  }
+
+  std::pmr::unsynchronized_pool_resource connection_memory;
+  BufferPool buffers(pooled_buffers, pooled_buffer_capacity);
+  connection_map connections(&connection_memory);
+  pipe_map pipes;
+  std::array<epoll_event, 256> events;
+  auto last_sweep = std::chrono::steady_clock::now();
+  bool draining{false};
+  std::chrono::steady_clock::time_point drain_deadline;
+
+  //Avanza la conexion y la cierra si ha terminado o ha fallado
+  auto advance = [&](connection_map::iterator it){
+    std::expected<void, int> processed = process_connection(it->second, options, metrics, access_log, handler);
+    if(!processed){
+      if(processed.error() != ECONNRESET && processed.error() != EPIPE){
+        std::cerr << "Error serving connection: " << std::strerror(processed.error()) << std::endl;
+      }
+      close_connection(connections, pipes, buffers, it);
+    }
+    else if(it->second.state == connection_state::done) close_connection(connections, pipes, buffers, it);
+    else watch_pipe(epoll.value(), pipes, it->first, it->second);
+  };
+
+  while(true){
+    //Despertar al menos una vez por segundo para las tareas periodicas
+    int ready = epoll_wait(epoll.value().get(), events.data(), static_cast<int>(events.size()), 1000);
+    if(ready < 0){
+      if(errno != EINTR) return errno;
+      ready = 0;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if(!draining && stop_serving.load()){
+      //Las conexiones que ya estan en la cola de los sockets tambien se atienden
+      draining = true;
+      drain_deadline = now + options.drain_timeout;
+      for(const SafeFD& socket : sockets){
+        accept_connections(socket, epoll.value(), connections, buffers, options, metrics, limits, now);
+        epoll_ctl(epoll.value().get(), EPOLL_CTL_DEL, socket.get(), nullptr);
+      }
+    }
+    if(draining){
+      close_idle_connections(connections, pipes, buffers);
+      if(connections.empty() || now > drain_deadline) return EXIT_SUCCESS;
+    }
+    if(now - last_sweep >= std::chrono::seconds(1)){
+      sweep_connections(connections, pipes, buffers, options, metrics, access_log);
+      last_sweep = now;
+    }
+    for(int i = 0; i < ready; i++){
+      int fd = events[static_cast<size_t>(i)].data.fd;
+
+      auto listener = std::ranges::find_if(sockets, [fd](const SafeFD& socket){ return socket.get() == fd; });
+      if(listener != sockets.end()){
+        if(!draining) accept_connections(*listener, epoll.value(), connections, buffers, options, metrics, limits, now);
+        continue;
+      }
+      if(fd == fs_notifier){
+        //Una conexion cerrada mientras esperaba puede haber dejado su descriptor a otra
+        options.fs_pool->drain([&](int client_fd){
+          auto it = connections.find(client_fd);
+          if(it == connections.end() || it->second.state != connection_state::waiting_file) return;
+          it->second.state = connection_state::reading_request;
+          it->second.last_active = now;
+          advance(it);
+        });
+        continue;
+      }
+
+      //Los eventos de una tuberia avanzan la conexion a la que pertenece
+      auto pipe = pipes.find(fd);
+      int client_fd = pipe != pipes.end() ? pipe->second : fd;
+      auto it = connections.find(client_fd);
+      if(it == connections.end()) continue;
+      it->second.last_active = now;
+      advance(it);
+    }
+  }
+}
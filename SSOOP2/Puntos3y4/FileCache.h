@@ -0,0 +1,203 @@
+#pragma once
+
+#include <chrono>
+#include <expected>
+#include <functional>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstdlib>
+
+#include "SafeFD.h"
+#include "SafeMap.h"
+#include "PathResolver.h"
+
+
+//Fichero abierto listo para servirse. El descriptor se envia con sendfile; map solo se
+//rellena cuando el servidor usa mmap. Los metadatos sirven para detectar cambios en disco.
+//Los validadores HTTP se calculan al abrirlo y se guardan ya formados como cabeceras, asi
+//que las peticiones condicionales no cuestan llamadas al sistema
+struct file_entry{
+  SafeFD fd;
+  SafeMap map;
+  size_t size{0};
+  dev_t device{0};
+  ino_t inode{0};
+  timespec mtime{};
+  //ETag y Last-Modified (sin el nombre de la cabecera)
+  std::string etag;
+  std::string last_modified;
+  //"ETag: ...\r\nLast-Modified: ...\r\n"
+  std::string validators;
+};
+
+
+struct file_cache_stats{
+  size_t hits{0};
+  size_t misses{0};
+  size_t evictions{0};
+  size_t invalidations{0};
+  //Aciertos de entradas negativas (ficheros que no existen o no se pueden servir)
+  size_t negative_hits{0};
+};
+
+
+//Cache LRU de ficheros abiertos por ruta con un presupuesto de memoria en bytes. Las entradas
+//se comparten con shared_ptr, asi que una respuesta en curso mantiene vivo el descriptor (y la
+//proyeccion) aunque la entrada se expulse. Una entrada se revalida con check (un stat) como
+//mucho una vez por intervalo valid; si cambia el inodo, el tamano o la fecha de modificacion
+//se descarta. Los fallos definitivos al cargar (p.ej. ENOENT) tambien se recuerdan durante
+//valid, asi que los 404 repetidos no llegan al sistema de ficheros. get busca y carga; find
+//y store permiten cargar en otro hilo (ver FsPool) y guardar despues el resultado
+class FileCache{
+ public:
+  using result = std::expected<std::shared_ptr<const file_entry>, int>;
+  using loader = std::function<std::expected<file_entry, int>(const std::string& path)>;
+  using checker = std::function<int(const std::string& path, struct stat& file_stat)>;
+
+  FileCache(size_t budget, size_t max_entries, std::chrono::milliseconds valid, loader load, checker check)
+      : budget_{budget}, max_entries_{max_entries}, valid_{valid}, load_{std::move(load)}, check_{std::move(check)} {}
+
+  FileCache(const FileCache&) = delete;
+  FileCache& operator=(const FileCache&) = delete;
+
+  //Un acierto no reserva memoria: path solo se copia al cargar el fichero
+  result get(std::string_view path){
+    std::optional<result> cached = find(path);
+    if(cached) return std::move(cached.value());
+    return load(path);
+  }
+
+  //El fichero o el error guardados, o nada si hay que cargarlo
+  std::optional<result> find(std::string_view path){
+    auto now = std::chrono::steady_clock::now();
+    auto it = entries_.find(path);
+    if(it != entries_.end()){
+      node& cached = it->second;
+      if(now - cached.checked < valid_ || unchanged(it->first, *cached.file)){
+        if(now - cached.checked >= valid_) cached.checked = now;
+        //Mover al frente de la lista LRU
+        lru_.splice(lru_.begin(), lru_, cached.position);
+        stats_.hits++;
+        return cached.file;
+      }
+      stats_.invalidations++;
+      remove(it);
+    }
+
+    auto missing = missing_.find(path);
+    if(missing != missing_.end() && now - missing->second.checked < valid_){
+      stats_.negative_hits++;
+      return std::unexpected(missing->second.error);
+    }
+    return std::nullopt;
+  }
+
+  //Hay una entrada de path, aunque haya que revalidarla
+  [[nodiscard]] bool contains(std::string_view path) const{
+    return entries_.find(path) != entries_.end() || missing_.find(path) != missing_.end();
+  }
+
+  //Carga path con el loader y guarda el resultado. Una ruta que ya faltaba se vuelve a
+  //probar con su clave, sin copiar path
+  result load(std::string_view path){
+    auto missing = missing_.find(path);
+    if(missing != missing_.end()) return store(path, load_(missing->first));
+    return store(path, load_(std::string(path)));
+  }
+
+  //Guarda lo que ha dado cargar path en lugar de lo que hubiera y lo devuelve. Si una ruta
+  //que ya faltaba sigue faltando solo se renueva la entrada, sin reservar memoria
+  result store(std::string_view path, std::expected<file_entry, int> loaded){
+    auto now = std::chrono::steady_clock::now();
+    stats_.misses++;
+    //Otra peticion puede haberlo cargado mientras tanto
+    auto cached = entries_.find(path);
+    if(cached != entries_.end()) remove(cached);
+    auto missing = missing_.find(path);
+    std::string key;
+    if(missing != missing_.end()){
+      if(!loaded && permanent(loaded.error())){
+        missing->second = negative_node{loaded.error(), now};
+        return std::unexpected(loaded.error());
+      }
+      key = std::move(missing_.extract(missing).key());
+    }
+    else key = path;
+    if(!loaded){
+      if(max_entries_ > 0 && permanent(loaded.error())){
+        //Sin orden LRU: al llenarse se olvidan todas
+        if(missing_.size() >= max_entries_) missing_.clear();
+        missing_.emplace(std::move(key), negative_node{loaded.error(), now});
+      }
+      return std::unexpected(loaded.error());
+    }
+    std::shared_ptr<const file_entry> file = std::make_shared<const file_entry>(std::move(loaded.value()));
+
+    //Los ficheros que no caben en el presupuesto se sirven sin guardarlos
+    size_t cost = file->size + key.size();
+    if(cost > budget_ || max_entries_ == 0) return file;
+    while(!lru_.empty() && (used_ + cost > budget_ || entries_.size() >= max_entries_)){
+      remove(entries_.find(lru_.back()));
+      stats_.evictions++;
+    }
+    lru_.push_front(key);
+    entries_.emplace(std::move(key), node{file, lru_.begin(), now});
+    used_ += cost;
+    return file;
+  }
+
+  [[nodiscard]] const file_cache_stats& stats() const noexcept{
+    return stats_;
+  }
+
+  [[nodiscard]] size_t used() const noexcept{
+    return used_;
+  }
+
+ private:
+  struct node{
+    std::shared_ptr<const file_entry> file;
+    std::list<std::string>::iterator position;
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  struct negative_node{
+    int error;
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  //Errores que se repetiran mientras no cambie el sistema de ficheros
+  static bool permanent(int error){
+    return error == ENOENT || error == ENOTDIR || error == EACCES || error == EXDEV || error == ELOOP || error == EISDIR;
+  }
+
+  bool unchanged(const std::string& path, const file_entry& file) const{
+    struct stat file_stat;
+    if(check_(path, file_stat) != EXIT_SUCCESS) return false;
+    return file_stat.st_dev == file.device && file_stat.st_ino == file.inode
+        && static_cast<size_t>(file_stat.st_size) == file.size
+        && file_stat.st_mtim.tv_sec == file.mtime.tv_sec && file_stat.st_mtim.tv_nsec == file.mtime.tv_nsec;
+  }
+
+  void remove(string_map<node>::iterator it){
+    used_ -= it->second.file->size + it->first.size();
+    lru_.erase(it->second.position);
+    entries_.erase(it);
+  }
+
+  size_t budget_;
+  size_t max_entries_;
+  std::chrono::milliseconds valid_;
+  loader load_;
+  checker check_;
+  size_t used_{0};
+  std::list<std::string> lru_;
+  string_map<node> entries_;
+  string_map<negative_node> missing_;
+  file_cache_stats stats_;
+};
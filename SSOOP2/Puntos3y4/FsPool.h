@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <cstdint>
+
+#include "SafeFD.h"
+#include "Metrics.h"
+
+
+//Reserva de hilos para las llamadas al sistema de ficheros que pueden bloquear (abrir un
+//fichero resolviendo su ruta, fstat, mmap, posix_fadvise...) fuera del hilo de red de un
+//trabajador. Cada hilo tiene su cola; submit las reparte por turno y un hilo sin trabajo
+//se lo quita a los demas. Al terminar una tarea se avisa por el eventfd notifier, que el
+//bucle de eventos vigila, y el hilo de red llama a drain, que ejecuta las finalizaciones
+//y reanuda las conexiones que esperaban. Como mucho hay max_pending tareas sin finalizar;
+//con la cola llena submit devuelve false y el llamante hace el trabajo el mismo. Las
+//tareas se reutilizan: con funciones que quepan en std::function sin reservar (dos punteros)
+//encargar trabajo no reserva memoria. Las metricas solo las escribe el hilo de red (en
+//submit y drain)
+class FsPool{
+ public:
+  using work = std::function<void()>;
+  //Se ejecuta en el hilo de red y anota en resumed las conexiones que se pueden reanudar
+  using completion = std::function<void(std::vector<int>& resumed)>;
+
+  static std::expected<std::unique_ptr<FsPool>, int> create(size_t threads, size_t max_pending, worker_metrics& metrics){
+    SafeFD notifier(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    if(!notifier.is_valid()) return std::unexpected(errno);
+    std::unique_ptr<FsPool> pool(new FsPool(threads, max_pending, metrics, std::move(notifier)));
+    for(size_t i = 0; i < threads; i++){
+      pool->threads_.emplace_back([raw = pool.get(), i]{
+        raw->work_loop(i);
+      });
+    }
+    return pool;
+  }
+
+  FsPool(const FsPool&) = delete;
+  FsPool& operator=(const FsPool&) = delete;
+
+  //Las tareas que sigan en cola se descartan sin ejecutar sus finalizaciones
+  ~FsPool(){
+    stopping_.store(true);
+    available_.release(static_cast<std::ptrdiff_t>(thread_count_));
+  }
+
+  [[nodiscard]] int notifier() const noexcept{
+    return notifier_.get();
+  }
+
+  //Veces que drain ha terminado. Lo que finaliza una llamada a drain deja de hacer falta al
+  //volver: para entonces ya se han reanudado todas las conexiones que lo esperaban
+  [[nodiscard]] uint64_t drained() const noexcept{
+    return drained_;
+  }
+
+  //Anota un trabajo que el llamante hace en el hilo de red sin haber pasado por submit
+  void count_inline(){
+    metrics_.fs_inline.add();
+  }
+
+  bool submit(work task_work, completion done){
+    if(pending_ >= max_pending_){
+      metrics_.fs_inline.add();
+      return false;
+    }
+    std::unique_ptr<fs_task> task;
+    if(spare_.empty()) task = std::make_unique<fs_task>();
+    else{
+      task = std::move(spare_.back());
+      spare_.pop_back();
+    }
+    task->run = std::move(task_work);
+    task->done = std::move(done);
+    task->queued = std::chrono::steady_clock::now();
+    fs_queue& queue = queues_[next_++ % thread_count_];
+    {
+      std::lock_guard lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    available_.release();
+    pending_++;
+    metrics_.fs_tasks.add();
+    metrics_.fs_queue_depth.set(pending_);
+    return true;
+  }
+
+  //Ejecuta las finalizaciones de las tareas terminadas y llama a resume con cada conexion
+  //que anoten. resume puede volver a llamar a submit
+  template <typename Resume>
+  void drain(Resume&& resume){
+    uint64_t count;
+    while(read(notifier_.get(), &count, sizeof(count)) < 0 && errno == EINTR){}
+    {
+      std::lock_guard lock(finished_mutex_);
+      finished_.swap(completed_);
+    }
+    for(std::unique_ptr<fs_task>& task : completed_){
+      metrics_.fs_wait.record(task->started - task->queued);
+      metrics_.fs_task.record(task->finished - task->started);
+      task->done(resumed_);
+      task->run = nullptr;
+      task->done = nullptr;
+      spare_.push_back(std::move(task));
+    }
+    pending_ -= completed_.size();
+    metrics_.fs_queue_depth.set(pending_);
+    completed_.clear();
+    for(int fd : resumed_) resume(fd);
+    resumed_.clear();
+    drained_++;
+  }
+
+ private:
+  struct fs_task{
+    work run;
+    completion done;
+    std::chrono::steady_clock::time_point queued;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+  };
+
+  //Cada cola en su linea de cache, para que los hilos no se estorben al tomar de la suya
+  struct alignas(64) fs_queue{
+    std::mutex mutex;
+    std::deque<std::unique_ptr<fs_task>> tasks;
+  };
+
+  FsPool(size_t threads, size_t max_pending, worker_metrics& metrics, SafeFD notifier)
+      : thread_count_{threads}, max_pending_{max_pending}, metrics_{metrics}, notifier_{std::move(notifier)}, queues_{new fs_queue[threads]} {
+    threads_.reserve(threads);
+  }
+
+  //La tarea mas antigua de la cola propia o, si esta vacia, la mas reciente de otra. Cada
+  //release de available_ corresponde a una tarea ya encolada, asi que quien lo ha adquirido
+  //encuentra alguna
+  std::unique_ptr<fs_task> take(size_t own){
+    for(size_t i = 0; i < thread_count_; i++){
+      fs_queue& queue = queues_[(own + i) % thread_count_];
+      std::lock_guard lock(queue.mutex);
+      if(queue.tasks.empty()) continue;
+      std::unique_ptr<fs_task> task;
+      if(i == 0){
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      else{
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      }
+      return task;
+    }
+    return nullptr;
+  }
+
+  void work_loop(size_t own){
+    //Las senales las atiende el hilo de red
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    while(true){
+      available_.acquire();
+      if(stopping_.load()) return;
+      std::unique_ptr<fs_task> task = take(own);
+      if(!task) continue;
+      task->started = std::chrono::steady_clock::now();
+      task->run();
+      task->finished = std::chrono::steady_clock::now();
+      {
+        std::lock_guard lock(finished_mutex_);
+        finished_.push_back(std::move(task));
+      }
+      uint64_t one{1};
+      while(write(notifier_.get(), &one, sizeof(one)) < 0 && errno == EINTR){}
+    }
+  }
+
+  size_t thread_count_;
+  size_t max_pending_;
+  worker_metrics& metrics_;
+  SafeFD notifier_;
+  std::unique_ptr<fs_queue[]> queues_;
+  std::counting_semaphore<> available_{0};
+  std::atomic<bool> stopping_{false};
+  std::mutex finished_mutex_;
+  std::vector<std::unique_ptr<fs_task>> finished_;
+  //Solo del hilo de red
+  std::vector<std::unique_ptr<fs_task>> completed_;
+  std::vector<std::unique_ptr<fs_task>> spare_;
+  std::vector<int> resumed_;
+  size_t pending_{0};
+  size_t next_{0};
+  uint64_t drained_{0};
+  //Los ultimos: se unen al destruirse, antes que las colas
+  std::vector<std::jthread> threads_;
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cctype>
+#include <charconv>
+#include <array>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <format>
+#include <initializer_list>
+#include <memory_resource>
+#include <optional>
+#include <unistd.h>
+
+
+//Compara sin distinguir mayusculas, como exige HTTP para los nombres de cabecera
+bool iequals(std::string_view a, std::string_view b){
+  if(a.size() != b.size()) return false;
+  for(size_t i = 0; i < a.size(); i++){
+    if(std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) return false;
+  }
+  return true;
+}
+
+
+//Tipo MIME segun la extension del fichero
+std::string_view content_type(std::string_view path){
+  static constexpr std::array<std::pair<std::string_view, std::string_view>, 14> types{{
+    {".html", "text/html; charset=utf-8"},
+    {".htm", "text/html; charset=utf-8"},
+    {".txt", "text/plain; charset=utf-8"},
+    {".sh", "text/plain; charset=utf-8"},
+    {".css", "text/css"},
+    {".js", "text/javascript"},
+    {".json", "application/json"},
+    {".xml", "application/xml"},
+    {".pdf", "application/pdf"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".svg", "image/svg+xml"},
+  }};
+  size_t dot = path.rfind('.');
+  if(dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos){
+    std::string_view extension = path.substr(dot);
+    for(const auto& [known, type] : types){
+      if(iequals(extension, known)) return type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+
+//Longitud de un cuerpo que se envia segun se genera: la respuesta no lleva Content-Length
+//y el final del cuerpo lo marca el cierre de la conexion
+constexpr size_t unknown_content_length{SIZE_MAX};
+
+
+//Escribe en header la cabecera de una respuesta HTTP. Se vacia y se rellena sin liberar su
+//memoria, asi que reutilizar el mismo string entre respuestas no reserva memoria nueva.
+//Sin content_type se omite la cabecera Content-Type (respuestas sin cuerpo). extra son
+//cabeceras adicionales ya formadas, cada una terminada en \r\n
+void build_http_header(std::string& header, std::string_view status, std::string_view content_type, size_t content_length, bool keep_alive,
+                       std::initializer_list<std::string_view> extra = {}){
+  header.clear();
+  header.append("HTTP/1.1 ").append(status).append("\r\n");
+  if(!content_type.empty()) header.append("Content-Type: ").append(content_type).append("\r\n");
+  if(content_length != unknown_content_length){
+    char length[24];
+    auto [end, ec] = std::to_chars(length, length + sizeof(length), content_length);
+    header.append("Content-Length: ").append(length, end).append("\r\n");
+  }
+  else keep_alive = false;
+  for(std::string_view line : extra) header.append(line);
+  header.append(keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+  header.append("\r\n");
+}
+
+
+//Rangos que se atienden como mucho en una peticion; con mas se envia el fichero entero
+constexpr size_t max_byte_ranges{16};
+
+
+//Rango de bytes [first, last] de un fichero, ya ajustado a su tamano
+struct byte_range{
+  size_t first{0};
+  size_t last{0};
+};
+
+
+enum class range_result{
+  //Sin Range o con uno que no se entiende: se envia el fichero entero
+  ignored,
+  satisfiable,
+  //Ningun rango cae dentro del fichero: 416
+  unsatisfiable,
+};
+
+
+//Analiza "Range: bytes=a-b, c-, -n" para un fichero de size bytes. Los rangos que se solapan
+//se juntan y quedan ordenados. Una cabecera mal formada se ignora, como permite RFC 9110, 14.2
+range_result parse_byte_ranges(std::string_view header, size_t size, std::array<byte_range, max_byte_ranges>& ranges, size_t& count){
+  count = 0;
+  if(header.size() < 6 || !iequals(header.substr(0, 6), "bytes=")) return range_result::ignored;
+  header.remove_prefix(6);
+  bool any{false};
+  while(!header.empty()){
+    size_t comma = header.find(',');
+    std::string_view spec = header.substr(0, comma);
+    header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+    while(!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) spec.remove_prefix(1);
+    while(!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) spec.remove_suffix(1);
+    if(spec.empty()) continue;
+
+    size_t dash = spec.find('-');
+    if(dash == std::string_view::npos) return range_result::ignored;
+    std::string_view first_str = spec.substr(0, dash);
+    std::string_view last_str = spec.substr(dash + 1);
+    size_t first{0};
+    size_t last{0};
+    if(first_str.empty()){
+      //Sufijo: los ultimos n bytes
+      size_t suffix{0};
+      auto [ptr, ec] = std::from_chars(last_str.begin(), last_str.end(), suffix);
+      if(ec != std::errc() || ptr != last_str.end() || last_str.empty()) return range_result::ignored;
+      any = true;
+      if(suffix == 0 || size == 0) continue;
+      first = size - std::min(suffix, size);
+      last = size - 1;
+    }
+    else{
+      auto [ptr, ec] = std::from_chars(first_str.begin(), first_str.end(), first);
+      if(ec != std::errc() || ptr != first_str.end()) return range_result::ignored;
+      last = SIZE_MAX;
+      if(!last_str.empty()){
+        auto [last_ptr, last_ec] = std::from_chars(last_str.begin(), last_str.end(), last);
+        if(last_ec != std::errc() || last_ptr != last_str.end() || last < first) return range_result::ignored;
+      }
+      any = true;
+      if(first >= size) continue;
+      last = std::min(last, size - 1);
+    }
+    if(count == ranges.size()) return range_result::ignored;
+    ranges[count++] = {first, last};
+  }
+  if(!any) return range_result::ignored;
+  if(count == 0) return range_result::unsatisfiable;
+
+  std::sort(ranges.begin(), ranges.begin() + static_cast<std::ptrdiff_t>(count), [](const byte_range& a, const byte_range& b){
+    return a.first < b.first;
+  });
+  size_t merged{0};
+  for(size_t i = 1; i < count; i++){
+    if(ranges[i].first <= ranges[merged].last) ranges[merged].last = std::max(ranges[merged].last, ranges[i].last);
+    else ranges[++merged] = ranges[i];
+  }
+  count = merged + 1;
+  return range_result::satisfiable;
+}
+
+
+//Separador de las partes de una respuesta multipart/byteranges, en memory. No tiene que ser
+//secreto, solo improbable dentro del fichero
+std::pmr::string make_boundary(std::pmr::memory_resource* memory){
+  static uint64_t state = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^ static_cast<uint64_t>(getpid());
+  //splitmix64
+  uint64_t z = (state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  z ^= z >> 31;
+  std::array<char, 16> hex;
+  static constexpr std::string_view digits{"0123456789abcdef"};
+  for(size_t i = 0; i < hex.size(); i++) hex[i] = digits[(z >> (4 * i)) & 0xf];
+  std::pmr::string boundary("docserver-", memory);
+  return boundary.append(hex.data(), hex.size());
+}
+
+
+constexpr std::array<std::string_view, 7> http_days{"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+constexpr std::array<std::string_view, 12> http_months{"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+
+//Fecha en el formato de HTTP (IMF-fixdate): "Sun, 06 Nov 1994 08:49:37 GMT". No usa
+//strftime() para no depender del locale
+std::string http_date(time_t time){
+  tm utc;
+  gmtime_r(&time, &utc);
+  char buffer[32];
+  auto two = [](char* out, int value){
+    out[0] = static_cast<char>('0' + value / 10);
+    out[1] = static_cast<char>('0' + value % 10);
+  };
+  std::string_view day = http_days[static_cast<size_t>(utc.tm_wday)];
+  std::string_view month = http_months[static_cast<size_t>(utc.tm_mon)];
+  std::copy(day.begin(), day.end(), buffer);
+  buffer[3] = ',';
+  buffer[4] = ' ';
+  two(buffer + 5, utc.tm_mday);
+  buffer[7] = ' ';
+  std::copy(month.begin(), month.end(), buffer + 8);
+  buffer[11] = ' ';
+  int year = utc.tm_year + 1900;
+  two(buffer + 12, year / 100);
+  two(buffer + 14, year % 100);
+  buffer[16] = ' ';
+  two(buffer + 17, utc.tm_hour);
+  buffer[19] = ':';
+  two(buffer + 20, utc.tm_min);
+  buffer[22] = ':';
+  two(buffer + 23, utc.tm_sec);
+  std::string_view gmt{" GMT"};
+  std::copy(gmt.begin(), gmt.end(), buffer + 25);
+  return std::string(buffer, 29);
+}
+
+
+//Interpreta una fecha IMF-fixdate. Los formatos obsoletos (RFC 850 y asctime) no se
+//aceptan: quien envia If-Modified-Since repite el Last-Modified que recibio
+std::optional<time_t> parse_http_date(std::string_view date){
+  if(date.size() != 29 || date.substr(25) != " GMT" || date[3] != ',') return std::nullopt;
+  auto number = [&](size_t offset, size_t length, int& value){
+    auto [ptr, ec] = std::from_chars(date.data() + offset, date.data() + offset + length, value);
+    return ec == std::errc() && ptr == date.data() + offset + length;
+  };
+  tm utc{};
+  auto month = std::find(http_months.begin(), http_months.end(), date.substr(8, 3));
+  if(month == http_months.end()) return std::nullopt;
+  utc.tm_mon = static_cast<int>(month - http_months.begin());
+  if(!number(5, 2, utc.tm_mday) || !number(12, 4, utc.tm_year) || !number(17, 2, utc.tm_hour) || !number(20, 2, utc.tm_min)
+     || !number(23, 2, utc.tm_sec)){
+    return std::nullopt;
+  }
+  utc.tm_year -= 1900;
+  return timegm(&utc);
+}
+
+
+//ETag fuerte a partir del inodo, el tamano y la fecha de modificacion con nanosegundos,
+//que cambian en cuanto se reescribe el fichero
+std::string make_etag(ino_t inode, size_t size, const timespec& mtime){
+  uint64_t nanoseconds = static_cast<uint64_t>(mtime.tv_sec) * 1000000000 + static_cast<uint64_t>(mtime.tv_nsec);
+  return std::format("\"{0:x}-{1:x}-{2:x}\"", inode, size, nanoseconds);
+}
+
+
+//Comprueba si etag esta en la lista de If-None-Match, con la comparacion debil que pide
+//RFC 9110, 13.1.2 (se ignora el prefijo W/). "*" coincide con cualquiera
+bool etag_matches(std::string_view list, std::string_view etag){
+  while(!list.empty()){
+    size_t comma = list.find(',');
+    std::string_view tag = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+    while(!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+    while(!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+    if(tag == "*") return true;
+    if(tag.starts_with("W/")) tag.remove_prefix(2);
+    if(tag == etag) return true;
+  }
+  return false;
+}
+
+
+//Comprueba si el cliente acepta la codificacion coding segun su Accept-Encoding. Una
+//codificacion con q=0 esta rechazada; "*" vale para las que no aparecen (RFC 9110, 12.5.3)
+bool accepts_encoding(std::string_view header, std::string_view coding){
+  bool wildcard{false};
+  while(!header.empty()){
+    size_t comma = header.find(',');
+    std::string_view item = header.substr(0, comma);
+    header = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+    size_t semicolon = item.find(';');
+    std::string_view name = item.substr(0, semicolon);
+    while(!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+    while(!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+
+    bool accepted{true};
+    if(semicolon != std::string_view::npos){
+      std::string_view parameter = item.substr(semicolon + 1);
+      while(!parameter.empty() && (parameter.front() == ' ' || parameter.front() == '\t')) parameter.remove_prefix(1);
+      //q=0, q=0.0, q=0.00 o q=0.000
+      if(parameter.starts_with("q=") || parameter.starts_with("Q=")){
+        std::string_view value = parameter.substr(2);
+        while(!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+        accepted = !(value.starts_with('0') && value.find_first_not_of("0.") == std::string_view::npos);
+      }
+    }
+    if(iequals(name, coding)) return accepted;
+    if(name == "*") wildcard = accepted;
+  }
+  return wildcard;
+}
+
+
+//Tipos que merece la pena comprimir: texto y formatos basados en texto
+bool compressible(std::string_view type){
+  return type.starts_with("text/") || type.starts_with("application/json") || type.starts_with("application/xml")
+      || type.starts_with("image/svg+xml");
+}
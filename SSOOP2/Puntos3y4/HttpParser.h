@@ -0,0 +1,221 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <algorithm>
+
+#include "Http.h"
+
+
+//Cabeceras que se guardan como mucho por peticion; con mas se responde 431
+constexpr size_t max_http_headers{32};
+
+
+struct http_header_field{
+  std::string_view name;
+  std::string_view value;
+};
+
+
+//Peticion ya analizada. Todas las vistas apuntan al buffer de la conexion, asi que solo
+//son validas hasta que este se modifique. version esta vacia en las peticiones simples
+//("GET /ruta"), que son el formato original del servidor
+struct http_request{
+  std::string_view method;
+  std::string_view target;
+  std::string_view version;
+  std::array<http_header_field, max_http_headers> headers;
+  size_t header_count{0};
+  //Bytes del buffer que ocupa la peticion completa
+  size_t length{0};
+
+  [[nodiscard]] bool is_http() const noexcept{
+    return !version.empty();
+  }
+
+  //Valor de la cabecera name, o vacio si no esta
+  [[nodiscard]] std::string_view header(std::string_view name) const noexcept{
+    for(size_t i = 0; i < header_count; i++){
+      if(iequals(headers[i].name, name)) return headers[i].value;
+    }
+    return {};
+  }
+
+  [[nodiscard]] bool has_header(std::string_view name) const noexcept{
+    for(size_t i = 0; i < header_count; i++){
+      if(iequals(headers[i].name, name)) return true;
+    }
+    return false;
+  }
+
+  //HTTP/1.1 mantiene la conexion salvo "Connection: close"; HTTP/1.0 solo con "keep-alive"
+  [[nodiscard]] bool keep_alive() const noexcept{
+    if(!is_http()) return false;
+    std::string_view connection = header("Connection");
+    if(version == "HTTP/1.0") return iequals(connection, "keep-alive");
+    return !iequals(connection, "close");
+  }
+};
+
+
+//Trozo del buffer de la conexion guardado como posicion, que sigue siendo valida aunque
+//el buffer se reubique
+struct buffer_span{
+  uint32_t offset{0};
+  uint32_t length{0};
+};
+
+
+//has_body es una peticion completa que anuncia un cuerpo (Transfer-Encoding o Content-Length
+//distinto de 0). El servidor no lee cuerpos: no se puede saber donde empieza la siguiente
+//peticion y hay que responder y cerrar, o el cuerpo se tomaria por otra peticion encadenada.
+//unsupported_version es una version HTTP bien formada que no es 1.0 ni 1.1
+enum class parse_status{
+  complete,
+  incomplete,
+  bad_request,
+  too_large,
+  has_body,
+  unsupported_version,
+};
+
+
+//Analizador incremental de peticiones. Se le pasa el buffer entero cada vez que llegan
+//bytes nuevos y continua donde lo dejo, sin volver a recorrer las lineas ya analizadas.
+//Guarda posiciones en vez de vistas y no reserva memoria dinamica
+class HttpParser{
+ public:
+  explicit HttpParser(size_t max_header_size = 8192) noexcept : max_header_size_{max_header_size} {}
+
+  //Con eof el cliente ya no enviara mas: una peticion simple sin salto de linea se da por completa
+  parse_status parse(std::string_view buffer, http_request& request, bool eof = false) noexcept{
+    while(true){
+      size_t end = buffer.find('\n', std::max(position_, scanned_));
+      if(end == std::string_view::npos){
+        if(buffer.size() > max_header_size_) return parse_status::too_large;
+        if(!eof || state_ != state::request_line || buffer.size() == position_){
+          scanned_ = buffer.size();
+          return eof ? parse_status::bad_request : parse_status::incomplete;
+        }
+        end = buffer.size();
+      }
+      if(end >= max_header_size_) return parse_status::too_large;
+
+      size_t next = std::min(end + 1, buffer.size());
+      std::string_view line = buffer.substr(position_, end - position_);
+      if(line.ends_with('\r')) line.remove_suffix(1);
+
+      if(state_ == state::request_line){
+        //Se toleran lineas vacias antes de la peticion (RFC 9112, 2.2)
+        if(line.empty()){
+          position_ = scanned_ = next;
+          continue;
+        }
+        if(!parse_request_line(buffer, line)) return parse_status::bad_request;
+        std::string_view version = view(buffer, version_);
+        if(version.length() > 0 && version != "HTTP/1.0" && version != "HTTP/1.1") return parse_status::unsupported_version;
+        position_ = scanned_ = next;
+        if(version_.length == 0) return finish(buffer, request, next);
+        state_ = state::headers;
+        continue;
+      }
+
+      if(line.empty()) return finish(buffer, request, next);
+      size_t colon = line.find(':');
+      if(colon == 0 || colon == std::string_view::npos) return parse_status::bad_request;
+      if(header_count_ == max_http_headers) return parse_status::too_large;
+      std::string_view value = line.substr(colon + 1);
+      while(!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+      while(!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+      headers_[header_count_++] = {make_span(buffer, line.substr(0, colon)), make_span(buffer, value)};
+      position_ = scanned_ = next;
+    }
+  }
+
+  //Prepara el analizador para la siguiente peticion de la misma conexion
+  void reset() noexcept{
+    *this = HttpParser(max_header_size_);
+  }
+
+ private:
+  enum class state{
+    request_line,
+    headers,
+  };
+
+  static buffer_span make_span(std::string_view buffer, std::string_view part) noexcept{
+    return {static_cast<uint32_t>(part.data() - buffer.data()), static_cast<uint32_t>(part.size())};
+  }
+
+  static std::string_view view(std::string_view buffer, buffer_span part) noexcept{
+    return buffer.substr(part.offset, part.length);
+  }
+
+  //METODO SP RUTA [SP VERSION]
+  bool parse_request_line(std::string_view buffer, std::string_view line) noexcept{
+    std::array<std::string_view, 3> tokens;
+    size_t count{0};
+    size_t pos{0};
+    while(pos < line.size()){
+      if(line[pos] == ' ' || line[pos] == '\t'){
+        pos++;
+        continue;
+      }
+      size_t end = line.find_first_of(" \t", pos);
+      if(end == std::string_view::npos) end = line.size();
+      if(count == tokens.size()) return false;
+      tokens[count++] = line.substr(pos, end - pos);
+      pos = end;
+    }
+    if(count < 2) return false;
+    //HTTP/<digito>.<digito> (RFC 9112, 2.3)
+    if(count == 3){
+      std::string_view version = tokens[2];
+      if(version.size() != 8 || !version.starts_with("HTTP/") || version[6] != '.') return false;
+      if(version[5] < '0' || version[5] > '9' || version[7] < '0' || version[7] > '9') return false;
+    }
+    method_ = make_span(buffer, tokens[0]);
+    target_ = make_span(buffer, tokens[1]);
+    version_ = count == 3 ? make_span(buffer, tokens[2]) : buffer_span{};
+    return true;
+  }
+
+  parse_status finish(std::string_view buffer, http_request& request, size_t length) noexcept{
+    request.method = view(buffer, method_);
+    request.target = view(buffer, target_);
+    request.version = view(buffer, version_);
+    request.header_count = header_count_;
+    for(size_t i = 0; i < header_count_; i++){
+      request.headers[i] = {view(buffer, headers_[i].first), view(buffer, headers_[i].second)};
+    }
+    request.length = length;
+    return body_status(request);
+  }
+
+  //Un Content-Length que no es un numero es un error; uno distinto de 0, un cuerpo
+  static parse_status body_status(const http_request& request) noexcept{
+    parse_status status{parse_status::complete};
+    for(size_t i = 0; i < request.header_count; i++){
+      const http_header_field& field = request.headers[i];
+      if(iequals(field.name, "Transfer-Encoding")) status = parse_status::has_body;
+      else if(iequals(field.name, "Content-Length")){
+        if(field.value.empty() || !std::ranges::all_of(field.value, [](char c){ return c >= '0' && c <= '9'; })) return parse_status::bad_request;
+        if(!std::ranges::all_of(field.value, [](char c){ return c == '0'; })) status = parse_status::has_body;
+      }
+    }
+    return status;
+  }
+
+  size_t max_header_size_;
+  state state_{state::request_line};
+  //Inicio de la primera linea sin analizar y hasta donde se ha buscado su final
+  size_t position_{0};
+  size_t scanned_{0};
+  buffer_span method_;
+  buffer_span target_;
+  buffer_span version_;
+  std::array<std::pair<buffer_span, buffer_span>, max_http_headers> headers_;
+  size_t header_count_{0};
+};
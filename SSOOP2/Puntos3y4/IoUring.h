@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <expected>
+#include <memory>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "SafeFD.h"
+#include "SafeMap.h"
+
+
+//glibc no trae envoltorios para las llamadas de io_uring
+int io_uring_setup(unsigned entries, io_uring_params* params){
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+
+int io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args){
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+
+//Anillos de envio y de finalizacion de una instancia de io_uring, usados directamente sin
+//liburing. Solo los usa un hilo: los indices compartidos con el kernel se leen con acquire y
+//se publican con release
+class IoUring{
+ public:
+  static std::expected<IoUring, int> create(unsigned entries){
+    io_uring_params params{};
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    int fd = io_uring_setup(entries, &params);
+    //Los nucleos anteriores a 6.0 no conocen SINGLE_ISSUER
+    if(fd < 0 && errno == EINVAL){
+      params = io_uring_params{};
+      fd = io_uring_setup(entries, &params);
+    }
+    if(fd < 0) return std::unexpected(errno);
+    IoUring ring(fd);
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) return std::unexpected(ENOSYS);
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    size_t ring_size = std::max(sq_size, cq_size);
+    void* rings = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(rings == MAP_FAILED) return std::unexpected(errno);
+    ring.rings_ = SafeMap(std::string_view(static_cast<char*>(rings), ring_size));
+    size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) return std::unexpected(errno);
+    ring.sqes_map_ = SafeMap(std::string_view(static_cast<char*>(sqes), sqes_size));
+
+    char* base = static_cast<char*>(rings);
+    ring.sq_head_ = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    ring.sq_tail_ = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    ring.sq_mask_ = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    ring.sq_entries_ = params.sq_entries;
+    ring.sq_array_ = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    ring.cq_head_ = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    ring.cq_tail_ = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    ring.cq_mask_ = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    ring.cqes_ = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    ring.sqes_ = static_cast<io_uring_sqe*>(sqes);
+    ring.local_tail_ = *ring.sq_tail_;
+    //El array del anillo de envio se deja como la identidad: la entrada i usa el sqe i
+    for(unsigned i = 0; i < ring.sq_entries_; i++) ring.sq_array_[i] = i;
+    return ring;
+  }
+
+  IoUring(IoUring&&) noexcept = default;
+  IoUring& operator=(IoUring&&) noexcept = default;
+
+  //Siguiente sqe libre, ya vacio. Si el anillo esta lleno se envia antes lo pendiente
+  io_uring_sqe* get_sqe(){
+    if(local_tail_ - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire) == sq_entries_){
+      if(submit(0) < 0) return nullptr;
+      if(local_tail_ - std::atomic_ref<unsigned>(*sq_head_).load(std::memory_order_acquire) == sq_entries_) return nullptr;
+    }
+    io_uring_sqe* sqe = &sqes_[local_tail_ & sq_mask_];
+    std::memset(sqe, 0, sizeof(*sqe));
+    local_tail_++;
+    return sqe;
+  }
+
+  //Envia los sqe preparados y espera hasta que haya wait finalizaciones. Devuelve -errno si falla
+  int submit(unsigned wait){
+    std::atomic_ref<unsigned>(*sq_tail_).store(local_tail_, std::memory_order_release);
+    unsigned pending = local_tail_ - submitted_;
+    int result = io_uring_enter(fd_.get(), pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if(result < 0) return -errno;
+    submitted_ += static_cast<unsigned>(result);
+    return result;
+  }
+
+  //Llama a handle con cada finalizacion disponible y las marca como consumidas
+  template <typename Handler>
+  unsigned drain(Handler&& handle){
+    unsigned head = *cq_head_;
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+    unsigned count = tail - head;
+    for(; head != tail; head++){
+      //Copia: el manejador puede preparar nuevos sqe antes de que se libere la entrada
+      io_uring_cqe cqe = cqes_[head & cq_mask_];
+      std::atomic_ref<unsigned>(*cq_head_).store(head + 1, std::memory_order_release);
+      handle(cqe);
+    }
+    return count;
+  }
+
+  int register_buffers(const iovec* buffers, unsigned count){
+    if(io_uring_register(fd_.get(), IORING_REGISTER_BUFFERS, buffers, count) < 0) return errno;
+    return EXIT_SUCCESS;
+  }
+
+ private:
+  explicit IoUring(int fd) noexcept : fd_{fd} {}
+
+  SafeFD fd_;
+  SafeMap rings_;
+  SafeMap sqes_map_;
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned sq_entries_{0};
+  unsigned* sq_array_{nullptr};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe* cqes_{nullptr};
+  io_uring_sqe* sqes_{nullptr};
+  //sqe preparados (local_tail_) y ya entregados al kernel (submitted_)
+  unsigned local_tail_{0};
+  unsigned submitted_{0};
+};
+
+
+//Buffers proporcionados al kernel: este toma uno al llegar datos a un recv con
+//IOSQE_BUFFER_SELECT, asi que las conexiones inactivas no retienen memoria. Cada buffer
+//se vuelve a proporcionar en cuanto se ha copiado su contenido
+class ProvidedBuffers{
+ public:
+  ProvidedBuffers(uint16_t group, unsigned count, size_t size) : data_{new char[count * size]}, group_{group}, count_{count}, size_{size} {}
+
+  [[nodiscard]] uint16_t group() const noexcept{
+    return group_;
+  }
+
+  [[nodiscard]] unsigned count() const noexcept{
+    return count_;
+  }
+
+  [[nodiscard]] std::string_view get(uint16_t id, size_t length) const noexcept{
+    return std::string_view(data_.get() + id * size_, length);
+  }
+
+  //Prepara en sqe la entrega al kernel de count buffers consecutivos a partir de first
+  void provide(io_uring_sqe* sqe, uint16_t first, unsigned count) const noexcept{
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(data_.get() + first * size_);
+    sqe->len = static_cast<uint32_t>(size_);
+    sqe->off = first;
+    sqe->buf_group = group_;
+  }
+
+ private:
+  std::unique_ptr<char[]> data_;
+  uint16_t group_;
+  unsigned count_;
+  size_t size_;
+};
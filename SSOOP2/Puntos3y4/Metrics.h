@@ -0,0 +1,257 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <new>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <sys/mman.h>
+
+#include "SafeMap.h"
+
+
+//Contador con un unico escritor (su trabajador). Leer y sumar con store evita la instruccion
+//con lock de fetch_add; los lectores de /metrics solo necesitan ver un valor reciente
+class Counter{
+ public:
+  void add(uint64_t n = 1) noexcept{
+    value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  void set(uint64_t n) noexcept{
+    value_.store(n, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] uint64_t get() const noexcept{
+    return value_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+
+//Histograma de latencias log-lineal al estilo HDR: cada potencia de dos de nanosegundos se
+//parte en dos cubetas, con un error relativo maximo del 50%. Va de 256 ns a ~69 s
+class LatencyHistogram{
+ public:
+  static constexpr unsigned min_shift{8};
+  static constexpr unsigned max_shift{36};
+  static constexpr size_t bucket_count{2 + 2 * (max_shift - min_shift)};
+
+  void record(std::chrono::nanoseconds elapsed) noexcept{
+    uint64_t ns = elapsed.count() > 0 ? static_cast<uint64_t>(elapsed.count()) : 0;
+    counts_[index(ns)].add();
+    sum_ns_.add(ns);
+  }
+
+  //Cubeta de ns: la 0 es [0, 2^min_shift); despues, para 2^k <= ns < 2^(k+1), el bit k-1
+  //decide si cae en la mitad baja o alta del intervalo
+  static size_t index(uint64_t ns) noexcept{
+    if(ns < (uint64_t{1} << min_shift)) return 0;
+    unsigned k = static_cast<unsigned>(std::bit_width(ns)) - 1;
+    if(k >= max_shift) return bucket_count - 1;
+    size_t half = (ns >> (k - 1)) & 1;
+    return 1 + 2 * (k - min_shift) + half;
+  }
+
+  //Limite superior (exclusivo) de la cubeta i en ns
+  static uint64_t upper_bound(size_t i) noexcept{
+    if(i == 0) return uint64_t{1} << min_shift;
+    unsigned k = min_shift + static_cast<unsigned>((i - 1) / 2);
+    return (uint64_t{1} << k) + ((i - 1) % 2 + 1) * (uint64_t{1} << (k - 1));
+  }
+
+  [[nodiscard]] uint64_t count(size_t i) const noexcept{
+    return counts_[i].get();
+  }
+
+  [[nodiscard]] uint64_t sum_ns() const noexcept{
+    return sum_ns_.get();
+  }
+
+ private:
+  std::array<Counter, bucket_count> counts_;
+  Counter sum_ns_;
+};
+
+
+//Metricas de un trabajador. Cada trabajador escribe solo en la suya
+struct worker_metrics{
+  Counter connections;
+  Counter requests;
+  Counter responses_2xx;
+  Counter responses_4xx;
+  Counter responses_5xx;
+  Counter cache_hits;
+  Counter cache_misses;
+  Counter cache_evictions;
+  Counter access_log_dropped;
+  //Respuestas enviadas con Content-Encoding y bytes que se ahorran frente al fichero original
+  Counter encoded_responses;
+  Counter encoding_bytes_saved;
+  //Conexiones rechazadas al aceptarlas por los limites y peticiones rechazadas por exceso de ritmo
+  Counter rejected_connections;
+  Counter rate_limited;
+  //Programas de /bin matados por superar --cgi-timeout, cuya respuesta queda sin terminar
+  Counter cgi_timeouts;
+  //Handshakes TLS completados, cuantos reanudan una sesion y en cuantos el kernel cifra los
+  //envios (kTLS), y los que fallan
+  Counter tls_handshakes;
+  Counter tls_resumed;
+  Counter tls_kernel_send;
+  Counter tls_failed_handshakes;
+#ifdef DOCSERVER_COUNT_ALLOCATIONS
+  //Reservas de memoria dinamica del proceso del trabajador (ver Allocations.h), contando las
+  //del maestro antes de crearlo. Se actualiza con cada peticion; en regimen estable no crece
+  Counter heap_allocations;
+#endif
+  //Reserva de hilos de fs (ver FsPool): tareas sin finalizar (un valor, no un total), tareas
+  //encargadas y cargas hechas en el hilo de red, por tener la cola llena o porque a una
+  //peticion que ya ha esperado le falta algo que la reserva no ha cargado
+  Counter fs_queue_depth;
+  Counter fs_tasks;
+  Counter fs_inline;
+  LatencyHistogram accept;
+  LatencyHistogram parse;
+  LatencyHistogram file_open;
+  LatencyHistogram send;
+  LatencyHistogram cgi;
+  LatencyHistogram compress;
+  LatencyHistogram request;
+  LatencyHistogram tls_handshake;
+  //Espera de una tarea en la cola de la reserva de hilos de fs y lo que tarda en un hilo
+  LatencyHistogram fs_wait;
+  LatencyHistogram fs_task;
+
+  void count_status(unsigned status) noexcept{
+    if(status >= 200 && status < 300) responses_2xx.add();
+    else if(status >= 400 && status < 500) responses_4xx.add();
+    else if(status >= 500 && status < 600) responses_5xx.add();
+  }
+};
+
+
+//Metricas de todos los trabajadores en memoria compartida anonima, creada antes de lanzarlos
+//para que cualquiera pueda servir /metrics con la suma de todos sin bloquear a nadie
+class Metrics{
+ public:
+  static std::expected<Metrics, int> create(size_t workers){
+    size_t size = sizeof(worker_metrics) * workers;
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED) return std::unexpected(errno);
+    for(size_t i = 0; i < workers; i++) new (static_cast<worker_metrics*>(mem) + i) worker_metrics();
+    return Metrics(SafeMap(std::string_view(static_cast<char*>(mem), size)), workers);
+  }
+
+  [[nodiscard]] worker_metrics& worker(size_t index) const noexcept{
+    return slots()[index];
+  }
+
+  //Todas las metricas en el formato de texto de Prometheus
+  [[nodiscard]] std::string render() const{
+    std::string out;
+    out.reserve(65536);
+    render_counter(out, "docserver_connections_total", "Conexiones aceptadas", &worker_metrics::connections);
+    render_counter(out, "docserver_requests_total", "Peticiones atendidas", &worker_metrics::requests);
+    render_counter(out, "docserver_responses_2xx_total", "Respuestas 2xx", &worker_metrics::responses_2xx);
+    render_counter(out, "docserver_responses_4xx_total", "Respuestas 4xx", &worker_metrics::responses_4xx);
+    render_counter(out, "docserver_responses_5xx_total", "Respuestas 5xx", &worker_metrics::responses_5xx);
+    render_counter(out, "docserver_file_cache_hits_total", "Aciertos de la cache de ficheros", &worker_metrics::cache_hits);
+    render_counter(out, "docserver_file_cache_misses_total", "Fallos de la cache de ficheros", &worker_metrics::cache_misses);
+    render_counter(out, "docserver_file_cache_evictions_total", "Expulsiones de la cache de ficheros", &worker_metrics::cache_evictions);
+    render_counter(out, "docserver_access_log_dropped_total", "Entradas descartadas del registro de accesos", &worker_metrics::access_log_dropped);
+    render_counter(out, "docserver_encoded_responses_total", "Respuestas comprimidas", &worker_metrics::encoded_responses);
+    render_counter(out, "docserver_encoding_saved_bytes_total", "Bytes ahorrados al comprimir", &worker_metrics::encoding_bytes_saved);
+    render_counter(out, "docserver_rejected_connections_total", "Conexiones rechazadas por los limites de conexiones", &worker_metrics::rejected_connections);
+    render_counter(out, "docserver_rate_limited_total", "Peticiones rechazadas por el limite de peticiones por segundo", &worker_metrics::rate_limited);
+    render_counter(out, "docserver_cgi_timeouts_total", "Programas de /bin matados por superar su plazo", &worker_metrics::cgi_timeouts);
+    render_counter(out, "docserver_tls_handshakes_total", "Handshakes TLS completados", &worker_metrics::tls_handshakes);
+    render_counter(out, "docserver_tls_resumed_total", "Handshakes TLS que reanudan una sesion", &worker_metrics::tls_resumed);
+    render_counter(out, "docserver_tls_kernel_send_total", "Conexiones TLS cuyos envios cifra el kernel (kTLS)", &worker_metrics::tls_kernel_send);
+    render_counter(out, "docserver_tls_failed_handshakes_total", "Handshakes TLS fallidos", &worker_metrics::tls_failed_handshakes);
+#ifdef DOCSERVER_COUNT_ALLOCATIONS
+    render_counter(out, "docserver_heap_allocations_total", "Reservas de memoria dinamica (operator new) del trabajador", &worker_metrics::heap_allocations);
+#endif
+    render_gauge(out, "docserver_fs_queue_depth", "Tareas de la reserva de hilos de fs en cola o en curso", &worker_metrics::fs_queue_depth);
+    render_counter(out, "docserver_fs_tasks_total", "Tareas encargadas a la reserva de hilos de fs", &worker_metrics::fs_tasks);
+    render_counter(out, "docserver_fs_inline_total", "Cargas de ficheros hechas en el hilo de red por tener llena la cola de fs o tras esperar a ella", &worker_metrics::fs_inline);
+    render_histogram(out, "docserver_accept_seconds", "Duracion de accept", &worker_metrics::accept);
+    render_histogram(out, "docserver_parse_seconds", "Duracion del analisis de la peticion", &worker_metrics::parse);
+    render_histogram(out, "docserver_file_open_seconds", "Duracion de abrir (o buscar en la cache) un fichero", &worker_metrics::file_open);
+    render_histogram(out, "docserver_send_seconds", "Duracion del envio de la respuesta", &worker_metrics::send);
+    render_histogram(out, "docserver_cgi_seconds", "Duracion de los programas de /bin", &worker_metrics::cgi);
+    render_histogram(out, "docserver_compress_seconds", "Duracion de la compresion al vuelo", &worker_metrics::compress);
+    render_histogram(out, "docserver_request_seconds", "Duracion total de la peticion", &worker_metrics::request);
+    render_histogram(out, "docserver_tls_handshake_seconds", "Duracion del handshake TLS", &worker_metrics::tls_handshake);
+    render_histogram(out, "docserver_fs_wait_seconds", "Espera de las tareas en la cola de la reserva de hilos de fs", &worker_metrics::fs_wait);
+    render_histogram(out, "docserver_fs_task_seconds", "Duracion de las tareas de la reserva de hilos de fs", &worker_metrics::fs_task);
+    return out;
+  }
+
+ private:
+  Metrics(SafeMap region, size_t workers) noexcept : region_{std::move(region)}, workers_{workers} {}
+
+  [[nodiscard]] worker_metrics* slots() const noexcept{
+    return reinterpret_cast<worker_metrics*>(const_cast<char*>(region_.get().data()));
+  }
+
+  static void append_number(std::string& out, uint64_t value){
+    char buffer[24];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, end);
+  }
+
+  static void append_seconds(std::string& out, uint64_t ns){
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), static_cast<double>(ns) / 1e9);
+    out.append(buffer, end);
+  }
+
+  void render_counter(std::string& out, std::string_view name, std::string_view help, Counter worker_metrics::* counter, std::string_view type = "counter") const{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    for(size_t i = 0; i < workers_; i++){
+      out.append(name).append("{worker=\"");
+      append_number(out, i);
+      out.append("\"} ");
+      append_number(out, (slots()[i].*counter).get());
+      out.append("\n");
+    }
+  }
+
+  //Un valor que sube y baja, guardado en un Counter con set
+  void render_gauge(std::string& out, std::string_view name, std::string_view help, Counter worker_metrics::* gauge) const{
+    render_counter(out, name, help, gauge, "gauge");
+  }
+
+  void render_histogram(std::string& out, std::string_view name, std::string_view help, LatencyHistogram worker_metrics::* histogram) const{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" histogram\n");
+    uint64_t cumulative{0};
+    uint64_t sum_ns{0};
+    for(size_t b = 0; b < LatencyHistogram::bucket_count; b++){
+      for(size_t i = 0; i < workers_; i++) cumulative += (slots()[i].*histogram).count(b);
+      out.append(name).append("_bucket{le=\"");
+      if(b + 1 == LatencyHistogram::bucket_count) out.append("+Inf");
+      else append_seconds(out, LatencyHistogram::upper_bound(b));
+      out.append("\"} ");
+      append_number(out, cumulative);
+      out.append("\n");
+    }
+    for(size_t i = 0; i < workers_; i++) sum_ns += (slots()[i].*histogram).sum_ns();
+    out.append(name).append("_sum ");
+    append_seconds(out, sum_ns);
+    out.append("\n").append(name).append("_count ");
+    append_number(out, cumulative);
+    out.append("\n");
+  }
+
+  SafeMap region_;
+  size_t workers_;
+};
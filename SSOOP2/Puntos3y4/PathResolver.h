@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <expected>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+
+#include "SafeFD.h"
+
+
+//Hash para buscar en las caches por ruta con cualquier cadena (la de canonical_path esta en
+//la arena de la respuesta) sin copiarla a un std::string
+struct string_hash{
+  using is_transparent = void;
+
+  size_t operator()(std::string_view text) const noexcept{
+    return std::hash<std::string_view>{}(text);
+  }
+};
+
+
+template<typename T>
+using string_map = std::unordered_map<std::string, T, string_hash, std::equal_to<>>;
+
+
+//glibc no trae envoltorio para openat2
+int sys_openat2(int dirfd, const char* path, open_how* how){
+  return static_cast<int>(syscall(__NR_openat2, dirfd, path, how, sizeof(open_how)));
+}
+
+
+//Decodifica los %XX de la ruta de la peticion y la normaliza como RFC 3986, 5.2.4: se quita
+//la query, los segmentos vacios y los ".", y cada ".." quita el segmento anterior sin salir
+//nunca de la raiz. Devuelve la ruta relativa a basedir sin "/" inicial ("" es la propia
+//raiz), o nada si tiene un escape mal formado o un byte nulo. La ruta se reserva en memory,
+//normalmente la arena de la respuesta
+std::optional<std::pmr::string> canonical_path(std::string_view target, std::pmr::memory_resource* memory = std::pmr::get_default_resource()){
+  target = target.substr(0, target.find_first_of("?#"));
+  std::pmr::string decoded(memory);
+  decoded.reserve(target.size());
+  for(size_t i = 0; i < target.size(); i++){
+    if(target[i] != '%'){
+      decoded.push_back(target[i]);
+      continue;
+    }
+    if(i + 2 >= target.size()) return std::nullopt;
+    unsigned value{0};
+    for(char c : target.substr(i + 1, 2)){
+      value <<= 4;
+      if(c >= '0' && c <= '9') value |= static_cast<unsigned>(c - '0');
+      else if(c >= 'a' && c <= 'f') value |= static_cast<unsigned>(c - 'a' + 10);
+      else if(c >= 'A' && c <= 'F') value |= static_cast<unsigned>(c - 'A' + 10);
+      else return std::nullopt;
+    }
+    if(value == 0) return std::nullopt;
+    decoded.push_back(static_cast<char>(value));
+    i += 2;
+  }
+
+  //Los segmentos se copian sobre el propio buffer: la salida nunca es mas larga que la entrada
+  size_t out{0};
+  size_t pos{0};
+  while(pos <= decoded.size()){
+    size_t slash = decoded.find('/', pos);
+    if(slash == std::string::npos) slash = decoded.size();
+    std::string_view segment(decoded.data() + pos, slash - pos);
+    if(segment == ".."){
+      if(out > 0){
+        size_t previous = decoded.rfind('/', out - 1);
+        out = previous == std::string::npos ? 0 : previous;
+      }
+    }
+    else if(!segment.empty() && segment != "."){
+      if(out > 0) decoded[out++] = '/';
+      std::copy(segment.begin(), segment.end(), decoded.begin() + static_cast<std::ptrdiff_t>(out));
+      out += segment.size();
+    }
+    pos = slash + 1;
+  }
+  decoded.resize(out);
+  return decoded;
+}
+
+
+//Abre ficheros por su ruta relativa al directorio base, que se mantiene abierto: el kernel
+//solo recorre la parte relativa de la ruta y openat2 con RESOLVE_BENEATH garantiza que ni
+//".." ni un enlace simbolico permiten salir del directorio (falla con EXDEV)
+class PathResolver{
+ public:
+  static std::expected<PathResolver, int> open(const std::string& basedir){
+    SafeFD root(::open(basedir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+    if(!root.is_valid()) return std::unexpected(errno);
+    return PathResolver(std::move(root));
+  }
+
+  //relative viene de canonical_path. Con flags O_PATH solo se comprueba que existe y esta dentro
+  std::expected<SafeFD, int> open(const std::string& relative, int flags) const{
+    open_how how{};
+    how.flags = static_cast<unsigned>(flags | O_CLOEXEC);
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    const char* path = relative.empty() ? "." : relative.c_str();
+    int fd = sys_openat2(root_.get(), path, &how);
+    //Nucleos anteriores a 5.6: canonical_path ya ha quitado los "..", pero los enlaces
+    //simbolicos pueden llevar fuera
+    if(fd < 0 && errno == ENOSYS) fd = openat(root_.get(), path, flags | O_CLOEXEC);
+    if(fd < 0) return std::unexpected(errno);
+    return SafeFD(fd);
+  }
+
+  //Para detectar cambios en un fichero ya abierto con open(); si la ruta se ha cambiado por
+  //un enlace hacia fuera, el fichero parece cambiado y al reabrirlo falla
+  int stat(const std::string& relative, struct stat& file_stat) const{
+    if(fstatat(root_.get(), relative.empty() ? "." : relative.c_str(), &file_stat, 0) < 0) return errno;
+    return EXIT_SUCCESS;
+  }
+
+ private:
+  explicit PathResolver(SafeFD root) noexcept : root_{std::move(root)} {}
+
+  SafeFD root_;
+};
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string_view>
+#include <sys/mman.h>
+
 class SafeMap{
   public:
     explicit SafeMap(std::string_view sv) noexcept : sv_{sv}{}
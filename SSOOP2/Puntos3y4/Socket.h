@@ -2,32 +2,191 @@
 
 #include <iostream>
 #include <cstdint>
+#include <cstddef>
 #include <expected>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <charconv>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <array>
+#include <chrono>
 
 #include "SafeFD.h"
 
 
-std::expected<SafeFD, int> make_socket(uint16_t port){
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(fd < 0) return std::unexpected(errno);
+//Direccion en la que escucha el servidor: IPv4, IPv6 o un socket Unix (una ruta o, si empieza
+//por '@', un nombre del espacio abstracto, que no deja fichero). Un socket IPv6 en :: es de
+//doble pila: tambien acepta IPv4, con direcciones IPv4 mapeadas en IPv6
+struct listen_address{
+  sockaddr_storage address{};
+  socklen_t length{0};
+
+  [[nodiscard]] sa_family_t family() const noexcept{
+    return address.ss_family;
+  }
+
+  [[nodiscard]] const sockaddr* get() const noexcept{
+    return reinterpret_cast<const sockaddr*>(&address);
+  }
+
+  //Ruta del socket Unix, con '@' en vez del 0 inicial si es abstracto
+  [[nodiscard]] std::string_view unix_path() const noexcept{
+    const auto& local = reinterpret_cast<const sockaddr_un&>(address);
+    size_t size = length - offsetof(sockaddr_un, sun_path);
+    //Una ruta del sistema de ficheros termina en 0; un nombre abstracto ocupa length entero
+    if(size > 0 && local.sun_path[0] != '\0') size = strnlen(local.sun_path, size);
+    return std::string_view(local.sun_path, size);
+  }
+
+  //Como se escribe en --listen: 0.0.0.0:8080, [::]:8080 o unix:/ruta
+  [[nodiscard]] std::string to_string() const{
+    if(family() == AF_UNIX){
+      std::string path(unix_path());
+      if(!path.empty() && path[0] == '\0') path[0] = '@';
+      return "unix:" + path;
+    }
+    char host[INET6_ADDRSTRLEN]{};
+    uint16_t port{0};
+    if(family() == AF_INET6){
+      const auto& ip = reinterpret_cast<const sockaddr_in6&>(address);
+      inet_ntop(AF_INET6, &ip.sin6_addr, host, sizeof(host));
+      port = ntohs(ip.sin6_port);
+      return "[" + std::string(host) + "]:" + std::to_string(port);
+    }
+    const auto& ip = reinterpret_cast<const sockaddr_in&>(address);
+    inet_ntop(AF_INET, &ip.sin_addr, host, sizeof(host));
+    port = ntohs(ip.sin_port);
+    return std::string(host) + ":" + std::to_string(port);
+  }
+
+  bool operator==(const listen_address& other) const noexcept{
+    return length == other.length && std::memcmp(&address, &other.address, length) == 0;
+  }
+};
+
+
+//Todas las direcciones IPv4 de la maquina en port, lo que se escucha por defecto
+listen_address ipv4_any(uint16_t port){
+  listen_address result;
+  auto& ip = reinterpret_cast<sockaddr_in&>(result.address);
+  ip.sin_family = AF_INET;
+  ip.sin_addr.s_addr = htonl(INADDR_ANY);
+  ip.sin_port = htons(port);
+  result.length = sizeof(sockaddr_in);
+  return result;
+}
+
+
+//Interpreta una direccion de --listen: "puerto" (todas las IPv4), "ipv4:puerto",
+//"[ipv6]:puerto" o "unix:ruta". Falla con EINVAL si no es valida y con ENAMETOOLONG si la
+//ruta no cabe en sockaddr_un
+std::expected<listen_address, int> parse_listen_address(std::string_view text){
+  listen_address result;
+  if(text.starts_with("unix:")){
+    std::string_view path = text.substr(5);
+    auto& local = reinterpret_cast<sockaddr_un&>(result.address);
+    if(path.empty() || path == "@") return std::unexpected(EINVAL);
+    if(path.size() >= sizeof(local.sun_path)) return std::unexpected(ENAMETOOLONG);
+    local.sun_family = AF_UNIX;
+    std::memcpy(local.sun_path, path.data(), path.size());
+    if(path[0] == '@'){
+      local.sun_path[0] = '\0';
+      result.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size());
+    }
+    else result.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+    return result;
+  }
+
+  size_t colon = text.rfind(':');
+  std::string_view host = colon == std::string_view::npos ? std::string_view() : text.substr(0, colon);
+  std::string_view port_text = colon == std::string_view::npos ? text : text.substr(colon + 1);
+  uint16_t port{0};
+  auto [end, ec] = std::from_chars(port_text.data(), port_text.data() + port_text.size(), port);
+  if(ec != std::errc() || end != port_text.data() + port_text.size()) return std::unexpected(EINVAL);
+  if(host.empty()) return ipv4_any(port);
+
+  if(host.starts_with('[') && host.ends_with(']')){
+    std::string literal(host.substr(1, host.size() - 2));
+    auto& ip = reinterpret_cast<sockaddr_in6&>(result.address);
+    if(inet_pton(AF_INET6, literal.c_str(), &ip.sin6_addr) != 1) return std::unexpected(EINVAL);
+    ip.sin6_family = AF_INET6;
+    ip.sin6_port = htons(port);
+    result.length = sizeof(sockaddr_in6);
+    return result;
+  }
+  std::string literal(host);
+  auto& ip = reinterpret_cast<sockaddr_in&>(result.address);
+  if(inet_pton(AF_INET, literal.c_str(), &ip.sin_addr) != 1) return std::unexpected(EINVAL);
+  ip.sin_family = AF_INET;
+  ip.sin_port = htons(port);
+  result.length = sizeof(sockaddr_in);
+  return result;
+}
 
-  sockaddr_in local_address{};
-  local_address.sin_family = AF_INET;
-  local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-  local_address.sin_port = htons(port);
 
-  int result = bind(fd, reinterpret_cast<const sockaddr*>(&local_address), sizeof(local_address));
+//Borra el fichero de un socket Unix que ha dejado un servidor que ya no esta (bind falla si
+//existe), pero no el de uno que sigue escuchando: eso es EADDRINUSE. Lo que no es un socket
+//no se toca y bind fallara con EADDRINUSE
+int remove_stale_socket(const listen_address& address){
+  std::string path(address.unix_path());
+  struct stat file_stat;
+  if(path.empty() || path[0] == '\0' || lstat(path.c_str(), &file_stat) < 0 || !S_ISSOCK(file_stat.st_mode)) return EXIT_SUCCESS;
+  SafeFD probe(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if(!probe.is_valid()) return errno;
+  if(connect(probe.get(), address.get(), address.length) == 0) return EADDRINUSE;
+  if(errno != ECONNREFUSED) return EXIT_SUCCESS;
+  if(unlink(path.c_str()) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Con reuseport varios procesos pueden enlazar la misma direccion TCP y el kernel reparte las
+//conexiones. Un socket Unix no lo admite: todos los trabajadores comparten el mismo
+std::expected<SafeFD, int> make_socket(const listen_address& address, bool reuseport = false){
+  //SOCK_CLOEXEC: los programas que ejecuta el servidor no deben heredar el socket
+  SafeFD fd(socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if(!fd.is_valid()) return std::unexpected(errno);
+
+  int enable{1};
+  if(address.family() == AF_UNIX){
+    int result = remove_stale_socket(address);
+    if(result != EXIT_SUCCESS) return std::unexpected(result);
+  }
+  else{
+    //SO_REUSEADDR permite reiniciar el servidor aunque queden conexiones en TIME_WAIT
+    if(setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) return std::unexpected(errno);
+    if(reuseport){
+      if(setsockopt(fd.get(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) return std::unexpected(errno);
+    }
+    //Sin Nagle, el ultimo segmento corto de una respuesta en una conexion persistente espera al
+    //ACK retardado del cliente (unos 40 ms). Las conexiones aceptadas heredan la opcion; la
+    //cabecera sigue compartiendo segmento con el cuerpo gracias a MSG_MORE
+    if(setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0) return std::unexpected(errno);
+    //La doble pila no depende de net.ipv6.bindv6only
+    int v6only{0};
+    if(address.family() == AF_INET6 && setsockopt(fd.get(), IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) return std::unexpected(errno);
+  }
+
+  int result = bind(fd.get(), address.get(), address.length);
   if (result < 0) return std::unexpected(errno);
 
-  return SafeFD(fd);
+  return fd;
 }
 
 
-int listen_connection(const SafeFD& socket){
-  if(listen(socket.get(), 5) < 0){
+int listen_connection(const SafeFD& socket, int backlog = SOMAXCONN){
+  if(listen(socket.get(), backlog) < 0){
     std::cout << std::strerror(errno) << std::endl;
     return errno;
   }
@@ -35,33 +194,240 @@ int listen_connection(const SafeFD& socket){
 }
 
 
-std::expected<SafeFD, int> accept_connection(const SafeFD& socket, sockaddr_in& client_addr, bool verbose){
+//Deja que otros sockets con SO_REUSEPORT se unan al puerto de uno ya enlazado. Enlazar el
+//primero sin la opcion hace que falle si el puerto lo usa otro programa
+int enable_reuseport(const SafeFD& socket){
+  int enable{1};
+  if(setsockopt(socket.get(), SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Direccion de un socket de escucha, p.ej. uno heredado de otro proceso. Falla con EINVAL si
+//el socket no esta escuchando
+std::expected<listen_address, int> listening_address(const SafeFD& socket){
+  int listening{0};
+  socklen_t length{sizeof(listening)};
+  if(getsockopt(socket.get(), SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0) return std::unexpected(errno);
+  if(!listening) return std::unexpected(EINVAL);
+  listen_address result;
+  result.length = sizeof(result.address);
+  if(getsockname(socket.get(), reinterpret_cast<sockaddr*>(&result.address), &result.length) < 0) return std::unexpected(errno);
+  return result;
+}
+
+
+//Direccion de un cliente en poco espacio, para el registro de accesos y los programas de /bin.
+//Las IPv4 mapeadas en IPv6 (clientes IPv4 de un socket de doble pila) quedan como IPv4. Los
+//clientes de un socket Unix no tienen direccion
+struct client_address{
+  std::array<unsigned char, 16> ip{};
+  //En orden de red, como en sockaddr_in
+  in_port_t port{0};
+  sa_family_t family{AF_UNSPEC};
+
+  static client_address from(const sockaddr_storage& address) noexcept{
+    client_address result;
+    result.family = address.ss_family;
+    if(address.ss_family == AF_INET){
+      const auto& ip = reinterpret_cast<const sockaddr_in&>(address);
+      std::memcpy(result.ip.data(), &ip.sin_addr, sizeof(ip.sin_addr));
+      result.port = ip.sin_port;
+    }
+    else if(address.ss_family == AF_INET6){
+      const auto& ip = reinterpret_cast<const sockaddr_in6&>(address);
+      result.port = ip.sin6_port;
+      if(IN6_IS_ADDR_V4MAPPED(&ip.sin6_addr)){
+        result.family = AF_INET;
+        std::memcpy(result.ip.data(), ip.sin6_addr.s6_addr + 12, 4);
+      }
+      else std::memcpy(result.ip.data(), &ip.sin6_addr, sizeof(ip.sin6_addr));
+    }
+    return result;
+  }
+
+  //La IP como texto, o vacia para un cliente sin direccion
+  [[nodiscard]] std::string ip_string() const{
+    if(family != AF_INET && family != AF_INET6) return {};
+    char text[INET6_ADDRSTRLEN]{};
+    inet_ntop(family, ip.data(), text, sizeof(text));
+    return text;
+  }
+};
+
+
+//Clave del cliente para los limites por cliente: su IPv4 o, en IPv6, el prefijo /64, que
+//suele ser de una misma maquina o red. Los clientes de un socket Unix no tienen: son
+//procesos locales, normalmente un proxy por el que llegan todos los clientes reales
+std::optional<uint64_t> client_key(const sockaddr_storage& address) noexcept{
+  client_address client = client_address::from(address);
+  if(client.family == AF_INET){
+    uint32_t ip;
+    std::memcpy(&ip, client.ip.data(), sizeof(ip));
+    return ip;
+  }
+  if(client.family != AF_INET6) return std::nullopt;
+  uint64_t prefix;
+  std::memcpy(&prefix, client.ip.data(), sizeof(prefix));
+  return prefix;
+}
+
+
+//Con inherit el descriptor se conserva al ejecutar otro programa con exec
+int set_inheritable(const SafeFD& fd, bool inherit){
+  int flags = fcntl(fd.get(), F_GETFD);
+  if(flags < 0) return errno;
+  if(fcntl(fd.get(), F_SETFD, inherit ? flags & ~FD_CLOEXEC : flags | FD_CLOEXEC) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Plazos de las llamadas bloqueantes sobre el socket: recv y send fallan con EAGAIN si no
+//avanzan en ese tiempo
+int set_timeouts(const SafeFD& socket, std::chrono::seconds receive, std::chrono::seconds send){
+  timeval receive_time{receive.count(), 0};
+  timeval send_time{send.count(), 0};
+  if(setsockopt(socket.get(), SOL_SOCKET, SO_RCVTIMEO, &receive_time, sizeof(receive_time)) < 0) return errno;
+  if(setsockopt(socket.get(), SOL_SOCKET, SO_SNDTIMEO, &send_time, sizeof(send_time)) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Descarta lo que el cliente ya haya enviado y no se haya leido (hasta 64 KB). Al cerrar un
+//socket con datos sin leer el kernel envia un RST, que puede hacer que el cliente descarte la
+//respuesta antes de leerla
+void discard_unread(const SafeFD& socket){
+  char buffer[4096];
+  for(int i = 0; i < 16 && recv(socket.get(), buffer, sizeof(buffer), MSG_DONTWAIT) > 0; i++){}
+}
+
+
+//Hace que al cerrar el socket se descarte lo que quede por enviar y se envie un RST, en vez
+//de seguir intentando entregarlo a un cliente que no lee
+int set_reset_on_close(const SafeFD& socket){
+  linger option{1, 0};
+  if(setsockopt(socket.get(), SOL_SOCKET, SO_LINGER, &option, sizeof(option)) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+int set_nonblocking(const SafeFD& socket){
+  int flags = fcntl(socket.get(), F_GETFL, 0);
+  if(flags < 0) return errno;
+  if(fcntl(socket.get(), F_SETFL, flags | O_NONBLOCK) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//flags se pasa a accept4(), p.ej. SOCK_NONBLOCK para las conexiones del bucle de eventos
+std::expected<SafeFD, int> accept_connection(const SafeFD& socket, sockaddr_storage& client_addr, bool verbose, int flags = SOCK_CLOEXEC){
   socklen_t client_addr_length{sizeof(client_addr)};
-  SafeFD new_fd(accept(socket.get(), reinterpret_cast<sockaddr*>(&client_addr), &client_addr_length));
+  SafeFD new_fd(accept4(socket.get(), reinterpret_cast<sockaddr*>(&client_addr), &client_addr_length, flags));
+  if(new_fd.get() < 0) return std::unexpected(errno);
+
   if(verbose) std::cerr << "Connection accepted ..." << std::endl;
+  return new_fd;
+}
 
-  if(new_fd.get() < 0) return std::unexpected(errno);
-  else return new_fd;
+
+//Recibe hasta max_size bytes al final de buffer, que no reserva memoria si ya tiene capacidad.
+//Devuelve los bytes recibidos; 0 es que el cliente ha cerrado
+std::expected<size_t, int> receive_request(const SafeFD& socket, std::string& buffer, size_t max_size){
+  size_t used = buffer.size();
+  buffer.resize(used + max_size);
+  ssize_t size = recv(socket.get(), buffer.data() + used, max_size, 0);
+  int error = errno;
+  buffer.resize(used + (size < 0 ? 0 : static_cast<size_t>(size)));
+  if(size < 0) return std::unexpected(error);
+  return static_cast<size_t>(size);
 }
 
+//Envia header y body con un solo sendmsg (equivalente a writev, pero admite flags) para que
+//viajen en el mismo segmento, continuando desde sent tras un envio parcial. Devuelve true al
+//terminar y false si el socket no bloqueante no admite mas datos por ahora
+std::expected<bool, int> send_vectored(const SafeFD& socket, std::string_view header, std::string_view body, size_t& sent, int flags = 0){
+  while(sent < header.size() + body.size()){
+    std::array<iovec, 2> parts;
+    size_t count{0};
+    if(sent < header.size()){
+      parts[count++] = {const_cast<char*>(header.data() + sent), header.size() - sent};
+    }
+    size_t body_sent = sent > header.size() ? sent - header.size() : 0;
+    if(body_sent < body.size()){
+      parts[count++] = {const_cast<char*>(body.data() + body_sent), body.size() - body_sent};
+    }
+    msghdr message{};
+    message.msg_iov = parts.data();
+    message.msg_iovlen = count;
+    ssize_t size = sendmsg(socket.get(), &message, flags | MSG_NOSIGNAL);
+    if(size < 0){
+      if(errno == EAGAIN) return false;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    sent += static_cast<size_t>(size);
+  }
+  return true;
+}
 
-std::expected<std::string, int> receive_request(const SafeFD& socket, size_t max_size){
-  std::string str(max_size, '0');
-  ssize_t size = recv(socket.get(), &str[0], max_size, 0);
-  if(size < 0) return std::unexpected(errno);
-  else{
-    str.resize(static_cast<long unsigned int>(size));
-    return str;
+
+//Envia el contenido de file desde offset hasta count directamente desde el kernel con sendfile(2),
+//sin pasar por espacio de usuario. Si file es una tuberia se recurre a splice(2), que no admite
+//offset; en ese caso count puede ser SIZE_MAX y se envia hasta EOF. Devuelve true al terminar y
+//false si el socket no bloqueante no admite mas datos por ahora. Un fichero regular que se
+//trunca mientras se envia da EIO: el cliente espera aun los bytes de Content-Length y la
+//conexion se tiene que cerrar
+std::expected<bool, int> send_file_body(const SafeFD& socket, const SafeFD& file, size_t& offset, size_t count){
+  while(offset < count){
+    off_t file_offset = static_cast<off_t>(offset);
+    ssize_t size = sendfile(socket.get(), file.get(), &file_offset, count - offset);
+    bool piped{false};
+    if(size < 0 && errno == EINVAL){
+      piped = true;
+      size = splice(file.get(), nullptr, socket.get(), nullptr, count - offset, SPLICE_F_MOVE | SPLICE_F_MORE);
+    }
+    if(size < 0){
+      if(errno == EAGAIN) return false;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    //EOF: fin de la tuberia o el fichero se ha truncado mientras se enviaba
+    if(size == 0){
+      if(piped) return true;
+      return std::unexpected(EIO);
+    }
+    offset += static_cast<size_t>(size);
   }
+  return true;
 }
 
-int send_response(const SafeFD& socket, std::string_view header, bool verbose, std::string_view body = {}){
-  if(verbose) std::cerr << "Sending response..." << std::endl;
-  if(send(socket.get(), header.data(), header.size(), 0) < 0) return errno;
 
-  //Salto de linea entre header y body
-  if(send(socket.get(), new char{'\n'}, 1, 0) < 0) return errno;
+//Reenvia al socket lo que haya en la tuberia pipe con splice(2), sin copiarlo a espacio de
+//usuario, hasta EOF. Devuelve true al terminar y false si la tuberia esta vacia o el socket
+//lleno; en ambos casos hay que esperar a que epoll avise de cualquiera de los dos
+std::expected<bool, int> send_pipe_body(const SafeFD& socket, const SafeFD& pipe, size_t& sent){
+  while(true){
+    ssize_t size = splice(pipe.get(), nullptr, socket.get(), nullptr, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(size < 0){
+      if(errno == EAGAIN) return false;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    if(size == 0) return true;
+    sent += static_cast<size_t>(size);
+  }
+}
 
-  if(send(socket.get(), body.data(), body.size(), 0) < 0) return errno;
+
+//Con more el cuerpo sigue despues (p.ej. con sendfile) y la cabecera se retiene con MSG_MORE
+//para que salga en el mismo segmento que el principio del cuerpo
+int send_response(const SafeFD& socket, std::string_view header, bool verbose, std::string_view body = {}, bool more = false){
+  if(verbose) std::cerr << "Sending response..." << std::endl;
+  //La cabecera ya incluye su separacion del cuerpo
+  size_t sent{0};
+  std::expected<bool, int> complete = send_vectored(socket, header, body, sent, more ? MSG_MORE : 0);
+  if(!complete) return complete.error();
+  //En un socket bloqueante solo se queda a medias si vence su SO_SNDTIMEO
+  if(!complete.value()) return ETIMEDOUT;
   return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <expected>
+#include <unistd.h>
+#include <cerrno>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "SafeFD.h"
+#include "Socket.h"
+
+
+//Terminacion de TLS: el handshake lo hace OpenSSL en espacio de usuario y despues, si el
+//kernel tiene el modulo tls y el cifrado negociado lo admite, OpenSSL instala las claves en
+//el socket (kTLS, TCP_ULP "tls"). Con kTLS para el envio el kernel cifra lo que se escribe en
+//el socket, asi que las respuestas salen con las mismas llamadas que sin TLS: sendmsg y,
+//sobre todo, sendfile y splice sin copiar los ficheros a espacio de usuario. Sin kTLS se
+//cifra con SSL_write, de un registro cada vez. Las peticiones se leen siempre con SSL_read,
+//que con kTLS para la recepcion solo es un recv
+
+
+//Texto maximo de un registro TLS: sin kTLS se envia un registro cada vez
+constexpr size_t tls_record_size{16384};
+
+
+//Mensaje del primer error de la cola de OpenSSL, que queda vacia
+std::string tls_error_string(){
+  unsigned long error = ERR_get_error();
+  ERR_clear_error();
+  if(error == 0) return "unknown error";
+  char buffer[256];
+  ERR_error_string_n(error, buffer, sizeof(buffer));
+  return buffer;
+}
+
+
+struct ssl_deleter{
+  void operator()(SSL* ssl) const noexcept{
+    SSL_free(ssl);
+  }
+};
+
+
+struct ssl_ctx_deleter{
+  void operator()(SSL_CTX* ctx) const noexcept{
+    SSL_CTX_free(ctx);
+  }
+};
+
+
+//Conexion TLS sobre un socket que no es suyo: el socket tiene que vivir mas que la sesion.
+//Los errores son los de las llamadas sobre sockets: EAGAIN si hay que esperar a que el
+//socket admita mas datos o los reciba, EPROTO si falla el protocolo
+class TlsSession{
+ public:
+  explicit TlsSession(std::unique_ptr<SSL, ssl_deleter> ssl) noexcept : ssl_{std::move(ssl)} {}
+  TlsSession(const TlsSession&) = delete;
+  TlsSession& operator=(const TlsSession&) = delete;
+
+  //Envia close_notify sin esperar el del cliente: sin el, un cuerpo que termina al cerrar la
+  //conexion (la salida de un programa) se podria tomar por truncado
+  ~TlsSession(){
+    if(!established_ || failed_) return;
+    ERR_clear_error();
+    SSL_shutdown(ssl_.get());
+    ERR_clear_error();
+  }
+
+  //Avanza el handshake. Devuelve true al terminar y false si hay que esperar al socket
+  std::expected<bool, int> handshake(){
+    ERR_clear_error();
+    int result = SSL_do_handshake(ssl_.get());
+    if(result == 1){
+      established_ = true;
+      kernel_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_.get())) != 0;
+      return true;
+    }
+    int error = error_code(result);
+    if(error == EAGAIN) return false;
+    return std::unexpected(error == 0 ? ECONNRESET : error);
+  }
+
+  //Lee texto en claro. 0 es el final de la conexion, con o sin close_notify
+  std::expected<size_t, int> receive(char* buffer, size_t size){
+    ERR_clear_error();
+    int result = SSL_read(ssl_.get(), buffer, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+    if(result > 0) return static_cast<size_t>(result);
+    int error = error_code(result);
+    if(error == 0) return 0;
+    return std::unexpected(error);
+  }
+
+  //Registro pendiente de enviar en espacio de usuario; solo se llena cuando esta vacio (ver flush)
+  [[nodiscard]] std::string& outgoing() noexcept{
+    return outgoing_;
+  }
+
+  //Cifra y envia el registro pendiente. Tras EAGAIN SSL_write exige repetir con los mismos
+  //datos, que siguen en outgoing hasta que salen. Devuelve true si no queda nada pendiente
+  std::expected<bool, int> flush(){
+    while(!outgoing_.empty()){
+      ERR_clear_error();
+      int result = SSL_write(ssl_.get(), outgoing_.data(), static_cast<int>(outgoing_.size()));
+      if(result <= 0){
+        int error = error_code(result);
+        if(error == EAGAIN) return false;
+        return std::unexpected(error == 0 ? EPIPE : error);
+      }
+      outgoing_.erase(0, static_cast<size_t>(result));
+    }
+    return true;
+  }
+
+  //El kernel cifra los envios (kTLS): se escribe directamente en el socket
+  [[nodiscard]] bool kernel_send() const noexcept{
+    return kernel_send_;
+  }
+
+  [[nodiscard]] bool kernel_receive() const noexcept{
+    return established_ && BIO_get_ktls_recv(SSL_get_rbio(ssl_.get())) != 0;
+  }
+
+  //La sesion se ha reanudado con un ticket o desde la cache, sin intercambio de claves completo
+  [[nodiscard]] bool resumed() const noexcept{
+    return SSL_session_reused(ssl_.get()) == 1;
+  }
+
+  [[nodiscard]] std::string_view version() const noexcept{
+    return SSL_get_version(ssl_.get());
+  }
+
+  [[nodiscard]] std::string_view cipher() const noexcept{
+    return SSL_get_cipher_name(ssl_.get());
+  }
+
+ private:
+  //Traduce el resultado de una llamada de OpenSSL: EAGAIN si hay que esperar al socket, 0 si
+  //el cliente ha cerrado y si no el error, tras el que la sesion ya no se puede usar
+  int error_code(int result){
+    int error = SSL_get_error(ssl_.get(), result);
+    if(error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) return EAGAIN;
+    if(error == SSL_ERROR_ZERO_RETURN) return 0;
+    failed_ = true;
+    if(error == SSL_ERROR_SYSCALL) return errno != 0 ? errno : ECONNRESET;
+    return EPROTO;
+  }
+
+  std::unique_ptr<SSL, ssl_deleter> ssl_;
+  std::string outgoing_;
+  bool established_{false};
+  bool failed_{false};
+  bool kernel_send_{false};
+};
+
+
+//Certificado, clave y configuracion comunes a todas las conexiones TLS. Se crea en el proceso
+//principal antes de lanzar los trabajadores, que heredan asi las mismas claves de los tickets
+//de sesion: un cliente reanuda su sesion aunque SO_REUSEPORT le lleve a otro trabajador. La
+//cache de sesiones por identificador (TLS 1.2 sin tickets) es de cada trabajador
+class TlsContext{
+ public:
+  //key puede estar vacio si la clave va en el mismo fichero que el certificado. Los errores
+  //son los mensajes de OpenSSL
+  static std::expected<TlsContext, std::string> create(const std::string& certificate, const std::string& key){
+    std::unique_ptr<SSL_CTX, ssl_ctx_deleter> ctx(SSL_CTX_new(TLS_server_method()));
+    if(!ctx) return std::unexpected(tls_error_string());
+    SSL_CTX_set_min_proto_version(ctx.get(), TLS1_2_VERSION);
+    //En TLS 1.2 solo cifrados AEAD, los que kTLS sabe cifrar; los de TLS 1.3 ya lo son todos
+    if(SSL_CTX_set_cipher_list(ctx.get(), "ECDHE+AESGCM:ECDHE+CHACHA20") != 1) return std::unexpected(tls_error_string());
+    //Sin SSL_OP_IGNORE_UNEXPECTED_EOF un cliente que cierra sin close_notify seria un error
+    SSL_CTX_set_options(ctx.get(), SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    //Las conexiones en espera no retienen los buffers de lectura y escritura de OpenSSL
+    SSL_CTX_set_mode(ctx.get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_session_cache_mode(ctx.get(), SSL_SESS_CACHE_SERVER);
+    static constexpr std::string_view session_context{"docserver"};
+    SSL_CTX_set_session_id_context(ctx.get(), reinterpret_cast<const unsigned char*>(session_context.data()), session_context.size());
+    //Un ticket por handshake basta para reanudar la siguiente conexion
+    SSL_CTX_set_num_tickets(ctx.get(), 1);
+
+    if(SSL_CTX_use_certificate_chain_file(ctx.get(), certificate.c_str()) != 1) return std::unexpected(tls_error_string());
+    const std::string& key_file = key.empty() ? certificate : key;
+    if(SSL_CTX_use_PrivateKey_file(ctx.get(), key_file.c_str(), SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx.get()) != 1){
+      return std::unexpected(tls_error_string());
+    }
+    return TlsContext(std::move(ctx));
+  }
+
+  //Sesion de servidor sobre una conexion recien aceptada, sin empezar el handshake
+  [[nodiscard]] std::expected<std::unique_ptr<TlsSession>, int> accept(const SafeFD& socket) const{
+    std::unique_ptr<SSL, ssl_deleter> ssl(SSL_new(ctx_.get()));
+    if(!ssl || SSL_set_fd(ssl.get(), socket.get()) != 1){
+      ERR_clear_error();
+      return std::unexpected(ENOMEM);
+    }
+    SSL_set_accept_state(ssl.get());
+    return std::make_unique<TlsSession>(std::move(ssl));
+  }
+
+ private:
+  explicit TlsContext(std::unique_ptr<SSL_CTX, ssl_ctx_deleter> ctx) noexcept : ctx_{std::move(ctx)} {}
+
+  std::unique_ptr<SSL_CTX, ssl_ctx_deleter> ctx_;
+};
+
+
+//Las funciones de envio de Socket.h sobre una sesion TLS. Sin sesion (tls es nullptr) o con
+//kTLS para el envio son las mismas llamadas, con el cuerpo por sendfile o splice; si no, los
+//datos pasan por outgoing de registro en registro. Como ellas, devuelven true al terminar y
+//false si el socket no admite mas datos por ahora
+
+
+std::expected<bool, int> send_vectored(const SafeFD& socket, TlsSession* tls, std::string_view header, std::string_view body, size_t& sent, int flags = 0){
+  if(tls == nullptr || tls->kernel_send()) return send_vectored(socket, header, body, sent, flags);
+  while(true){
+    std::expected<bool, int> flushed = tls->flush();
+    if(!flushed || !flushed.value()) return flushed;
+    if(sent == header.size() + body.size()) return true;
+    //La cabecera y el principio del cuerpo comparten registro
+    std::string& record = tls->outgoing();
+    if(sent < header.size()) record.append(header.substr(sent, tls_record_size));
+    size_t body_sent = sent > header.size() ? sent - header.size() : 0;
+    record.append(body.substr(body_sent, tls_record_size - record.size()));
+    sent += record.size();
+  }
+}
+
+
+std::expected<bool, int> send_file_body(const SafeFD& socket, TlsSession* tls, const SafeFD& file, size_t& offset, size_t count){
+  if(tls == nullptr || tls->kernel_send()) return send_file_body(socket, file, offset, count);
+  while(true){
+    std::expected<bool, int> flushed = tls->flush();
+    if(!flushed || !flushed.value()) return flushed;
+    if(offset >= count) return true;
+    std::string& record = tls->outgoing();
+    record.resize(std::min(tls_record_size, count - offset));
+    ssize_t size = pread(file.get(), record.data(), record.size(), static_cast<off_t>(offset));
+    bool piped = size < 0 && errno == ESPIPE;
+    if(piped) size = read(file.get(), record.data(), record.size());
+    if(size <= 0){
+      record.clear();
+      //Como en send_file_body sin TLS: un fichero regular truncado no termina el cuerpo
+      if(size == 0) return piped ? std::expected<bool, int>(true) : std::unexpected(EIO);
+      if(errno == EAGAIN) return false;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    record.resize(static_cast<size_t>(size));
+    offset += record.size();
+  }
+}
+
+
+std::expected<bool, int> send_pipe_body(const SafeFD& socket, TlsSession* tls, const SafeFD& pipe, size_t& sent){
+  if(tls == nullptr || tls->kernel_send()) return send_pipe_body(socket, pipe, sent);
+  while(true){
+    std::expected<bool, int> flushed = tls->flush();
+    if(!flushed || !flushed.value()) return flushed;
+    std::string& record = tls->outgoing();
+    record.resize(tls_record_size);
+    ssize_t size = read(pipe.get(), record.data(), record.size());
+    if(size <= 0){
+      record.clear();
+      if(size == 0) return true;
+      if(errno == EAGAIN) return false;
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    record.resize(static_cast<size_t>(size));
+    sent += record.size();
+  }
+}
+
+
+//receive_request y send_response de Socket.h, para el motor bloqueante
+std::expected<size_t, int> receive_request(const SafeFD& socket, TlsSession* tls, std::string& buffer, size_t max_size){
+  if(tls == nullptr) return receive_request(socket, buffer, max_size);
+  size_t used = buffer.size();
+  buffer.resize(used + max_size);
+  std::expected<size_t, int> size = tls->receive(buffer.data() + used, max_size);
+  buffer.resize(used + size.value_or(0));
+  return size;
+}
+
+
+int send_response(const SafeFD& socket, TlsSession* tls, std::string_view header, bool verbose, std::string_view body = {}, bool more = false){
+  if(tls == nullptr) return send_response(socket, header, verbose, body, more);
+  if(verbose) std::cerr << "Sending response..." << std::endl;
+  size_t sent{0};
+  std::expected<bool, int> complete = send_vectored(socket, tls, header, body, sent, more ? MSG_MORE : 0);
+  if(!complete) return complete.error();
+  if(!complete.value()) return ETIMEDOUT;
+  return EXIT_SUCCESS;
+}
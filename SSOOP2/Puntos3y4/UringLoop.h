@@ -0,0 +1,594 @@
+#pragma once
+
+#include <iostream>
+#include <array>
+#include <deque>
+#include <vector>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <expected>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <chrono>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <linux/time_types.h>
+#include <cerrno>
+#include <cstring>
+
+#include "SafeFD.h"
+#include "EventLoop.h"
+#include "IoUring.h"
+
+
+//Operacion de io_uring a la que corresponde una finalizacion. Va en el byte bajo de user_data
+//y el descriptor de la conexion en el resto
+enum class uring_op : uint8_t{
+  accept,
+  tick,
+  provide,
+  recv,
+  send_header,
+  part_prefix,
+  file_read,
+  file_write,
+  pipe_splice,
+  cancel,
+  fs_notify,
+};
+
+
+constexpr uint64_t make_user_data(int fd, uring_op op) noexcept{
+  return (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 8) | static_cast<uint8_t>(op);
+}
+
+
+//Conexion atendida con io_uring. Lo que se pasa al kernel (message, parts) tiene que seguir
+//en su sitio hasta que llegue la finalizacion; los nodos de unordered_map no se mueven
+struct uring_connection{
+  connection conn;
+  msghdr message{};
+  std::array<iovec, 2> parts{};
+  //Operaciones en curso; la conexion solo se libera (y se cierra el socket) con 0
+  unsigned inflight{0};
+  //Hay un recv multishot armado
+  bool receiving{false};
+  bool cancelling{false};
+  //Buffer registrado por el que pasa el fichero, o -1; chunk son los bytes leidos en el
+  //y chunk_sent los que ya se han enviado de ellos
+  int slot{-1};
+  size_t chunk{0};
+  size_t chunk_sent{0};
+};
+
+
+//Motor con io_uring: las conexiones se aceptan con un accept multishot, las peticiones llegan
+//por un recv multishot a buffers proporcionados y los ficheros se leen a buffers
+//registrados, asi que en regimen estable no hay llamadas al sistema por peticion mas alla de
+//un io_uring_enter que envia y recoge las operaciones de todas las conexiones a la vez
+class UringLoop{
+ public:
+  static constexpr unsigned ring_entries{4096};
+  static constexpr uint16_t recv_group{0};
+  static constexpr unsigned recv_buffers{1024};
+  static constexpr size_t recv_buffer_size{4096};
+  static constexpr unsigned file_slots{64};
+  static constexpr size_t file_slot_size{64 * 1024};
+
+  static std::expected<UringLoop, int> create(const std::vector<SafeFD>& sockets, const event_loop_options& options, worker_metrics& metrics,
+                                              ConnectionLimits& limits, AccessLog* access_log, const request_handler& handler){
+    std::expected<IoUring, int> ring = IoUring::create(ring_entries);
+    if(!ring) return std::unexpected(ring.error());
+    UringLoop loop(sockets, options, metrics, limits, access_log, handler, std::move(ring.value()));
+
+    std::array<iovec, file_slots> slots;
+    for(unsigned i = 0; i < file_slots; i++){
+      slots[i] = {loop.slot_data(static_cast<int>(i)), file_slot_size};
+      loop.free_slots_.push_back(static_cast<int>(i));
+    }
+    int result = loop.ring_.register_buffers(slots.data(), file_slots);
+    if(result != EXIT_SUCCESS) return std::unexpected(result);
+    return loop;
+  }
+
+  //Tras stop_serving termina las conexiones en curso y devuelve EXIT_SUCCESS, como
+  //run_event_loop; si no, solo retorna si falla el propio io_uring
+  int run(){
+    if(!provide_buffers(0, buffers_.count()) || !arm_tick() || !arm_fs_notify()) return ENOMEM;
+    for(const SafeFD& socket : sockets_){
+      if(!arm_accept(socket.get())) return ENOMEM;
+    }
+    while(true){
+      int result = ring_.submit(1);
+      if(result < 0 && result != -EINTR && result != -EBUSY) return -result;
+      ring_.drain([this](const io_uring_cqe& cqe){
+        complete(cqe);
+      });
+      if(!draining_ && stop_serving.load()) start_drain();
+      if(draining_ && (connections_.empty() || std::chrono::steady_clock::now() > drain_deadline_)) return EXIT_SUCCESS;
+    }
+  }
+
+ private:
+  using connection_table = std::pmr::unordered_map<int, uring_connection>;
+
+  UringLoop(const std::vector<SafeFD>& sockets, const event_loop_options& options, worker_metrics& metrics, ConnectionLimits& limits,
+            AccessLog* access_log, const request_handler& handler, IoUring ring)
+      : sockets_{sockets}, options_{options}, metrics_{metrics}, limits_{limits}, access_log_{access_log}, handler_{handler},
+        ring_{std::move(ring)}, buffers_{recv_group, recv_buffers, recv_buffer_size}, slot_memory_{new char[file_slots * file_slot_size]} {}
+
+  char* slot_data(int slot) const noexcept{
+    return slot_memory_.get() + static_cast<size_t>(slot) * file_slot_size;
+  }
+
+  //Un accept multishot por socket de escucha; su finalizacion lleva el socket en user_data
+  bool arm_accept(int socket){
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if(sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(socket, uring_op::accept);
+    return true;
+  }
+
+  //Deja de aceptar conexiones (las que esperan en la cola de los sockets se quedan para otro
+  //proceso que los comparta) y cierra las persistentes que esperan la siguiente peticion
+  void start_drain(){
+    draining_ = true;
+    drain_deadline_ = std::chrono::steady_clock::now() + options_.drain_timeout;
+    for(const SafeFD& socket : sockets_){
+      io_uring_sqe* sqe = ring_.get_sqe();
+      if(sqe == nullptr) break;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = make_user_data(socket.get(), uring_op::accept);
+      sqe->user_data = make_user_data(socket.get(), uring_op::cancel);
+    }
+    close_idle();
+  }
+
+  void close_idle(){
+    for(auto& [fd, uc] : connections_){
+      if(uc.conn.state == connection_state::reading_request && uc.conn.served > 0 && uc.conn.request.empty()) close(uc);
+    }
+    release_finished();
+  }
+
+  //Libera las conexiones cerradas que ya no esperan ninguna finalizacion
+  void release_finished(){
+    for(auto it = connections_.begin(); it != connections_.end();){
+      if(it->second.conn.state == connection_state::done && it->second.inflight == 0) it = release(it);
+      else it++;
+    }
+  }
+
+  //Libera una conexion sin operaciones en curso, guardando sus buffers para las siguientes
+  connection_table::iterator release(connection_table::iterator it){
+    release_slot(it->second);
+    recycle_connection(it->second.conn, recycled_);
+    return connections_.erase(it);
+  }
+
+  //Su finalizacion no se espera: si falla, el buffer simplemente deja de usarse
+  bool provide_buffers(uint16_t first, unsigned count){
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if(sqe == nullptr) return false;
+    buffers_.provide(sqe, first, count);
+    sqe->user_data = make_user_data(0, uring_op::provide);
+    return true;
+  }
+
+  //Temporizador de un segundo para las tareas periodicas
+  bool arm_tick(){
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if(sqe == nullptr) return false;
+    tick_ = {1, 0};
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&tick_);
+    sqe->len = 1;
+    sqe->user_data = make_user_data(0, uring_op::tick);
+    return true;
+  }
+
+  //Poll multishot del notifier de la reserva de hilos de fs, si la hay
+  bool arm_fs_notify(){
+    if(options_.fs_pool == nullptr) return true;
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if(sqe == nullptr) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = options_.fs_pool->notifier();
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = make_user_data(0, uring_op::fs_notify);
+    return true;
+  }
+
+  //Vuelve a atender las peticiones de las conexiones cuyo fichero ya se ha cargado. Una
+  //conexion cerrada mientras esperaba puede haber dejado su descriptor a otra
+  void resume_waiting(){
+    options_.fs_pool->drain([this](int fd){
+      auto it = connections_.find(fd);
+      if(it == connections_.end() || it->second.conn.state != connection_state::waiting_file) return;
+      uring_connection& uc = it->second;
+      uc.conn.state = connection_state::reading_request;
+      uc.conn.last_active = std::chrono::steady_clock::now();
+      advance(uc);
+      if(uc.conn.state == connection_state::done && uc.inflight == 0) release(it);
+    });
+  }
+
+  io_uring_sqe* prepare(uring_connection& uc, uring_op op){
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if(sqe == nullptr) return nullptr;
+    sqe->user_data = make_user_data(uc.conn.fd.get(), op);
+    uc.inflight++;
+    return sqe;
+  }
+
+  void arm_recv(uring_connection& uc){
+    io_uring_sqe* sqe = prepare(uc, uring_op::recv);
+    if(sqe == nullptr) return close(uc);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc.conn.fd.get();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers_.group();
+    uc.receiving = true;
+  }
+
+  //Envia lo que quede de la cabecera y, si esta en memoria, del cuerpo, con un solo sendmsg
+  void send_header(uring_connection& uc){
+    connection& conn = uc.conn;
+    bool body_follows = conn.resp.body_follows();
+    std::string_view header = conn.resp.header;
+    std::string_view body = body_follows ? std::string_view() : conn.resp.body();
+    size_t skip = conn.sent;
+    size_t count{0};
+    for(std::string_view part : {header, body}){
+      if(skip >= part.size()){
+        skip -= part.size();
+        continue;
+      }
+      uc.parts[count++] = {const_cast<char*>(part.data() + skip), part.size() - skip};
+      skip = 0;
+    }
+    uc.message = msghdr{};
+    uc.message.msg_iov = uc.parts.data();
+    uc.message.msg_iovlen = count;
+
+    io_uring_sqe* sqe = prepare(uc, uring_op::send_header);
+    if(sqe == nullptr) return close(uc);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.fd.get();
+    sqe->addr = reinterpret_cast<uint64_t>(&uc.message);
+    sqe->len = 1;
+    //La cabecera de un cuerpo que va despues se retiene con MSG_MORE, como en el motor epoll
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (body_follows ? MSG_MORE : 0);
+  }
+
+  //Sigue con el trozo conn.part del fichero (ver response::segment), del que ya se han
+  //enviado conn.sent bytes contando su prefijo: primero el prefijo y despues el fichero por
+  //bloques del tamano del buffer registrado
+  void read_chunk(uring_connection& uc){
+    connection& conn = uc.conn;
+    const response& resp = conn.resp;
+    for(; conn.part < resp.segment_count(); conn.part++, conn.sent = 0){
+      body_segment segment = resp.segment(conn.part);
+      if(conn.sent < segment.prefix.size()){
+        bool last = segment.length == 0 && conn.part + 1 == resp.segment_count();
+        io_uring_sqe* sqe = prepare(uc, uring_op::part_prefix);
+        if(sqe == nullptr) return close(uc);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn.fd.get();
+        sqe->addr = reinterpret_cast<uint64_t>(segment.prefix.data() + conn.sent);
+        sqe->len = static_cast<uint32_t>(segment.prefix.size() - conn.sent);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (last ? 0 : MSG_MORE);
+        return;
+      }
+      size_t done = conn.sent - segment.prefix.size();
+      if(done == segment.length) continue;
+      io_uring_sqe* sqe = prepare(uc, uring_op::file_read);
+      if(sqe == nullptr) return close(uc);
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = resp.file->fd.get();
+      sqe->addr = reinterpret_cast<uint64_t>(slot_data(uc.slot));
+      sqe->len = static_cast<uint32_t>(std::min(file_slot_size, segment.length - done));
+      sqe->off = segment.offset + done;
+      sqe->buf_index = static_cast<uint16_t>(uc.slot);
+      return;
+    }
+    release_slot(uc);
+    finish(uc, resp.file_body_size());
+  }
+
+  void write_chunk(uring_connection& uc){
+    io_uring_sqe* sqe = prepare(uc, uring_op::file_write);
+    if(sqe == nullptr) return close(uc);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc.conn.fd.get();
+    sqe->addr = reinterpret_cast<uint64_t>(slot_data(uc.slot) + uc.chunk_sent);
+    sqe->len = static_cast<uint32_t>(uc.chunk - uc.chunk_sent);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  }
+
+  //Reenvia la salida del programa al socket. La operacion la completa un hilo del kernel,
+  //asi que la tuberia es bloqueante
+  void splice_pipe(uring_connection& uc){
+    io_uring_sqe* sqe = prepare(uc, uring_op::pipe_splice);
+    if(sqe == nullptr) return close(uc);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = uc.conn.fd.get();
+    sqe->off = UINT64_MAX;
+    sqe->splice_fd_in = uc.conn.resp.pipe.get();
+    sqe->splice_off_in = UINT64_MAX;
+    sqe->len = 1 << 16;
+    sqe->splice_flags = SPLICE_F_MOVE;
+  }
+
+  void start_body(uring_connection& uc){
+    connection& conn = uc.conn;
+    conn.state = connection_state::writing_body;
+    conn.sent = 0;
+    conn.part = 0;
+    if(conn.resp.use_sendfile()){
+      if(free_slots_.empty()){
+        waiting_slot_.push_back(conn.fd.get());
+        return;
+      }
+      uc.slot = free_slots_.back();
+      free_slots_.pop_back();
+      return read_chunk(uc);
+    }
+    if(conn.resp.pipe.is_valid()) return splice_pipe(uc);
+    finish(uc, conn.resp.body().size());
+  }
+
+  //Devuelve el buffer registrado y se lo pasa a la primera conexion que lo espera
+  void release_slot(uring_connection& uc){
+    if(uc.slot < 0) return;
+    free_slots_.push_back(uc.slot);
+    uc.slot = -1;
+    while(!waiting_slot_.empty()){
+      auto it = connections_.find(waiting_slot_.front());
+      waiting_slot_.pop_front();
+      if(it != connections_.end() && it->second.conn.state == connection_state::writing_body && it->second.slot < 0){
+        start_body(it->second);
+        break;
+      }
+    }
+  }
+
+  void finish(uring_connection& uc, size_t body_bytes){
+    connection& conn = uc.conn;
+    record_response(conn, metrics_, access_log_, conn.resp.header.size() + body_bytes);
+    conn.sent = 0;
+    conn.part = 0;
+    if(!conn.resp.keep_alive) return close(uc);
+    conn.resp.clear();
+    conn.state = connection_state::reading_request;
+    advance(uc);
+  }
+
+  //Atiende las peticiones que ya esten completas en el buffer hasta que haya que esperar
+  //a que el kernel termine un envio o a que lleguen mas datos
+  void advance(uring_connection& uc){
+    connection& conn = uc.conn;
+    if(conn.state != connection_state::reading_request) return;
+    http_request request;
+    std::expected<parse_status, int> status = parse_buffered(conn, request, metrics_);
+    if(!status) return close(uc);
+    if(status.value() == parse_status::incomplete){
+      if(!uc.receiving && !conn.closing) arm_recv(uc);
+      return;
+    }
+    std::expected<void, int> dispatched = dispatch_request(conn, status.value(), request, options_, metrics_, access_log_, handler_);
+    if(!dispatched){
+      std::cerr << "Error serving connection: " << std::strerror(dispatched.error()) << std::endl;
+      return close(uc);
+    }
+    if(conn.state == connection_state::done) return close(uc);
+    if(conn.state == connection_state::waiting_file) return;
+    send_header(uc);
+  }
+
+  //Marca la conexion para cerrarla y cancela su recv. El socket se cierra al liberarla,
+  //cuando el kernel ya no tiene ninguna operacion suya en curso
+  void close(uring_connection& uc){
+    uc.conn.state = connection_state::done;
+    if(!uc.receiving || uc.cancelling) return;
+    io_uring_sqe* sqe = prepare(uc, uring_op::cancel);
+    if(sqe == nullptr) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(uc.conn.fd.get(), uring_op::recv);
+    uc.cancelling = true;
+  }
+
+  void fail(uring_connection& uc, int error){
+    if(error != ECONNRESET && error != EPIPE && error != ECANCELED){
+      std::cerr << "Error serving connection: " << std::strerror(error) << std::endl;
+    }
+    close(uc);
+  }
+
+  void accept(int socket, const io_uring_cqe& cqe){
+    if(!(cqe.flags & IORING_CQE_F_MORE) && !draining_) arm_accept(socket);
+    if(cqe.res == -ECANCELED) return;
+    if(cqe.res < 0){
+      std::cerr << "Error accepting connection: " << std::strerror(-cqe.res) << std::endl;
+      return;
+    }
+    metrics_.connections.add();
+    if(options_.verbose) std::cerr << "Connection accepted ..." << std::endl;
+    uring_connection uc;
+    uc.conn.fd = SafeFD(cqe.res);
+    //El accept multishot no devuelve la direccion del cliente
+    socklen_t length{sizeof(uc.conn.client_addr)};
+    getpeername(cqe.res, reinterpret_cast<sockaddr*>(&uc.conn.client_addr), &length);
+    std::expected<connection_permit, limit_exceeded> permit = limits_.admit(client_key(uc.conn.client_addr));
+    if(!permit){
+      metrics_.rejected_connections.add();
+      return reject_connection(uc.conn.fd, permit.error());
+    }
+    uc.conn.permit = std::move(permit.value());
+    uc.conn.parser = HttpParser(options_.max_header_size);
+    equip_connection(uc.conn, recycled_);
+    uc.conn.last_active = std::chrono::steady_clock::now();
+    auto [it, inserted] = connections_.insert_or_assign(cqe.res, std::move(uc));
+    arm_recv(it->second);
+  }
+
+  void receive(uring_connection& uc, const io_uring_cqe& cqe){
+    connection& conn = uc.conn;
+    uc.receiving = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if(cqe.flags & IORING_CQE_F_BUFFER){
+      uint16_t id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      if(cqe.res > 0){
+        if(conn.request.empty()) conn.request_started = std::chrono::steady_clock::now();
+        conn.request.append(buffers_.get(id, static_cast<size_t>(cqe.res)));
+      }
+      provide_buffers(id, 1);
+    }
+    if(cqe.res == 0) conn.closing = true;
+    //Sin buffers libres el recv se vuelve a armar en advance, tras devolverlos
+    else if(cqe.res < 0 && cqe.res != -ENOBUFS) return fail(uc, -cqe.res);
+    advance(uc);
+  }
+
+  void complete(const io_uring_cqe& cqe){
+    int fd = static_cast<int>(cqe.user_data >> 8);
+    uring_op op = static_cast<uring_op>(cqe.user_data & 0xff);
+    if(op == uring_op::accept) return accept(fd, cqe);
+    if(op == uring_op::provide) return;
+    if(op == uring_op::tick){
+      sweep();
+      if(draining_) close_idle();
+      arm_tick();
+      return;
+    }
+    if(op == uring_op::fs_notify){
+      if(!(cqe.flags & IORING_CQE_F_MORE)) arm_fs_notify();
+      return resume_waiting();
+    }
+
+    auto it = connections_.find(fd);
+    if(it == connections_.end()) return;
+    uring_connection& uc = it->second;
+    connection& conn = uc.conn;
+    if(op != uring_op::recv || !(cqe.flags & IORING_CQE_F_MORE)) uc.inflight--;
+    conn.last_active = std::chrono::steady_clock::now();
+
+    if(op == uring_op::recv) receive(uc, cqe);
+    else if(conn.state == connection_state::done){}
+    else if(cqe.res < 0) fail(uc, -cqe.res);
+    else if(op == uring_op::send_header){
+      conn.sent += static_cast<size_t>(cqe.res);
+      size_t total = conn.resp.header.size() + (conn.resp.body_follows() ? 0 : conn.resp.body().size());
+      if(conn.sent < total) send_header(uc);
+      else start_body(uc);
+    }
+    else if(op == uring_op::part_prefix){
+      conn.sent += static_cast<size_t>(cqe.res);
+      read_chunk(uc);
+    }
+    else if(op == uring_op::file_read){
+      //El fichero ha encogido desde que se abrio: ya no se puede cumplir el Content-Length
+      if(cqe.res == 0) fail(uc, EIO);
+      else{
+        uc.chunk = static_cast<size_t>(cqe.res);
+        uc.chunk_sent = 0;
+        write_chunk(uc);
+      }
+    }
+    else if(op == uring_op::file_write){
+      uc.chunk_sent += static_cast<size_t>(cqe.res);
+      if(uc.chunk_sent < uc.chunk) write_chunk(uc);
+      else{
+        conn.sent += uc.chunk;
+        read_chunk(uc);
+      }
+    }
+    else if(op == uring_op::pipe_splice){
+      if(cqe.res > 0){
+        conn.sent += static_cast<size_t>(cqe.res);
+        splice_pipe(uc);
+      }
+      else{
+        metrics_.cgi.record(std::chrono::steady_clock::now() - conn.resp.started);
+        finish(uc, conn.sent);
+      }
+    }
+
+    if(uc.conn.state == connection_state::done){
+      close(uc);
+      if(uc.inflight == 0) release(it);
+    }
+  }
+
+  //Igual que en el motor epoll: cierra las conexiones que superan sus plazos, mata los
+  //programas que superan el suyo y recoge los que ya han terminado
+  void sweep(){
+    auto now = std::chrono::steady_clock::now();
+    for(auto& [fd, uc] : connections_){
+      connection& conn = uc.conn;
+      if(conn.resp.child > 0 && now > conn.resp.deadline){
+        //Al morir el grupo se cierra la tuberia y el splice en curso termina; su finalizacion
+        //se descarta. Sin shutdown: enviaria un FIN antes del RST
+        kill_program(conn, metrics_, access_log_);
+        close(uc);
+      }
+      else if(connection_expired(conn, options_, now)){
+        //Un envio a un cliente que no lee no termina nunca: shutdown lo hace fallar
+        if(conn.state != connection_state::reading_request){
+          set_reset_on_close(conn.fd);
+          shutdown(conn.fd.get(), SHUT_RDWR);
+        }
+        close(uc);
+      }
+    }
+    //Las que no esperan ninguna finalizacion se liberan aqui
+    release_finished();
+    while(waitpid(-1, nullptr, WNOHANG) > 0){}
+  }
+
+  const std::vector<SafeFD>& sockets_;
+  const event_loop_options& options_;
+  worker_metrics& metrics_;
+  ConnectionLimits& limits_;
+  AccessLog* access_log_;
+  const request_handler& handler_;
+  IoUring ring_;
+  ProvidedBuffers buffers_;
+  std::unique_ptr<char[]> slot_memory_;
+  std::vector<int> free_slots_;
+  //Conexiones que esperan un buffer registrado para enviar su fichero
+  std::deque<int> waiting_slot_;
+  //Los nodos de las conexiones salen de un pool y sus buffers de los de conexiones cerradas: en
+  //regimen estable atender peticiones no reserva memoria. El pool va aparte para que el
+  //UringLoop se pueda mover
+  std::unique_ptr<std::pmr::unsynchronized_pool_resource> connection_memory_{std::make_unique<std::pmr::unsynchronized_pool_resource>()};
+  BufferPool recycled_{pooled_buffers, pooled_buffer_capacity};
+  connection_table connections_{connection_memory_.get()};
+  __kernel_timespec tick_{};
+  bool draining_{false};
+  std::chrono::steady_clock::time_point drain_deadline_;
+};
+
+
+//Bucle con io_uring, alternativo a run_event_loop. Retorna al terminar de cerrar el servidor
+//o si falla el propio io_uring
+int run_uring_loop(const std::vector<SafeFD>& sockets, const event_loop_options& options, worker_metrics& metrics, ConnectionLimits& limits,
+                   AccessLog* access_log, const request_handler& handler){
+  std::expected<UringLoop, int> loop = UringLoop::create(sockets, options, metrics, limits, access_log, handler);
+  if(!loop) return loop.error();
+  return loop.value().run();
+}
@@ -0,0 +1,101 @@
+#!/bin/bash
+# Comprueba que atender peticiones en regimen estable no reserva memoria dinamica. Con un solo
+# trabajador abre una conexion persistente y le envia rondas de peticiones encadenadas (cada
+# ronda en una sola escritura): un fichero pequeno por sendfile, un indice de directorio, un
+# Range, un 304 con If-None-Match, un binario y un 404 de la cache negativa. Unas rondas
+# calientan las caches y los buffers de la conexion; despues se leen tres veces seguidas por
+# la misma conexion el contador docserver_heap_allocations_total de /metrics, con REPEAT rondas
+# entre la primera y la segunda. Cada lectura de /metrics reserva la suya (el texto que genera),
+# que es lo que hay entre la segunda y la tercera y se descuenta. Termina con error si las
+# rondas han reservado algo, aunque sea una vez, o si no han dado las respuestas esperadas.
+# El motor bloqueante no mantiene conexiones persistentes y no se comprueba. El contador solo
+# lo tiene el servidor compilado con DOCSERVER_COUNT_ALLOCATIONS (server-allocations).
+# Uso: bench/allocations.sh [puerto]   (desde el directorio con server-allocations compilado).
+#      ENGINES elige los motores (por defecto "epoll io_uring")
+
+PORT=${1:-8080}
+SERVER=${SERVER:-./server-allocations}
+ENGINES=${ENGINES:-epoll io_uring}
+WARMUP=${WARMUP:-20}
+REPEAT=${REPEAT:-200}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+bench/fixtures.sh "$DIR" > /dev/null
+
+# request <ruta> [cabecera]...
+request() {
+  local TARGET=$1
+  shift
+  printf "GET %s HTTP/1.1\r\nHost: localhost\r\n" "$TARGET"
+  for HEADER in "$@"; do printf "%s\r\n" "$HEADER"; done
+  printf "\r\n"
+}
+
+# Las respuestas de una ronda: 200, 200, 206, 304, 200 y 404. Se espera a la ultima antes de
+# seguir: con io_uring el recv multishot sigue leyendo lo encadenado mientras se envian las
+# respuestas, y si las rondas se acumulasen el buffer de la peticion creceria con ellas
+SEEN=0
+round() {
+  {
+    request /static/small.html
+    request /site/
+    request /static/page.html "Range: bytes=100-199"
+    request /static/style.css "If-None-Match: $ETAG"
+    request /static/4k.bin
+    request /nonexistent.html
+  } >&3
+  until tail -c +$((SEEN + 1)) "$DIR/responses" | grep -a -q "HTTP/1.1 404"; do sleep 0.01; done
+  SEEN=$(stat -c %s "$DIR/responses")
+}
+
+# ETag de un fichero, en una conexion aparte
+etag() {
+  exec 4<>"/dev/tcp/127.0.0.1/$PORT"
+  printf "GET %s HTTP/1.0\r\n\r\n" "$1" >&4
+  tr -d '\r' <&4 | awk 'tolower($1) == "etag:" { print $2; exit }'
+  exec 4<&-
+}
+
+STATUS=0
+ROUNDS=$((WARMUP + REPEAT))
+for ENGINE in $ENGINES; do
+  # Todas las peticiones van por la misma conexion
+  "$SERVER" -p "$PORT" -b "$DIR" -e "$ENGINE" -w 1 --metrics-path /metrics --max-requests $((ROUNDS * 6 + 4)) &
+  PID=$!
+  sleep 1
+  ETAG=$(etag /static/style.css)
+
+  exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+  : > "$DIR/responses"
+  SEEN=0
+  cat <&3 > "$DIR/responses" &
+  READER=$!
+  for ((i = 0; i < WARMUP; i++)); do round; done
+  request /metrics >&3
+  sleep 0.5
+  request /metrics >&3
+  for ((i = 0; i < REPEAT; i++)); do round; done
+  request /metrics >&3
+  request /metrics "Connection: close" >&3
+  wait $READER
+  exec 3<&-
+
+  # Los valores de las cuatro lecturas de /metrics, en orden. Un cuerpo que no acaba en salto
+  # de linea (como el del Range) deja la linea de estado siguiente a mitad de linea
+  read -r -a COUNTS <<< "$(tr -d '\r' < "$DIR/responses" | awk '/^docserver_heap_allocations_total/ { printf "%s ", $NF }')"
+  NOT_MODIFIED=$(grep -a -o "HTTP/1.1 304" "$DIR/responses" | wc -l)
+  PARTIAL=$(grep -a -o "HTTP/1.1 206" "$DIR/responses" | wc -l)
+  NOT_FOUND=$(grep -a -o "HTTP/1.1 404" "$DIR/responses" | wc -l)
+  if [ "${#COUNTS[@]}" -ne 4 ] || [ "$NOT_MODIFIED" -ne "$ROUNDS" ] || [ "$PARTIAL" -ne "$ROUNDS" ] || [ "$NOT_FOUND" -ne "$ROUNDS" ]; then
+    printf "%s\trespuestas inesperadas (%d lecturas de /metrics, %d 304, %d 206, %d 404 de %d)\n" "$ENGINE" "${#COUNTS[@]}" "$NOT_MODIFIED" "$PARTIAL" "$NOT_FOUND" "$ROUNDS"
+    STATUS=1
+  else
+    ALLOCATIONS=$(( (COUNTS[2] - COUNTS[1]) - (COUNTS[3] - COUNTS[2]) ))
+    printf "%s\t%d reservas en %d peticiones\n" "$ENGINE" "$ALLOCATIONS" "$((REPEAT * 6))"
+    [ "$ALLOCATIONS" -ne 0 ] && STATUS=1
+  fi
+  kill $PID
+  wait $PID 2>/dev/null
+done
+exit $STATUS
@@ -0,0 +1,64 @@
+//Coste de comprimir al vuelo los documentos: para cada fichero pasado como argumento (o los
+//de ejemplo si no hay ninguno) muestra los bytes que viajarian por la red sin comprimir y con
+//gzip a varios niveles, y el tiempo de CPU que cuesta cada compresion. La cache de variantes
+//solo paga este coste la primera vez que se pide cada version de un fichero
+//Uso: bench/compression [fichero...]
+
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <vector>
+
+#include "../Compression.h"
+
+
+//Documentos de texto tipicos: HTML con marcado repetitivo y texto plano
+std::vector<std::pair<std::string, std::string>> sample_documents(){
+  std::string html{"<!DOCTYPE html>\n<html><head><title>Documentacion</title></head><body>\n"};
+  for(int i = 0; i < 200; i++){
+    html += "<div class=\"entry\"><h2>Seccion " + std::to_string(i) + "</h2><p>Descripcion del apartado " + std::to_string(i)
+          + " con enlaces a <a href=\"/docs/" + std::to_string(i) + ".html\">mas detalles</a>.</p></div>\n";
+  }
+  html += "</body></html>\n";
+  std::string text;
+  for(int i = 0; i < 500; i++) text += "Linea " + std::to_string(i) + ": el servidor envia documentos de texto a los clientes.\n";
+  return {{"sample.html", html}, {"sample.txt", text}};
+}
+
+
+int main(int argc, char* argv[]){
+  std::vector<std::pair<std::string, std::string>> documents;
+  for(int i = 1; i < argc; i++){
+    std::ifstream file(argv[i], std::ios::binary);
+    if(!file){
+      std::cerr << "Error opening " << argv[i] << std::endl;
+      return 1;
+    }
+    std::ostringstream content;
+    content << file.rdbuf();
+    documents.emplace_back(argv[i], content.str());
+  }
+  if(documents.empty()) documents = sample_documents();
+
+  for(const auto& [name, content] : documents){
+    std::cout << name << ": " << content.size() << " bytes" << std::endl;
+    for(int level : {1, 6, 9}){
+      const size_t iterations{std::clamp<size_t>(20000000 / (content.size() + 1), 10, 2000)};
+      size_t compressed_size{0};
+      auto start = std::chrono::steady_clock::now();
+      for(size_t i = 0; i < iterations; i++){
+        std::expected<std::string, int> compressed = gzip_compress(content, level);
+        if(!compressed) return 1;
+        compressed_size = compressed.value().size();
+      }
+      double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / static_cast<double>(iterations);
+      std::cout << "  gzip -" << level << ": " << compressed_size << " bytes ("
+                << 100.0 * static_cast<double>(compressed_size) / static_cast<double>(content.size()) << "%), "
+                << us << " us/compression, " << static_cast<double>(content.size()) / us << " MB/s" << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Compara los motores epoll, io_uring y blocking: throughput, tiempo de CPU y cambios de contexto
+# del servidor por peticion y, si hay strace, llamadas al sistema por peticion (en una segunda
+# tanda, porque strace ralentiza el servidor).
+# Uso: bench/engines.sh [puerto] [ruta]   (desde el directorio con server y loadgen compilados)
+
+PORT=${1:-8080}
+URL_PATH=${2:-/foo.txt}
+REQUESTS=5000
+CONCURRENCY=8
+TICKS=$(getconf CLK_TCK)
+
+# utime + stime del proceso en ticks
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+context_switches() {
+  awk '/ctxt_switches/ { total += $2 } END { print total }' "/proc/$1/status"
+}
+
+run() {
+  ./server -p "$PORT" -e "$1" &
+  PID=$!
+  sleep 1
+  CPU_BEFORE=$(cpu_ticks $PID)
+  CS_BEFORE=$(context_switches $PID)
+  echo "== $1"
+  ./loadgen -p "$PORT" -c "$CONCURRENCY" -n "$REQUESTS" -u "$URL_PATH" | grep -E "throughput|p99"
+  CPU_AFTER=$(cpu_ticks $PID)
+  CS_AFTER=$(context_switches $PID)
+  echo "cpu us/request: $(( (CPU_AFTER - CPU_BEFORE) * 1000000 / TICKS / REQUESTS ))"
+  echo "context switches/request: $(awk -v d=$((CS_AFTER - CS_BEFORE)) -v n=$REQUESTS 'BEGIN { printf "%.2f", d / n }')"
+  kill $PID
+  wait $PID 2>/dev/null
+
+  if command -v strace > /dev/null; then
+    # Los hilos del kernel de io_uring no aparecen en strace: solo se cuentan las llamadas del servidor
+    strace -f -c -o "$TRACE" ./server -p "$PORT" -e "$1" &
+    PID=$!
+    sleep 1
+    ./loadgen -p "$PORT" -c "$CONCURRENCY" -n "$REQUESTS" -u "$URL_PATH" > /dev/null
+    kill -INT $PID
+    wait $PID 2>/dev/null
+    SYSCALLS=$(awk '$NF == "total" { print $4 }' "$TRACE")
+    echo "syscalls/request: $(awk -v d="$SYSCALLS" -v n=$REQUESTS 'BEGIN { printf "%.1f", d / n }')"
+  fi
+}
+
+TRACE=$(mktemp)
+trap 'rm -f "$TRACE"' EXIT
+
+run epoll
+run io_uring
+run blocking
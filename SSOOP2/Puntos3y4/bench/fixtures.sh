@@ -0,0 +1,53 @@
+#!/bin/bash
+# Crea un directorio base de prueba para el servidor con ficheros de varios tamanos y tipos, un
+# hermano precomprimido, un directorio con muchas entradas, un indice y un programa para /bin.
+# Los ficheros de texto tienen siempre el mismo contenido; los binarios son aleatorios, pero solo
+# importa su tamano porque no se comprimen. Tambien escribe mix.txt, una mezcla para loadgen -m.
+# Uso: bench/fixtures.sh <directorio> [entradas del directorio grande]
+
+set -e
+
+DIR=${1:?Uso: bench/fixtures.sh <directorio> [entradas del directorio grande]}
+ENTRIES=${2:-10000}
+
+mkdir -p "$DIR/static" "$DIR/many" "$DIR/site" "$DIR/bin"
+
+# Texto repetitivo, que se comprime bien como el HTML o el CSS reales
+text() {
+  seq 1 "$1" | sed 's/.*/<p class="line">Linea & del documento de prueba del servidor<\/p>/'
+}
+
+echo "hola" > "$DIR/foo.txt"
+text 20 > "$DIR/static/small.html"
+text 400 > "$DIR/static/page.html"
+text 2000 > "$DIR/static/style.css"
+gzip -9 -k -f -n "$DIR/static/style.css"
+for SIZE in 4k:4096 64k:65536 1m:1048576 16m:16777216; do
+  head -c "${SIZE##*:}" /dev/urandom > "$DIR/static/${SIZE%%:*}.bin"
+done
+
+# Nombres con ceros a la izquierda para que el listado tenga siempre el mismo orden
+(cd "$DIR/many" && seq -f "file-%06g.txt" 1 "$ENTRIES" | xargs touch)
+
+text 50 > "$DIR/site/index.html"
+
+cat > "$DIR/bin/hello.sh" <<'EOF'
+#!/bin/sh
+echo "Hola desde $REQUEST_PATH"
+EOF
+chmod +x "$DIR/bin/hello.sh"
+
+# Sobre todo ficheros pequenos, como la mayoria de los sitios
+cat > "$DIR/mix.txt" <<'EOF'
+# peso ruta
+40 /static/small.html
+20 /static/page.html
+10 /static/style.css
+15 /static/4k.bin
+8 /static/64k.bin
+2 /static/1m.bin
+3 /site/
+2 /nonexistent.html
+EOF
+
+echo "$DIR"
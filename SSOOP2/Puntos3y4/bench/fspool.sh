@@ -0,0 +1,70 @@
+#!/bin/bash
+# Comprueba que la reserva de hilos de fs hace sola el trabajo que se le encarga: con un solo
+# trabajador y una cache de ficheros demasiado pequena para el fichero de 16 MB, pide ese
+# fichero REQUESTS veces. Cada peticion tiene que cargarlo una vez, en la reserva, y servirse
+# de esa carga aunque la cache no la guarde: tantas tareas y fallos de la cache como peticiones
+# y ninguna carga en el hilo de red (docserver_fs_inline_total). Despues pide REQUESTS veces
+# el programa de /bin, cuya comprobacion tambien hace la reserva: una tarea mas por peticion y
+# ninguna en el hilo de red. Termina con error si no.
+# Uso: bench/fspool.sh [puerto]   (desde el directorio con server compilado).
+#      ENGINES elige los motores (por defecto "epoll io_uring"; el bloqueante no usa la reserva)
+
+PORT=${1:-8080}
+SERVER=${SERVER:-./server}
+ENGINES=${ENGINES:-epoll io_uring}
+REQUESTS=${REQUESTS:-5}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+bench/fixtures.sh "$DIR" 10 > /dev/null
+SIZE=$(stat -c %s "$DIR/static/16m.bin")
+
+# get <ruta>: tamano de la respuesta completa, cabecera incluida
+get() {
+  exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+  printf "GET %s HTTP/1.0\r\n\r\n" "$1" >&3
+  wc -c <&3
+  exec 3<&-
+}
+
+# metric <nombre>: suma de todos los trabajadores
+metric() {
+  exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+  printf "GET /metrics HTTP/1.0\r\n\r\n" >&3
+  tr -d '\r' <&3 | awk -v name="$1" '$1 ~ "^" name "({|$)" { total += $NF } END { print total + 0 }'
+  exec 3<&-
+}
+
+STATUS=0
+for ENGINE in $ENGINES; do
+  # --cache-size en MB: 1 no basta para el fichero
+  "$SERVER" -p "$PORT" -b "$DIR" -e "$ENGINE" -w 1 --metrics-path /metrics --cache-size 1 &
+  PID=$!
+  sleep 1
+  SHORT=0
+  for ((i = 0; i < REQUESTS; i++)); do
+    [ "$(get /static/16m.bin)" -gt "$SIZE" ] || SHORT=$((SHORT + 1))
+  done
+  TASKS=$(metric docserver_fs_tasks_total)
+  INLINE=$(metric docserver_fs_inline_total)
+  MISSES=$(metric docserver_file_cache_misses_total)
+  printf "%s/ficheros\t%d tareas, %d cargas en el hilo de red, %d fallos de la cache, %d respuestas incompletas en %d peticiones\n" \
+         "$ENGINE" "$TASKS" "$INLINE" "$MISSES" "$SHORT" "$REQUESTS"
+  if [ "$TASKS" -ne "$REQUESTS" ] || [ "$INLINE" -ne 0 ] || [ "$MISSES" -ne "$REQUESTS" ] || [ "$SHORT" -ne 0 ]; then STATUS=1; fi
+
+  FAILED=0
+  for ((i = 0; i < REQUESTS; i++)); do
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+    printf "GET /bin/hello.sh HTTP/1.0\r\n\r\n" >&3
+    grep -q "Hola desde /bin/hello.sh" <&3 || FAILED=$((FAILED + 1))
+    exec 3<&-
+  done
+  PROGRAM_TASKS=$(( $(metric docserver_fs_tasks_total) - TASKS ))
+  INLINE=$(metric docserver_fs_inline_total)
+  printf "%s/programas\t%d tareas, %d en el hilo de red, %d respuestas sin la salida del programa en %d peticiones\n" \
+         "$ENGINE" "$PROGRAM_TASKS" "$INLINE" "$FAILED" "$REQUESTS"
+  if [ "$PROGRAM_TASKS" -ne "$REQUESTS" ] || [ "$INLINE" -ne 0 ] || [ "$FAILED" -ne 0 ]; then STATUS=1; fi
+  kill $PID
+  wait $PID 2>/dev/null
+done
+exit $STATUS
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Segmentos TCP por respuesta y throughput. Cuenta OutSegs de /proc/net/snmp antes y despues de
+# una tanda de peticiones; en loopback incluye tambien los segmentos del cliente (SYN, ACK, FIN).
+# Uso: bench/packets.sh [puerto] [ruta]   (desde el directorio con server y loadgen compilados)
+
+PORT=${1:-8080}
+URL_PATH=${2:-/foo.txt}
+REQUESTS=2000
+
+out_segs() {
+  awk '/^Tcp:/ { if (!header) { for (i = 1; i <= NF; i++) if ($i == "OutSegs") col = i; header = 1 } else print $col }' /proc/net/snmp
+}
+
+./server -p "$PORT" &
+PID=$!
+sleep 1
+
+BEFORE=$(out_segs)
+./loadgen -p "$PORT" -c 1 -n "$REQUESTS" -u "$URL_PATH" | grep -E "throughput|p50"
+AFTER=$(out_segs)
+echo "segments/request: $(( (AFTER - BEFORE) / REQUESTS ))"
+
+kill $PID
+wait $PID 2>/dev/null
@@ -0,0 +1,97 @@
+//Microbenchmark del analizador de peticiones: compara HttpParser con el analisis original
+//(std::istringstream sobre una copia de la peticion) en ns por peticion, y comprueba que
+//trocear la peticion en fragmentos al azar, como llegaria en varios segmentos TCP, da el
+//mismo resultado que analizarla entera
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "../HttpParser.h"
+
+
+const std::vector<std::string> requests{
+  "GET /foo.txt\n",
+  "GET /foo.txt HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n",
+  "GET /docs/manual/index.html HTTP/1.1\r\nHost: example.org\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+  "Accept: text/html,application/xhtml+xml\r\nAccept-Language: es-ES,es;q=0.9\r\nAccept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\nCache-Control: max-age=0\r\n\r\n",
+};
+
+
+//Analisis original de docserver: metodo y ruta con un istringstream
+void parse_istringstream(std::string_view request, std::string& method, std::string& path){
+  std::istringstream iss{std::string(request)};
+  iss >> method >> path;
+}
+
+
+template <typename F>
+double time_ns(size_t iterations, F&& f){
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < iterations; i++) f(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(iterations);
+}
+
+
+int main(){
+  const size_t iterations{1000000};
+  volatile size_t sink{0};
+
+  for(const std::string& request : requests){
+    double parser_ns = time_ns(iterations, [&](size_t){
+      HttpParser parser;
+      http_request parsed;
+      parser.parse(request, parsed);
+      sink = sink + parsed.target.size();
+    });
+    double istringstream_ns = time_ns(iterations, [&](size_t){
+      std::string method, path;
+      parse_istringstream(request, method, path);
+      sink = sink + path.size();
+    });
+    std::cout << request.size() << " bytes: HttpParser " << parser_ns << " ns/request, istringstream "
+              << istringstream_ns << " ns/request" << std::endl;
+  }
+
+  //Comprobacion de consistencia: cada peticion (a veces con un byte alterado) se entrega
+  //en trozos de tamano aleatorio y se compara con analizarla entera
+  std::mt19937 random(42);
+  size_t mismatches{0};
+  for(size_t i = 0; i < 100000; i++){
+    std::string request = requests[i % requests.size()];
+    if(i % 3 == 0) request[std::uniform_int_distribution<size_t>(0, request.size() - 1)(random)] = static_cast<char>(random());
+
+    HttpParser whole_parser;
+    http_request whole;
+    parse_status whole_status = whole_parser.parse(request, whole);
+
+    http_request pieces;
+    std::string buffer;
+    HttpParser parser;
+    parse_status status{parse_status::incomplete};
+    size_t pos{0};
+    while(status == parse_status::incomplete && pos < request.size()){
+      size_t piece = std::uniform_int_distribution<size_t>(1, request.size() - pos)(random);
+      buffer.append(request, pos, piece);
+      pos += piece;
+      status = parser.parse(buffer, pieces);
+    }
+    bool same = status == whole_status;
+    if(same && status == parse_status::complete){
+      same = pieces.method == whole.method && pieces.target == whole.target && pieces.version == whole.version
+          && pieces.header_count == whole.header_count && pieces.length == whole.length;
+      for(size_t h = 0; same && h < whole.header_count; h++){
+        same = pieces.headers[h].name == whole.headers[h].name && pieces.headers[h].value == whole.headers[h].value;
+      }
+    }
+    if(!same) mismatches++;
+  }
+  std::cout << "split/corrupted consistency: " << mismatches << " mismatches" << std::endl;
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+#!/bin/bash
+# Sondas de protocolo: envia peticiones a mano por una conexion y comprueba las respuestas con
+# cada motor. Una peticion con cuerpo (Content-Length o Transfer-Encoding) se rechaza y cierra
+# la conexion: su cuerpo no se puede tomar por otra peticion encadenada. Solo se sirven HTTP/1.0
+# y HTTP/1.1; otra version bien formada recibe un 505. Un programa de /bin que supera
+# --cgi-timeout no puede dar una respuesta completa: el motor bloqueante responde 504 y los
+# demas, que ya han enviado la cabecera del 200, cortan la conexion con un RST (curl falla).
+# Las metricas solo se sirven con --metrics-path: sin la opcion /metrics es un fichero mas. Solo
+# lo que hay bajo /bin/ son programas: /binary.txt es un fichero.
+# Termina con error si alguna sonda falla.
+# Uso: bench/protocol.sh [puerto]   (desde el directorio con server compilado).
+#      ENGINES elige los motores (por defecto "epoll io_uring blocking")
+
+PORT=${1:-8080}
+SERVER=${SERVER:-./server}
+ENGINES=${ENGINES:-epoll io_uring blocking}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+bench/fixtures.sh "$DIR" 10 > /dev/null
+printf '#!/bin/sh\necho "Salida parcial"\nsleep 30\n' > "$DIR/bin/slow.sh"
+chmod +x "$DIR/bin/slow.sh"
+echo "No es un programa" > "$DIR/binary.txt"
+
+# exchange <peticion en formato printf>: todas las lineas de estado de las respuestas, separadas
+# por espacios. El servidor tiene que cerrar la conexion. La peticion sale en una sola escritura
+# (printf escribe por trozos): si el servidor cierra tras la cabecera, un cuerpo que llega
+# despues provoca un RST que puede descartar la respuesta
+exchange() {
+  printf "$1" > "$DIR/request"
+  exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+  cat "$DIR/request" >&3
+  timeout 5 cat <&3 | tr -d '\r' | grep -a -o "HTTP/1\.[01] [0-9][0-9][0-9]" | cut -d ' ' -f 2 | paste -s -d ' '
+  exec 3<&-
+}
+
+# probe <nombre> <estados esperados> <peticion>
+probe() {
+  local GOT
+  GOT=$(exchange "$3")
+  if [ "$GOT" = "$2" ]; then
+    printf "%s/%s\tok\n" "$ENGINE" "$1"
+  else
+    printf "%s/%s\tFALLA: se esperaba \"%s\" y se ha recibido \"%s\"\n" "$ENGINE" "$1" "$2" "$GOT"
+    STATUS=1
+  fi
+}
+
+# Otra peticion de 34 bytes escondida en el cuerpo
+HIDDEN='GET /foo.txt HTTP/1.1\r\nHost: x\r\n\r\n'
+
+STATUS=0
+for ENGINE in $ENGINES; do
+  "$SERVER" -p "$PORT" -b "$DIR" -e "$ENGINE" -w 1 --cgi-timeout 1 &
+  PID=$!
+  sleep 1
+  # El motor bloqueante atiende una peticion por conexion
+  if [ "$ENGINE" = blocking ]; then ZERO_LENGTH="200"; else ZERO_LENGTH="200 200"; fi
+  probe content-length "413" "GET /foo.txt HTTP/1.1\r\nHost: x\r\nContent-Length: 34\r\n\r\n$HIDDEN"
+  probe chunked "400" "GET /foo.txt HTTP/1.1\r\nHost: x\r\nTransfer-Encoding: chunked\r\n\r\n22\r\n$HIDDEN\r\n0\r\n\r\n"
+  probe chunked-and-length "400" "GET /foo.txt HTTP/1.1\r\nHost: x\r\nContent-Length: 34\r\nTransfer-Encoding: chunked\r\n\r\n$HIDDEN"
+  probe bad-length "400" "GET /foo.txt HTTP/1.1\r\nHost: x\r\nContent-Length: 3x\r\n\r\n"
+  probe zero-length "$ZERO_LENGTH" "GET /foo.txt HTTP/1.1\r\nHost: x\r\nContent-Length: 0\r\n\r\nGET /foo.txt HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+  probe http10 "200" "GET /foo.txt HTTP/1.0\r\n\r\n"
+  probe http2 "505" "GET /foo.txt HTTP/2.0\r\nHost: x\r\n\r\n"
+  probe http99 "505" "GET /foo.txt HTTP/9.9\r\nHost: x\r\n\r\n"
+  probe http12 "505" "GET /foo.txt HTTP/1.2\r\nHost: x\r\n\r\n"
+  probe bad-version "400" "GET /foo.txt HTTP/one\r\nHost: x\r\n\r\n"
+  probe no-metrics "404" "GET /metrics HTTP/1.0\r\n\r\n"
+  probe not-bin "200" "GET /binary.txt HTTP/1.0\r\n\r\n"
+  probe bin "200" "GET /bin/hello.sh HTTP/1.0\r\n\r\n"
+  CODE=$(curl -s -o /dev/null -w "%{http_code}" --max-time 10 "http://127.0.0.1:$PORT/bin/slow.sh")
+  RESULT=$?
+  if [ "$ENGINE" = blocking ]; then EXPECTED="504 0"; else EXPECTED="200 56"; fi
+  if [ "$CODE $RESULT" = "$EXPECTED" ]; then
+    printf "%s/cgi-timeout\tok\n" "$ENGINE"
+  else
+    printf "%s/cgi-timeout\tFALLA: se esperaba \"%s\" (estado y salida de curl) y se ha recibido \"%s\"\n" "$ENGINE" "$EXPECTED" "$CODE $RESULT"
+    STATUS=1
+  fi
+  kill $PID
+  wait $PID 2>/dev/null
+done
+exit $STATUS
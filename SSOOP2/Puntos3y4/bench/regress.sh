@@ -0,0 +1,71 @@
+#!/bin/bash
+# Bateria de escenarios para seguir el rendimiento del servidor entre versiones: crea un directorio
+# base con bench/fixtures.sh, arranca el servidor con cada motor y escribe una linea TSV por
+# escenario (throughput, latencias y CPU del servidor por peticion, ver loadgen --tsv). Con un
+# fichero de referencia de una ejecucion anterior marca los escenarios cuyo throughput baja o
+# cuya latencia p99 o CPU por peticion sube mas de THRESHOLD por ciento, y termina con error.
+# server se compila con sanitizers: para medir conviene compilarlo con -O2 sin ellos y pasarlo
+# en SERVER. Los escenarios -unix repiten algunos por un socket Unix, para compararlos con TCP.
+# Uso: bench/regress.sh [puerto] [resultados.tsv] [referencia.tsv]   (desde el directorio con
+#      server y loadgen compilados). ENGINES elige los motores (por defecto "epoll io_uring blocking")
+
+PORT=${1:-8080}
+RESULTS=${2:-results.tsv}
+BASELINE=$3
+SERVER=${SERVER:-./server}
+ENGINES=${ENGINES:-epoll io_uring blocking}
+THRESHOLD=${THRESHOLD:-10}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+bench/fixtures.sh "$DIR" > /dev/null
+
+printf "scenario\tok\terrors\thttp_errors\tseconds\treq_s\tmb_s\tp50_us\tp90_us\tp99_us\tp999_us\tmax_us\tserver_cpu_us\n" > "$RESULTS"
+
+# scenario <nombre> <opciones de loadgen>...
+scenario() {
+  local NAME=$1
+  shift
+  local LINE
+  LINE=$(./loadgen -p "$PORT" --server-pid "$PID" --seed 1 --tsv "$@")
+  printf "%s\t%s\n" "$ENGINE/$NAME" "$LINE" | tee -a "$RESULTS"
+}
+
+for ENGINE in $ENGINES; do
+  "$SERVER" -l "$PORT" -l "unix:$DIR/docserver.sock" -b "$DIR" -e "$ENGINE" --listing &
+  PID=$!
+  sleep 1
+  # Conexion por peticion y conexiones persistentes con el mismo fichero pequeno
+  scenario small-simple -c 8 -n 5000 --warmup 500 -u /static/small.html
+  scenario small-keepalive -k -c 8 -n 20000 --warmup 500 -u /static/small.html
+  # Mezcla de tamanos como la de un sitio real
+  scenario mix-close --http -c 32 -n 5000 --warmup 500 -m "$DIR/mix.txt"
+  scenario mix-keepalive -k -c 32 -n 20000 --warmup 500 -m "$DIR/mix.txt"
+  scenario gzip-keepalive -k -c 8 -n 10000 --warmup 500 -H "Accept-Encoding: gzip" -u /static/page.html
+  scenario large -k -c 4 -n 200 --warmup 20 -u /static/16m.bin
+  scenario listing -k -c 8 -n 2000 --warmup 100 -u /many/
+  scenario cgi --http -c 4 -n 500 -u /bin/hello.sh
+  # Los mismos por un socket Unix: sin pila TCP ni puertos efimeros por conexion
+  scenario small-simple-unix -a "unix:$DIR/docserver.sock" -c 8 -n 5000 --warmup 500 -u /static/small.html
+  scenario small-keepalive-unix -a "unix:$DIR/docserver.sock" -k -c 8 -n 20000 --warmup 500 -u /static/small.html
+  scenario mix-keepalive-unix -a "unix:$DIR/docserver.sock" -k -c 32 -n 20000 --warmup 500 -m "$DIR/mix.txt"
+  kill $PID
+  wait $PID 2>/dev/null
+done
+
+[ -z "$BASELINE" ] && exit 0
+
+# Compara con la referencia por nombre de escenario: mas throughput es mejor; menos p99 y CPU tambien
+awk -F '\t' -v threshold="$THRESHOLD" '
+  FNR == 1 { next }
+  FNR == NR { rps[$1] = $6; p99[$1] = $10; cpu[$1] = $13; next }
+  !($1 in rps) { next }
+  {
+    worse = ""
+    if (rps[$1] > 0 && $6 < rps[$1] * (1 - threshold / 100)) worse = worse sprintf(" req/s %.0f -> %.0f", rps[$1], $6)
+    if (p99[$1] > 0 && $10 > p99[$1] * (1 + threshold / 100)) worse = worse sprintf(" p99 %.0f -> %.0f us", p99[$1], $10)
+    if (cpu[$1] > 0 && $13 > cpu[$1] * (1 + threshold / 100)) worse = worse sprintf(" cpu %.1f -> %.1f us", cpu[$1], $13)
+    if (worse != "") { print "REGRESSION " $1 ":" worse; failed = 1 }
+  }
+  END { exit failed }
+' "$BASELINE" "$RESULTS"
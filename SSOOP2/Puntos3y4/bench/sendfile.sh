@@ -0,0 +1,26 @@
+#!/bin/bash
+# Compara el envio de ficheros con mmap+send frente a sendfile para 4 KB, 1 MB y 1 GB.
+# Uso: bench/sendfile.sh [puerto]   (desde el directorio con server y loadgen compilados)
+
+PORT=${1:-8080}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+head -c 4096 /dev/urandom > "$DIR/4k.bin"
+head -c 1048576 /dev/urandom > "$DIR/1m.bin"
+truncate -s 1G "$DIR/1g.bin"
+
+run() {
+  ./server -p "$PORT" -b "$DIR" $1 &
+  PID=$!
+  sleep 1
+  for FILE in 4k.bin:2000 1m.bin:500 1g.bin:4; do
+    echo "== ${2} ${FILE%%:*}"
+    ./loadgen -p "$PORT" -c 4 -n "${FILE##*:}" -u "/${FILE%%:*}" | grep -E "throughput|p99"
+  done
+  kill $PID
+  wait $PID 2>/dev/null
+}
+
+run "--mmap" "mmap+send"
+run "" "sendfile"
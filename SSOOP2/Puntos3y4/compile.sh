@@ -1,4 +1,14 @@
-g++ -o server -std=c++23 -Wall -Wextra -Werror -Wpedantic -Wshadow -Wnon-virtual-dtor -Wold-style-cast \
+FLAGS="-std=c++23 -Wall -Wextra -Werror -Wpedantic -Wshadow -Wnon-virtual-dtor -Wold-style-cast \
 -Wcast-align -Wunused -Woverloaded-virtual -Wconversion -Wsign-conversion -Wnull-dereference -Wdouble-promotion \
--Wformat=2 -Wmisleading-indentation -Wduplicated-cond -Wduplicated-branches -Wlogical-op -Wuseless-cast \
--fsanitize=address,undefined,leak docserver3y4.cpp
\ No newline at end of file
+-Wformat=2 -Wmisleading-indentation -Wduplicated-cond -Wduplicated-branches -Wlogical-op -Wuseless-cast"
+SANITIZE="-fsanitize=address,undefined,leak"
+
+g++ -o server $FLAGS $SANITIZE docserver3y4.cpp -lz -lssl -lcrypto
+# Servidor que cuenta sus reservas de memoria dinamica, para bench/allocations.sh
+g++ -o server-allocations -DDOCSERVER_COUNT_ALLOCATIONS $FLAGS $SANITIZE docserver3y4.cpp -lz -lssl -lcrypto
+g++ -o loadgen $FLAGS $SANITIZE loadgen.cpp
+g++ -o docpack $FLAGS $SANITIZE docpack.cpp
+
+# Los benchmarks se compilan optimizados y sin sanitizers
+g++ -O2 -o bench/parser $FLAGS bench/parser.cpp
+g++ -O2 -o bench/compression $FLAGS bench/compression.cpp -lz
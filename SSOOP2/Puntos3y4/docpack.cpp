@@ -0,0 +1,319 @@
+//Empaqueta el arbol de un directorio base en un archivo de contenido para docserver --archive:
+//el contenido de cada fichero, sus cabeceras ya calculadas y un indice de hash perfecto minimo
+//por ruta (ver Archive.h)
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <expected>
+#include <filesystem>
+#include <format>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SafeFD.h"
+#include "Http.h"
+#include "Archive.h"
+
+
+enum class parse_args_errors{
+  missing_argument,
+  wrong_argument,
+  unknown_option,
+};
+
+
+struct docpack_options{
+  bool show_help{false};
+  bool verbose{false};
+  std::string basedir;
+  std::string output;
+};
+
+
+//Fichero que se va a empaquetar
+struct packed_file{
+  std::string path;
+  std::string source;
+  size_t size{0};
+  ino_t inode{0};
+  timespec mtime{};
+  uint64_t hash{0};
+  uint64_t data_offset{0};
+};
+
+
+void help(){
+  std::cout << "Modo de empleo: docpack -b <directorio> -o <archivo>" << std::endl;
+  std::cout << "Empaquetar los ficheros de un directorio base en un archivo para docserver --archive" << std::endl;
+  std::cout << "  -h, --help               mostrar unicamente un mensaje de ayuda" << std::endl;
+  std::cout << "  -v, --verbose            mostrar cada fichero empaquetado" << std::endl;
+  std::cout << "  -b, --base <ruta>        directorio base que se empaqueta" << std::endl;
+  std::cout << "  -o, --output <ruta>      archivo que se genera; se sustituye de una vez al terminar" << std::endl;
+  std::cout << "Los enlaces simbolicos y el directorio /bin (sus programas se ejecutan desde el directorio base)" << std::endl;
+  std::cout << "no se empaquetan" << std::endl;
+}
+
+
+std::expected<docpack_options, parse_args_errors> parse_args(int argc, char* argv[]){
+  std::vector<std::string_view> args(argv + 1, argv + argc);
+  docpack_options options;
+
+  for(auto it = args.begin(), end = args.end(); it != end; it++){
+    if(*it == "-h" || *it == "--help"){
+      options.show_help = true;
+      return options;
+    }
+    if(*it == "-v" || *it == "--verbose"){
+      options.verbose = true;
+      continue;
+    }
+    if(it == end - 1) return std::unexpected(parse_args_errors::missing_argument);
+    std::string_view option = *it;
+    it++;
+    if(option == "-b" || option == "--base") options.basedir = *it;
+    else if(option == "-o" || option == "--output") options.output = *it;
+    else return std::unexpected(parse_args_errors::unknown_option);
+  }
+  if(options.basedir.empty() || options.output.empty()) return std::unexpected(parse_args_errors::missing_argument);
+  return options;
+}
+
+
+//Ficheros regulares bajo basedir con su ruta relativa, como la que devuelve canonical_path
+std::expected<std::vector<packed_file>, std::string> collect_files(const docpack_options& options){
+  namespace fs = std::filesystem;
+  std::vector<packed_file> files;
+  std::error_code error;
+  fs::path output = fs::weakly_canonical(options.output, error);
+  fs::recursive_directory_iterator it(options.basedir, error);
+  if(error) return std::unexpected(std::format("{0}: {1}", options.basedir, error.message()));
+  for(; it != fs::recursive_directory_iterator(); it.increment(error)){
+    if(error) return std::unexpected(std::format("{0}: {1}", it->path().string(), error.message()));
+    std::string path = fs::relative(it->path(), options.basedir).generic_string();
+    if(it.depth() == 0 && path == "bin" && it->is_directory()){
+      it.disable_recursion_pending();
+      continue;
+    }
+    struct stat file_stat;
+    if(lstat(it->path().c_str(), &file_stat) < 0) return std::unexpected(std::format("{0}: {1}", it->path().string(), std::strerror(errno)));
+    if(!S_ISREG(file_stat.st_mode) || fs::weakly_canonical(it->path(), error) == output) continue;
+    packed_file file;
+    file.path = std::move(path);
+    file.source = it->path().string();
+    file.size = static_cast<size_t>(file_stat.st_size);
+    file.inode = file_stat.st_ino;
+    file.mtime = file_stat.st_mtim;
+    file.hash = archive_hash(file.path);
+    files.push_back(std::move(file));
+  }
+  //Orden de ruta: los ficheros de un mismo directorio quedan juntos en el archivo
+  std::sort(files.begin(), files.end(), [](const packed_file& a, const packed_file& b){
+    return a.path < b.path;
+  });
+  return files;
+}
+
+
+//Elige el desplazamiento de cada cubeta empezando por las mas llenas, que son las mas dificiles
+//de colocar mientras quedan casillas libres. Devuelve en slots la casilla de cada fichero
+std::expected<std::vector<uint32_t>, std::string> build_index(const std::vector<packed_file>& files, uint64_t bucket_count, std::vector<uint64_t>& slots){
+  uint64_t entry_count = files.size();
+  std::vector<std::vector<size_t>> buckets(bucket_count);
+  for(size_t i = 0; i < files.size(); i++) buckets[files[i].hash % bucket_count].push_back(i);
+  std::vector<size_t> order(bucket_count);
+  for(size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<uint32_t> displacements(bucket_count, 0);
+  std::vector<bool> taken(entry_count, false);
+  std::vector<uint64_t> candidate;
+  slots.assign(entry_count, 0);
+  for(size_t bucket : order){
+    const std::vector<size_t>& members = buckets[bucket];
+    if(members.empty()) break;
+    //Dos rutas con el mismo hash no se pueden separar con ningun desplazamiento
+    constexpr uint32_t max_tries{1u << 24};
+    uint32_t displacement{0};
+    for(; displacement < max_tries; displacement++){
+      candidate.clear();
+      bool fits{true};
+      for(size_t member : members){
+        uint64_t slot = archive_slot(files[member].hash, displacement, entry_count);
+        if(taken[slot] || std::find(candidate.begin(), candidate.end(), slot) != candidate.end()){
+          fits = false;
+          break;
+        }
+        candidate.push_back(slot);
+      }
+      if(fits) break;
+    }
+    if(displacement == max_tries) return std::unexpected(std::format("cannot place {0} in the index", files[members.front()].path));
+    displacements[bucket] = displacement;
+    for(size_t i = 0; i < members.size(); i++){
+      taken[candidate[i]] = true;
+      slots[members[i]] = candidate[i];
+    }
+  }
+  return displacements;
+}
+
+
+constexpr uint64_t align_up(uint64_t value, uint64_t alignment){
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+
+int write_all(const SafeFD& fd, std::string_view data, uint64_t offset){
+  while(!data.empty()){
+    ssize_t size = pwrite(fd.get(), data.data(), data.size(), static_cast<off_t>(offset));
+    if(size < 0){
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    data.remove_prefix(static_cast<size_t>(size));
+    offset += static_cast<uint64_t>(size);
+  }
+  return EXIT_SUCCESS;
+}
+
+
+//Copia el contenido de file en el archivo. Si el fichero ha cambiado de tamano desde que se
+//listo el directorio falla, en vez de guardar unas cabeceras que no corresponden
+int copy_contents(const SafeFD& output, const packed_file& file){
+  SafeFD input(open(file.source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+  if(!input.is_valid()) return errno;
+  std::vector<char> buffer(1 << 20);
+  size_t copied{0};
+  while(true){
+    ssize_t size = read(input.get(), buffer.data(), buffer.size());
+    if(size < 0){
+      if(errno == EINTR) continue;
+      return errno;
+    }
+    if(size == 0) break;
+    if(copied + static_cast<size_t>(size) > file.size) return ESTALE;
+    int result = write_all(output, std::string_view(buffer.data(), static_cast<size_t>(size)), file.data_offset + copied);
+    if(result != EXIT_SUCCESS) return result;
+    copied += static_cast<size_t>(size);
+  }
+  return copied == file.size ? EXIT_SUCCESS : ESTALE;
+}
+
+
+int main(int argc, char* argv[]){
+  std::expected<docpack_options, parse_args_errors> arguments = parse_args(argc, argv);
+  if(!arguments){
+    if(arguments.error() == parse_args_errors::missing_argument) std::cerr << "Missing argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::wrong_argument) std::cerr << "Wrong argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::unknown_option) std::cerr << "Unknown option" << std::endl;
+    return -1;
+  }
+  const docpack_options& options = arguments.value();
+  if(options.show_help){
+    help();
+    return 0;
+  }
+
+  std::expected<std::vector<packed_file>, std::string> collected = collect_files(options);
+  if(!collected){
+    std::cerr << "Error reading base directory: " << collected.error() << std::endl;
+    return -1;
+  }
+  std::vector<packed_file>& files = collected.value();
+
+  //Unas cuatro rutas por cubeta, como propone CHD: el indice ocupa poco y se genera rapido
+  archive_header header{};
+  header.magic = archive_magic;
+  header.entry_count = files.size();
+  header.bucket_count = files.empty() ? 0 : std::max<uint64_t>(1, (files.size() + 3) / 4);
+  std::vector<uint64_t> slots;
+  std::expected<std::vector<uint32_t>, std::string> displacements = build_index(files, header.bucket_count, slots);
+  if(!displacements){
+    std::cerr << "Error building index: " << displacements.error() << std::endl;
+    return -1;
+  }
+
+  //Cadenas y entradas, en el orden de las casillas
+  std::vector<archive_entry> entries(files.size());
+  std::string strings;
+  for(size_t i = 0; i < files.size(); i++){
+    const packed_file& file = files[i];
+    std::string_view type = content_type(file.path);
+    std::string etag = make_etag(file.inode, file.size, file.mtime);
+    std::string last_modified = http_date(file.mtime.tv_sec);
+    std::string validators = std::format("ETag: {0}\r\nLast-Modified: {1}\r\n", etag, last_modified);
+    archive_entry& entry = entries[slots[i]];
+    entry.size = file.size;
+    entry.mtime = file.mtime.tv_sec;
+    entry.strings = strings.size();
+    entry.path_length = static_cast<uint32_t>(file.path.size());
+    entry.type_length = static_cast<uint16_t>(type.size());
+    entry.validators_length = static_cast<uint16_t>(validators.size());
+    entry.etag_offset = 6;
+    entry.etag_length = static_cast<uint16_t>(etag.size());
+    entry.last_modified_offset = static_cast<uint16_t>(validators.find("Last-Modified: ") + 15);
+    entry.last_modified_length = static_cast<uint16_t>(last_modified.size());
+    strings.append(file.path).append(type).append(validators);
+  }
+
+  header.entries_offset = align_up(sizeof(header), alignof(archive_entry));
+  header.buckets_offset = header.entries_offset + entries.size() * sizeof(archive_entry);
+  header.strings_offset = header.buckets_offset + displacements.value().size() * sizeof(uint32_t);
+  header.strings_size = strings.size();
+  //Los ficheros de una pagina o mas empiezan en una pagina; los pequenos se juntan sin cruzar
+  //el limite de una pagina, asi que servir uno cuesta como mucho un fallo de pagina
+  uint64_t offset = align_up(header.strings_offset + strings.size(), archive_page);
+  for(size_t i = 0; i < files.size(); i++){
+    packed_file& file = files[i];
+    if(file.size >= archive_page || offset % archive_page + file.size > archive_page) offset = align_up(offset, archive_page);
+    file.data_offset = offset;
+    entries[slots[i]].data_offset = offset;
+    offset += file.size;
+  }
+  header.file_size = offset;
+
+  //Se escribe en un fichero temporal que sustituye al archivo de una vez: un servidor que
+  //arranque mientras tanto ve el archivo anterior entero
+  std::string temporary = options.output + ".tmp";
+  SafeFD output(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if(!output.is_valid()){
+    std::cerr << "Error creating " << temporary << ": " << std::strerror(errno) << std::endl;
+    return -1;
+  }
+  auto fail = [&](std::string_view what, int error){
+    std::cerr << "Error writing " << what << ": " << std::strerror(error) << std::endl;
+    unlink(temporary.c_str());
+    return -1;
+  };
+  //Los huecos de alineacion quedan como huecos del fichero, sin ocupar disco
+  if(ftruncate(output.get(), static_cast<off_t>(header.file_size)) < 0) return fail(temporary, errno);
+  int result = write_all(output, std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)), 0);
+  if(result == EXIT_SUCCESS) result = write_all(output, std::string_view(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(archive_entry)), header.entries_offset);
+  if(result == EXIT_SUCCESS){
+    result = write_all(output, std::string_view(reinterpret_cast<const char*>(displacements.value().data()), displacements.value().size() * sizeof(uint32_t)), header.buckets_offset);
+  }
+  if(result == EXIT_SUCCESS) result = write_all(output, strings, header.strings_offset);
+  if(result != EXIT_SUCCESS) return fail(temporary, result);
+  for(const packed_file& file : files){
+    result = copy_contents(output, file);
+    if(result == ESTALE){
+      std::cerr << "Error: " << file.source << " changed while packing" << std::endl;
+      unlink(temporary.c_str());
+      return -1;
+    }
+    if(result != EXIT_SUCCESS) return fail(file.source, result);
+    if(options.verbose) std::cerr << file.path << ": " << file.size << " bytes at " << file.data_offset << std::endl;
+  }
+  if(fsync(output.get()) < 0) return fail(temporary, errno);
+  if(rename(temporary.c_str(), options.output.c_str()) < 0) return fail(options.output, errno);
+  std::cout << files.size() << " files, " << header.file_size << " bytes" << std::endl;
+  return 0;
+}
@@ -1,6 +1,5 @@
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <limits.h>
 #include <unistd.h>
 #include <cstdint>
@@ -11,21 +10,61 @@
 #include <format>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <charconv>
 #include <cstring>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <array>
+#include <sched.h>
+#include <csignal>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <memory_resource>
+#include <unordered_map>
 
 #include "SafeFD.h"
 #include "SafeMap.h"
 #include "Socket.h"
+#include "EventLoop.h"
+#include "UringLoop.h"
+#include "FileCache.h"
+#include "Http.h"
+#include "HttpParser.h"
+#include "Metrics.h"
+#include "AccessLog.h"
+#include "Compression.h"
+#include "PathResolver.h"
+#include "ClientLimits.h"
+#include "DirectoryIndex.h"
+#include "Archive.h"
+#include "Tls.h"
+#include "Arena.h"
+#include "FsPool.h"
+#ifdef DOCSERVER_COUNT_ALLOCATIONS
+#include "Allocations.h"
+#endif
 
 
 enum class parse_args_errors{
   missing_argument,
   wrong_argument,
   unknown_option,
+  unreadable_config,
+};
+
+
+//Motor con el que se atienden las conexiones
+enum class server_engine{
+  epoll,
+  io_uring,
+  blocking,
 };
 
 
@@ -33,7 +72,65 @@ struct program_options{
   bool show_help{false};
   bool verbose{false};
   uint16_t port{8080};
+  //Direcciones en las que escuchar; sin --listen, todas las IPv4 en port
+  std::vector<listen_address> listen;
   std::string basedir;
+  server_engine engine{server_engine::epoll};
+  //0 indica un proceso trabajador por cada nucleo disponible
+  size_t workers{1};
+  int backlog{SOMAXCONN};
+  bool pin_cpus{false};
+  //Enviar los ficheros con mmap + send en vez de sendfile, para comparar
+  bool use_mmap{false};
+  //Presupuesto en bytes de la cache de ficheros abiertos (0 la desactiva)
+  size_t cache_size{64 * 1024 * 1024};
+  std::chrono::milliseconds cache_valid{1000};
+  std::chrono::seconds keepalive_timeout{5};
+  size_t max_requests{100};
+  size_t max_header_size{8192};
+  std::chrono::seconds cgi_timeout{10};
+  //Fichero del registro de accesos ("-" para la salida de error); vacio lo desactiva
+  std::string access_log;
+  log_full_policy log_full{log_full_policy::drop};
+  //Cabecera Cache-Control (ya formada) para los ficheros bajo cada directorio, relativo a
+  //basedir. Se aplica la del directorio mas largo que contenga al fichero
+  std::vector<std::pair<std::string, std::string>> cache_control;
+  //Memoria de la cache de ficheros comprimidos al vuelo (0 desactiva la compresion al vuelo,
+  //no los hermanos precomprimidos) y tamano minimo para comprimir un fichero
+  size_t compress_cache_size{16 * 1024 * 1024};
+  size_t compress_min{1024};
+  //Fichero de configuracion, que se vuelve a leer con SIGHUP
+  std::string config;
+  //Tiempo que tienen los trabajadores para terminar las respuestas en curso al pararlos
+  std::chrono::seconds drain_timeout{10};
+  //Plazo para recibir una peticion y para que el cliente acepte datos de la respuesta
+  std::chrono::seconds request_timeout{10};
+  std::chrono::seconds send_timeout{30};
+  //Conexiones abiertas como maximo por trabajador, en total y por cliente (0 sin limite).
+  //Los clientes de un socket Unix solo cuentan en el total
+  size_t max_connections{0};
+  size_t max_client_connections{0};
+  //Peticiones por segundo de cada IP (0 sin limite) y cuantas puede hacer seguidas
+  unsigned rate_limit{0};
+  unsigned rate_burst{0};
+  //Fichero que se sirve al pedir un directorio (vacio para ninguno) y si, a falta de el, se
+  //genera un listado del directorio
+  std::string index{"index.html"};
+  bool listing{false};
+  //Archivo de docpack del que se sirven los ficheros en vez de basedir (vacio para ninguno).
+  //Los programas de /bin se siguen ejecutando desde basedir
+  std::string archive;
+  //Certificado (con su cadena) y clave en PEM. Con certificado todas las conexiones son TLS;
+  //la clave puede ir en el mismo fichero
+  std::string tls_certificate;
+  std::string tls_key;
+  //Hilos por trabajador que abren los ficheros que no estan en la cache fuera del hilo de red
+  //(0 los abre el propio hilo de red) y tareas pendientes como maximo antes de hacerlo igualmente
+  size_t fs_threads{4};
+  size_t fs_queue{256};
+  //Ruta en la que se sirven las metricas (vacio para no servirlas); oculta al fichero de
+  //basedir con ese nombre
+  std::string metrics_path;
 };
 
 
@@ -51,13 +148,67 @@ struct exec_environment{
 };
 
 
+//Programa en ejecucion y el extremo de lectura de la tuberia conectada a su salida
+struct spawned_program{
+  pid_t pid;
+  SafeFD output;
+};
+
+
 void help(){
   std::cout << "Modo de empleo: docserver [OPCION]..." << std::endl;
   std::cout << "Compartir ficheros por internet" << std::endl;
   std::cout << "  -h, --help            mostrar unicamente un mensaje de ayuda" << std::endl;
+  std::cout << "  -c, --config <ruta>   leer opciones de un fichero, separadas por espacios o lineas (# comenta hasta el" << std::endl;
+  std::cout << "                        final de la linea); las de la linea de ordenes tienen prioridad" << std::endl;
   std::cout << "  -v, --verbose         mostrar mensajes informativos por la salida de error" << std::endl;
   std::cout << "  -p, --port <puerto>   seleccionar el puerto por el que comunicarse" << std::endl;
+  std::cout << "  -l, --listen <direccion> escuchar en direccion: puerto, ipv4:puerto, [ipv6]:puerto ([::] tambien acepta IPv4)" << std::endl;
+  std::cout << "                        o unix:ruta (unix:@nombre en el espacio abstracto); se puede repetir y sustituye a -p" << std::endl;
   std::cout << "  -b, --base <ruta>     indicar el directorio base de los archivos que pida el cliente" << std::endl;
+  std::cout << "  -e, --engine <motor>  motor de atencion de conexiones: epoll (por defecto), io_uring o blocking" << std::endl;
+  std::cout << "  -w, --workers <n>     lanzar n procesos trabajadores con SO_REUSEPORT (0 = uno por nucleo)" << std::endl;
+  std::cout << "      --backlog <n>     longitud de la cola de conexiones pendientes (por defecto SOMAXCONN)" << std::endl;
+  std::cout << "      --pin             fijar cada trabajador a un nucleo distinto" << std::endl;
+  std::cout << "      --mmap            enviar los ficheros con mmap y send en lugar de sendfile" << std::endl;
+  std::cout << "      --cache-size <MB> memoria maxima de la cache de ficheros abiertos (por defecto 64, 0 la desactiva)" << std::endl;
+  std::cout << "      --cache-valid <ms> tiempo antes de comprobar si un fichero de la cache ha cambiado (por defecto 1000)" << std::endl;
+  std::cout << "      --keepalive-timeout <s> segundos que una conexion persistente espera la siguiente peticion (por defecto 5)" << std::endl;
+  std::cout << "      --max-requests <n> peticiones maximas por conexion persistente (por defecto 100)" << std::endl;
+  std::cout << "      --max-header-size <bytes> tamano maximo de la peticion y sus cabeceras (por defecto 8192)" << std::endl;
+  std::cout << "      --cgi-timeout <s> segundos que puede tardar un programa de /bin antes de matarlo (por defecto 10)" << std::endl;
+  std::cout << "      --access-log <ruta> escribir un registro de accesos en ruta (- para la salida de error); SIGHUP lo reabre" << std::endl;
+  std::cout << "      --log-full <modo> con el registro lleno: drop (descartar, por defecto) o block (esperar)" << std::endl;
+  std::cout << "      --cache-control <dir>=<valor> enviar Cache-Control: valor con los ficheros bajo dir (p.ej. /static=max-age=3600);" << std::endl;
+  std::cout << "                        se puede repetir" << std::endl;
+  std::cout << "      --compress-cache <MB> memoria para ficheros comprimidos al vuelo con gzip (por defecto 16, 0 lo desactiva)" << std::endl;
+  std::cout << "      --compress-min <bytes> no comprimir al vuelo ficheros menores (por defecto 1024)" << std::endl;
+  std::cout << "      --drain-timeout <s> segundos para terminar las respuestas en curso al parar (por defecto 10)" << std::endl;
+  std::cout << "      --request-timeout <s> segundos para recibir entera una peticion ya empezada (por defecto 10)" << std::endl;
+  std::cout << "      --send-timeout <s> segundos sin que el cliente acepte datos antes de cerrar la conexion (por defecto 30)" << std::endl;
+  std::cout << "      --max-connections <n> conexiones abiertas como maximo por trabajador; las demas reciben 503 (por defecto 0, sin limite)" << std::endl;
+  std::cout << "      --max-client-connections <n> conexiones abiertas como maximo por trabajador desde una misma IP (o red /64" << std::endl;
+  std::cout << "                        en IPv6); las demas reciben 429 (por defecto 0, sin limite; no se aplica a sockets Unix)" << std::endl;
+  std::cout << "      --rate-limit <n>  peticiones por segundo de cada IP; las que exceden reciben 429 (por defecto 0, sin limite)" << std::endl;
+  std::cout << "      --rate-burst <n>  peticiones seguidas que puede hacer una IP por encima del ritmo (por defecto el propio ritmo)" << std::endl;
+  std::cout << "      --index <nombre>  fichero que se sirve al pedir un directorio (por defecto index.html)" << std::endl;
+  std::cout << "      --no-index        no servir ningun fichero al pedir un directorio" << std::endl;
+  std::cout << "      --listing         listar los directorios sin fichero indice, en HTML o en JSON si el cliente lo pide" << std::endl;
+  std::cout << "                        con Accept: application/json o ?format=json" << std::endl;
+  std::cout << "      --archive <ruta>  servir los ficheros desde un archivo generado con docpack, proyectado en memoria," << std::endl;
+  std::cout << "                        en vez de desde el directorio base (sin listados ni compresion al vuelo)" << std::endl;
+  std::cout << "      --tls-cert <ruta> atender las conexiones con TLS usando el certificado (PEM, con su cadena) de ruta;" << std::endl;
+  std::cout << "                        con kTLS los ficheros se siguen enviando con sendfile (no con el motor io_uring)" << std::endl;
+  std::cout << "      --tls-key <ruta>  clave privada del certificado (PEM), si no va en el mismo fichero" << std::endl;
+  std::cout << "      --fs-threads <n>  hilos por trabajador que abren los ficheros que faltan en la cache sin detener al resto" << std::endl;
+  std::cout << "                        de conexiones (por defecto 4, 0 los abre el hilo que atiende las conexiones)" << std::endl;
+  std::cout << "      --fs-queue <n>    aperturas pendientes como maximo por trabajador; con mas se abren sin esperar a los hilos" << std::endl;
+  std::cout << "                        (por defecto 256)" << std::endl;
+  std::cout << "      --metrics-path <ruta> servir en ruta (por ejemplo /metrics) las metricas del servidor en formato de texto" << std::endl;
+  std::cout << "                        de Prometheus, en todas las direcciones de escucha (por defecto no se sirven)" << std::endl;
+  std::cout << "Senales del proceso principal: SIGTERM o SIGINT paran el servidor tras terminar las respuestas en curso;" << std::endl;
+  std::cout << "SIGHUP vuelve a leer las opciones y sustituye a los trabajadores (y reabre el registro de accesos);" << std::endl;
+  std::cout << "SIGUSR2 ejecuta de nuevo el programa, que hereda los sockets de escucha, sin rechazar conexiones" << std::endl;
 }
 
 
@@ -68,10 +219,63 @@ std::string Getenv(const std::string& name){
 }
 
 
-std::expected<program_options, parse_args_errors> parse_args(int argc, char* argv[]){
-  std::vector<std::string_view> args(argv + 1, argv + argc);
+//Opciones que llevan un argumento a continuacion
+bool takes_argument(std::string_view option){
+  return option == "-c" || option == "--config" || option == "-p" || option == "--port" || option == "-l" || option == "--listen" || option == "-b" || option == "--base" || option == "-e" || option == "--engine"
+      || option == "-w" || option == "--workers" || option == "--backlog" || option == "--cache-size" || option == "--cache-valid"
+      || option == "--keepalive-timeout" || option == "--max-requests" || option == "--max-header-size"
+      || option == "--cgi-timeout" || option == "--access-log" || option == "--log-full"
+      || option == "--cache-control" || option == "--compress-cache" || option == "--compress-min" || option == "--drain-timeout"
+      || option == "--request-timeout" || option == "--send-timeout" || option == "--max-connections" || option == "--max-client-connections"
+      || option == "--rate-limit" || option == "--rate-burst" || option == "--index"
+      || option == "--archive" || option == "--tls-cert" || option == "--tls-key" || option == "--fs-threads" || option == "--fs-queue"
+      || option == "--metrics-path";
+}
+
+
+//Convierte un argumento numerico completo; std::from_chars() por si solo acepta prefijos como "4abc"
+template <typename T>
+bool parse_number(std::string_view str, T& value){
+  auto [ptr, ec] = std::from_chars(str.begin(), str.end(), value);
+  return ec == std::errc() && ptr == str.end();
+}
+
+
+//Opciones de un fichero de configuracion: palabras separadas por espacios o saltos de linea,
+//ignorando desde cada # hasta el final de la linea
+std::expected<std::vector<std::string>, int> read_config(const std::string& path){
+  std::ifstream file(path);
+  if(!file) return std::unexpected(errno != 0 ? errno : ENOENT);
+  std::vector<std::string> words;
+  std::string line;
+  while(std::getline(file, line)){
+    std::istringstream stream(line.substr(0, line.find('#')));
+    std::string word;
+    while(stream >> word) words.push_back(std::move(word));
+  }
+  if(file.bad()) return std::unexpected(EIO);
+  return words;
+}
+
+
+//arguments son los argumentos sin el nombre del programa
+std::expected<program_options, parse_args_errors> parse_args(std::vector<std::string> arguments){
   program_options options;
 
+  //Las opciones del fichero de configuracion van delante para que las de la linea de ordenes
+  //las sustituyan
+  auto config = std::ranges::find_if(arguments, [](const std::string& arg){ return arg == "-c" || arg == "--config"; });
+  if(config != arguments.end() && config + 1 != arguments.end()){
+    options.config = *(config + 1);
+    std::expected<std::vector<std::string>, int> words = read_config(options.config);
+    if(!words) return std::unexpected(parse_args_errors::unreadable_config);
+    for(const std::string& word : words.value()){
+      if(word == "-c" || word == "--config") return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    arguments.insert(arguments.begin(), words.value().begin(), words.value().end());
+  }
+  std::vector<std::string_view> args(arguments.begin(), arguments.end());
+
   bool p_selected{false};
   bool b_selected{false};
 
@@ -85,9 +289,13 @@ std::expected<program_options, parse_args_errors> parse_args(int argc, char* arg
 
   for (auto it = args.begin(), end = args.end(); it != end; it++){
     if(*it == "-v" || *it == "--verbose") options.verbose = true;
+    if(*it == "--pin") options.pin_cpus = true;
+    if(*it == "--mmap") options.use_mmap = true;
+    if(*it == "--no-index") options.index.clear();
+    if(*it == "--listing") options.listing = true;
 
     if(it == end - 1){
-      if(*it == "-p" || *it == "--port" || *it == "-b" || *it == "--base") return std::unexpected(parse_args_errors::missing_argument);
+      if(takes_argument(*it)) return std::unexpected(parse_args_errors::missing_argument);
     }
     else{
       if(*it == "-p" || *it == "--port"){
@@ -106,6 +314,12 @@ std::expected<program_options, parse_args_errors> parse_args(int argc, char* arg
           if(ec != std::errc()) return std::unexpected(parse_args_errors::wrong_argument);
         }
       }
+      else if(*it == "-l" || *it == "--listen"){
+        it++;
+        std::expected<listen_address, int> address = parse_listen_address(*it);
+        if(!address) return std::unexpected(parse_args_errors::wrong_argument);
+        if(std::ranges::find(options.listen, address.value()) == options.listen.end()) options.listen.push_back(address.value());
+      }
       else if(*it == "-b" || *it == "--base"){
         b_selected = true;
         if(it == end - 1){
@@ -117,7 +331,144 @@ std::expected<program_options, parse_args_errors> parse_args(int argc, char* arg
           else options.basedir = *it;
         }
       }
-      else if(*it != "-v" && *it != "--verbose") return std::unexpected(parse_args_errors::unknown_option);
+      else if(*it == "-c" || *it == "--config") it++;
+      else if(*it == "-e" || *it == "--engine"){
+        it++;
+        if(*it == "epoll") options.engine = server_engine::epoll;
+        else if(*it == "io_uring") options.engine = server_engine::io_uring;
+        else if(*it == "blocking") options.engine = server_engine::blocking;
+        else return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "-w" || *it == "--workers"){
+        it++;
+        if(!parse_number(*it, options.workers)) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--backlog"){
+        it++;
+        if(!parse_number(*it, options.backlog) || options.backlog <= 0) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--cache-size"){
+        it++;
+        size_t megabytes;
+        if(!parse_number(*it, megabytes)) return std::unexpected(parse_args_errors::wrong_argument);
+        options.cache_size = megabytes * 1024 * 1024;
+      }
+      else if(*it == "--cache-valid"){
+        it++;
+        unsigned int milliseconds;
+        if(!parse_number(*it, milliseconds)) return std::unexpected(parse_args_errors::wrong_argument);
+        options.cache_valid = std::chrono::milliseconds(milliseconds);
+      }
+      else if(*it == "--keepalive-timeout"){
+        it++;
+        unsigned int seconds;
+        if(!parse_number(*it, seconds)) return std::unexpected(parse_args_errors::wrong_argument);
+        options.keepalive_timeout = std::chrono::seconds(seconds);
+      }
+      else if(*it == "--max-requests"){
+        it++;
+        if(!parse_number(*it, options.max_requests) || options.max_requests == 0) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--max-header-size"){
+        it++;
+        if(!parse_number(*it, options.max_header_size) || options.max_header_size == 0) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--cgi-timeout"){
+        it++;
+        unsigned int seconds;
+        if(!parse_number(*it, seconds) || seconds == 0) return std::unexpected(parse_args_errors::wrong_argument);
+        options.cgi_timeout = std::chrono::seconds(seconds);
+      }
+      else if(*it == "--access-log"){
+        it++;
+        if(it->empty()) return std::unexpected(parse_args_errors::wrong_argument);
+        options.access_log = *it;
+      }
+      else if(*it == "--log-full"){
+        it++;
+        if(*it == "drop") options.log_full = log_full_policy::drop;
+        else if(*it == "block") options.log_full = log_full_policy::block;
+        else return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--cache-control"){
+        it++;
+        size_t equals = it->find('=');
+        if(!it->starts_with('/') || equals == std::string_view::npos) return std::unexpected(parse_args_errors::wrong_argument);
+        std::string_view directory = it->substr(0, equals);
+        while(directory.size() > 1 && directory.ends_with('/')) directory.remove_suffix(1);
+        options.cache_control.emplace_back(directory, std::format("Cache-Control: {0}\r\n", it->substr(equals + 1)));
+      }
+      else if(*it == "--compress-cache"){
+        it++;
+        size_t megabytes;
+        if(!parse_number(*it, megabytes)) return std::unexpected(parse_args_errors::wrong_argument);
+        options.compress_cache_size = megabytes * 1024 * 1024;
+      }
+      else if(*it == "--compress-min"){
+        it++;
+        if(!parse_number(*it, options.compress_min)) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--drain-timeout"){
+        it++;
+        unsigned int seconds;
+        if(!parse_number(*it, seconds)) return std::unexpected(parse_args_errors::wrong_argument);
+        options.drain_timeout = std::chrono::seconds(seconds);
+      }
+      else if(*it == "--request-timeout" || *it == "--send-timeout"){
+        bool request = *it == "--request-timeout";
+        it++;
+        unsigned int seconds;
+        if(!parse_number(*it, seconds) || seconds == 0) return std::unexpected(parse_args_errors::wrong_argument);
+        (request ? options.request_timeout : options.send_timeout) = std::chrono::seconds(seconds);
+      }
+      else if(*it == "--max-connections"){
+        it++;
+        if(!parse_number(*it, options.max_connections)) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--max-client-connections"){
+        it++;
+        if(!parse_number(*it, options.max_client_connections)) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--rate-limit"){
+        it++;
+        if(!parse_number(*it, options.rate_limit) || options.rate_limit > 1000000000) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--rate-burst"){
+        it++;
+        if(!parse_number(*it, options.rate_burst) || options.rate_burst == 0) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--index"){
+        it++;
+        //Un nombre dentro del directorio pedido, no una ruta
+        if(it->empty() || it->find('/') != std::string::npos || *it == "." || *it == "..") return std::unexpected(parse_args_errors::wrong_argument);
+        options.index = *it;
+      }
+      else if(*it == "--archive"){
+        it++;
+        options.archive = *it;
+      }
+      else if(*it == "--tls-cert"){
+        it++;
+        options.tls_certificate = *it;
+      }
+      else if(*it == "--tls-key"){
+        it++;
+        options.tls_key = *it;
+      }
+      else if(*it == "--fs-threads"){
+        it++;
+        if(!parse_number(*it, options.fs_threads) || options.fs_threads > 256) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--fs-queue"){
+        it++;
+        if(!parse_number(*it, options.fs_queue) || options.fs_queue == 0) return std::unexpected(parse_args_errors::wrong_argument);
+      }
+      else if(*it == "--metrics-path"){
+        it++;
+        if(!it->starts_with('/')) return std::unexpected(parse_args_errors::wrong_argument);
+        options.metrics_path = *it;
+      }
+      else if(*it != "-v" && *it != "--verbose" && *it != "--pin" && *it != "--mmap" && *it != "--no-index" && *it != "--listing") return std::unexpected(parse_args_errors::unknown_option);
     }
   }
   //Dar a port su valor por defecto si el usuario no lo ha especificado
@@ -128,6 +479,7 @@ std::expected<program_options, parse_args_errors> parse_args(int argc, char* arg
       if(ec != std::errc()) options.port = 8080;
     }
   }
+  if(options.listen.empty()) options.listen.push_back(ipv4_any(options.port));
   //Dar a basedir su valor por defecto si el usuario no lo ha especificado
   if(!b_selected){
     options.basedir = Getenv("DOCSERVER_BASEDIR");
@@ -136,156 +488,1615 @@ std::expected<program_options, parse_args_errors> parse_args(int argc, char* arg
       options.basedir = getcwd(cwd, sizeof(cwd));
     }
   }
+  if(options.rate_burst == 0) options.rate_burst = std::max(options.rate_limit, 1u);
+  if(options.workers == 0){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    options.workers = cores > 0 ? static_cast<size_t>(cores) : 1;
+  }
   return options;
 }
 
 
-std::expected<SafeMap, int> read_all(const std::string& path, bool verbose){
-  int fd = open(&path[0], O_RDONLY);
-
-  if(fd < 0){
-    return std::unexpected(errno);
-  }
+//Abre el fichero (path es relativo al directorio base) y guarda sus metadatos; el cuerpo se
+//envia despues con sendfile. Solo se sirven ficheros regulares
+std::expected<file_entry, int> open_file(const PathResolver& resolver, const std::string& path, bool verbose){
+  std::expected<SafeFD, int> fd = resolver.open(path, O_RDONLY);
+  if(!fd) return std::unexpected(fd.error());
   if(verbose) std::cerr << "open: se abre el archivo " << path << std::endl;
-  size_t length = static_cast<size_t>(lseek(fd, 0, SEEK_END));
-  void* mem = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  struct stat file_stat;
+  if(fstat(fd.value().get(), &file_stat) < 0) return std::unexpected(errno);
+  if(!S_ISREG(file_stat.st_mode)) return std::unexpected(S_ISDIR(file_stat.st_mode) ? EISDIR : EACCES);
+  file_entry file;
+  file.fd = std::move(fd.value());
+  file.size = static_cast<size_t>(file_stat.st_size);
+  file.device = file_stat.st_dev;
+  file.inode = file_stat.st_ino;
+  file.mtime = file_stat.st_mtim;
+  file.etag = make_etag(file.inode, file.size, file.mtime);
+  file.last_modified = http_date(file.mtime.tv_sec);
+  file.validators = std::format("ETag: {0}\r\nLast-Modified: {1}\r\n", file.etag, file.last_modified);
+  return file;
+}
+
+
+//Proyecta en memoria el fichero ya abierto (solo con --mmap)
+std::expected<SafeMap, int> read_all(const file_entry& file, const std::string& path, bool verbose){
+  if(file.size == 0) return SafeMap();
+  void* mem = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, file.fd.get(), 0);
   if(mem == MAP_FAILED){
     return std::unexpected(errno);
   }
-  if(verbose) std::cerr << "read: se leen " << length << " bytes del archivo " << path << std::endl;
-  close(fd);
-  std::string_view mem_sv(static_cast<char*>(mem), length);
+  if(verbose) std::cerr << "read: se leen " << file.size << " bytes del archivo " << path << std::endl;
+  std::string_view mem_sv(static_cast<char*>(mem), file.size);
   SafeMap mem_sm(mem_sv);
   return mem_sm;
 }
 
 
-std::expected<std::string, execute_program_error> execute_program(const std::string& path){
-  char buffer[1024];
-  memset(buffer, 0, sizeof(buffer));
-  execute_program_error error;
-  error.exit_code = -1;
+//Carga un fichero en la cache: lo abre y, con --mmap, lo proyecta en memoria
+std::expected<file_entry, int> load_file(const PathResolver& resolver, const std::string& path, const program_options& options){
+  std::expected<file_entry, int> file = open_file(resolver, path, options.verbose);
+  if(!file || !options.use_mmap) return file;
+  std::expected<SafeMap, int> map = read_all(file.value(), path, options.verbose);
+  if(!map) return std::unexpected(map.error());
+  file.value().map = std::move(map.value());
+  return file;
+}
 
-  //Comprobar que el programa existe y tiene permisos
-  if(access(&path[0], X_OK) < 0 || access(&path[0], F_OK) < 0){
-    std::cerr << "Archivo no valido" << std::endl;
-    error.error_code = errno;
-    return std::unexpected(error);
+
+//Comprueba que el programa relative (relativo al directorio base) esta dentro de el, sin
+//seguir enlaces hacia fuera, y se puede ejecutar: lo abre con O_PATH y pregunta por ese
+//descriptor, que devuelve. El programa se ejecuta desde el (ver spawn_program): por su ruta,
+//un enlace cambiado despues de comprobarla podria sacarlo del directorio base
+std::expected<SafeFD, int> check_program(const PathResolver& resolver, const std::string& relative){
+  std::expected<SafeFD, int> opened = resolver.open(relative, O_PATH);
+  if(!opened) return opened;
+  if(faccessat(opened.value().get(), "", X_OK, AT_EMPTY_PATH) < 0) return std::unexpected(errno);
+  return opened;
+}
+
+
+//Bytes del principio de un fichero que se piden por adelantado al cargarlo en la reserva de
+//hilos de fs, para que el envio no espere al disco
+constexpr size_t fs_readahead{2 * 1024 * 1024};
+
+
+//Fichero que se carga en un hilo de la reserva de hilos de fs y las conexiones que esperan a
+//la carga. Si path es un directorio tambien se carga su fichero indice index, para no tener
+//que esperar dos veces. stored e index_stored son lo que queda al guardarlos en la cache: las
+//peticiones reanudadas se sirven de ahi, porque la cache no guarda los ficheros que no caben.
+//Con program, path es un programa de /bin y solo se comprueba (ver check_program); el
+//resultado, con el descriptor del programa, queda en checked y no se guarda en ninguna cache
+struct pending_load{
+  std::string path;
+  std::string index;
+  bool program{false};
+  std::expected<SafeFD, int> checked{std::unexpected(EINPROGRESS)};
+  std::expected<file_entry, int> file{std::unexpected(EINPROGRESS)};
+  std::optional<std::expected<file_entry, int>> index_file;
+  std::optional<FileCache::result> stored;
+  std::optional<FileCache::result> index_stored;
+  std::vector<int> waiting;
+  //Valor de FsPool::drained al finalizarla
+  uint64_t drain{0};
+};
+
+
+//Cargas encargadas a la reserva de hilos de fs (sin reserva, pool es nullptr). Varias
+//peticiones del mismo fichero comparten carga. Las finalizadas se quedan en finished hasta
+//que se han reanudado sus conexiones y despues pasan a spare para las siguientes, con la
+//memoria de sus cadenas
+struct file_loads{
+  FsPool* pool;
+  const PathResolver& resolver;
+  const program_options& options;
+  FileCache& cache;
+  //Como mucho tantas como tareas admite la cola de la reserva: se buscan recorriendolas
+  std::vector<std::unique_ptr<pending_load>> loading{};
+  std::vector<std::unique_ptr<pending_load>> finished{};
+  std::vector<std::unique_ptr<pending_load>> spare{};
+};
+
+
+//Pasa a spare las cargas finalizadas en un drain que ya ha terminado
+void recycle_loads(file_loads& loads){
+  for(size_t i = 0; i < loads.finished.size();){
+    pending_load& load = *loads.finished[i];
+    if(load.drain >= loads.pool->drained()){
+      i++;
+      continue;
+    }
+    load.stored.reset();
+    load.index_stored.reset();
+    load.checked = std::unexpected(EINPROGRESS);
+    loads.spare.push_back(std::move(loads.finished[i]));
+    loads.finished[i] = std::move(loads.finished.back());
+    loads.finished.pop_back();
+  }
+}
+
+
+//Guarda en la cache lo que ha cargado load, en el hilo de red, y anota en resumed las
+//conexiones que esperaban
+void finish_load(file_loads& loads, pending_load* load, std::vector<int>& resumed){
+  recycle_loads(loads);
+  if(!load->program) load->stored = loads.cache.store(load->path, std::move(load->file));
+  if(load->index_file) load->index_stored = loads.cache.store(load->index, std::move(load->index_file.value()));
+  load->index_file.reset();
+  load->drain = loads.pool->drained();
+  resumed.insert(resumed.end(), load->waiting.begin(), load->waiting.end());
+  load->waiting.clear();
+  auto it = std::ranges::find_if(loads.loading, [load](const std::unique_ptr<pending_load>& pending){ return pending.get() == load; });
+  loads.finished.push_back(std::move(*it));
+  *it = std::move(loads.loading.back());
+  loads.loading.pop_back();
+}
+
+
+//Lo que ha cargado la reserva para path, si hay una carga finalizada que lo incluya
+std::optional<FileCache::result> loaded_file(const file_loads& loads, std::string_view path){
+  for(const std::unique_ptr<pending_load>& load : loads.finished){
+    if(load->stored && load->path == path) return load->stored;
+    if(load->index_stored && load->index == path) return load->index_stored;
+  }
+  return std::nullopt;
+}
+
+
+//Encarga a la reserva la carga de path (o su comprobacion, con program) y anota que la
+//conexion espera. Si ya se esta cargando solo anota la conexion. Devuelve false si la cola de
+//la reserva esta llena
+bool start_load(std::string_view path, bool program, int connection, file_loads& loads){
+  auto loading = std::ranges::find_if(loads.loading, [path, program](const std::unique_ptr<pending_load>& pending){
+    return pending->program == program && pending->path == path;
+  });
+  if(loading != loads.loading.end()){
+    std::vector<int>& waiting = (*loading)->waiting;
+    if(std::ranges::find(waiting, connection) == waiting.end()) waiting.push_back(connection);
+    return true;
+  }
+
+  recycle_loads(loads);
+  std::unique_ptr<pending_load> load;
+  if(loads.spare.empty()) load = std::make_unique<pending_load>();
+  else{
+    load = std::move(loads.spare.back());
+    loads.spare.pop_back();
+  }
+  load->path.assign(path);
+  load->program = program;
+  //El indice solo se carga con el directorio si no esta ya en la cache
+  load->index.clear();
+  if(!program && !loads.options.index.empty()){
+    if(!path.empty()) load->index.assign(path).append("/");
+    load->index.append(loads.options.index);
+    if(loads.cache.contains(load->index)) load->index.clear();
+  }
+  //Las funciones solo guardan dos punteros: caben en std::function sin reservar memoria
+  pending_load* raw = load.get();
+  bool submitted = loads.pool->submit([raw, &loads]{
+    if(raw->program){
+      raw->checked = check_program(loads.resolver, raw->path);
+      return;
+    }
+    raw->file = load_file(loads.resolver, raw->path, loads.options);
+    if(raw->file){
+      const file_entry& file = raw->file.value();
+      posix_fadvise(file.fd.get(), 0, static_cast<off_t>(std::min(file.size, fs_readahead)), POSIX_FADV_WILLNEED);
+    }
+    else if(raw->file.error() == EISDIR && !raw->index.empty()) raw->index_file = load_file(loads.resolver, raw->index, loads.options);
+  }, [raw, &loads](std::vector<int>& resumed){
+    finish_load(loads, raw, resumed);
+  });
+  if(!submitted){
+    loads.spare.push_back(std::move(load));
+    return false;
+  }
+  load->waiting.push_back(connection);
+  loads.loading.push_back(std::move(load));
+  return true;
+}
+
+
+//Busca el fichero path (relativo al directorio base) en la cache. Si falta y hay reserva de
+//hilos de fs, encarga la carga (abrir, fstat, mmap con --mmap y pedir por adelantado el
+//principio del fichero) y devuelve EINPROGRESS. Una peticion reanudada se sirve de lo que se
+//ha cargado para ella, este o no en la cache; lo que le siga faltando (un indice expulsado
+//entretanto) lo carga en el hilo de red y lo cuenta en fs_inline, para terminar aunque la
+//carga no llegue a guardarse. Sin reserva o con su cola llena tambien se carga aqui
+std::expected<std::shared_ptr<const file_entry>, int> fetch_file(std::string_view path, const request_context& context, file_loads& loads){
+  if(loads.pool != nullptr && context.resumed){
+    std::optional<FileCache::result> loaded = loaded_file(loads, path);
+    if(loaded) return std::move(loaded.value());
+  }
+  std::optional<FileCache::result> cached = loads.cache.find(path);
+  if(cached) return std::move(cached.value());
+  if(loads.pool == nullptr || context.connection < 0) return loads.cache.load(path);
+  if(context.resumed){
+    loads.pool->count_inline();
+    return loads.cache.load(path);
+  }
+  if(start_load(path, false, context.connection, loads)) return std::unexpected(EINPROGRESS);
+  return loads.cache.load(path);
+}
+
+
+//Como fetch_file para la comprobacion del programa path de /bin (ver check_program).
+//Devuelve el descriptor del programa, el error de la comprobacion o EINPROGRESS si hay que
+//esperarla. Las conexiones que han esperado a la misma comprobacion reciben cada una una copia
+std::expected<SafeFD, int> fetch_program_check(std::string_view path, const request_context& context, file_loads& loads){
+  if(loads.pool == nullptr || context.connection < 0) return check_program(loads.resolver, std::string(path));
+  if(context.resumed){
+    auto finished = std::ranges::find_if(loads.finished, [path](const std::unique_ptr<pending_load>& load){
+      return load->program && load->path == path;
+    });
+    if(finished != loads.finished.end()){
+      const std::expected<SafeFD, int>& checked = (*finished)->checked;
+      if(!checked) return std::unexpected(checked.error());
+      int fd = fcntl(checked.value().get(), F_DUPFD_CLOEXEC, 0);
+      if(fd < 0) return std::unexpected(errno);
+      return SafeFD(fd);
+    }
+    loads.pool->count_inline();
+    return check_program(loads.resolver, std::string(path));
   }
+  if(start_load(path, true, context.connection, loads)) return std::unexpected(EINPROGRESS);
+  return check_program(loads.resolver, std::string(path));
+}
+
+
+//Entorno del programa: el del servidor mas las variables de exec_environment
+std::vector<std::string> make_environment(const exec_environment& env){
+  std::vector<std::string> variables{
+    "REQUEST_PATH=" + env.REQUEST_PATH,
+    "SERVER_BASEDIR=" + env.SERVER_BASEDIR,
+    "REMOTE_PORT=" + env.REMOTE_PORT,
+    "REMOTE_IP=" + env.REMOTE_IP,
+  };
+  for(char** var = environ; *var != nullptr; var++){
+    std::string_view name(*var, std::strcspn(*var, "="));
+    if(name != "REQUEST_PATH" && name != "SERVER_BASEDIR" && name != "REMOTE_PORT" && name != "REMOTE_IP") variables.emplace_back(*var);
+  }
+  return variables;
+}
+
+
+//Los clientes de un socket Unix no tienen IP ni puerto: REMOTE_IP y REMOTE_PORT van vacias
+exec_environment make_exec_environment(std::string_view request_path, const program_options& options, const sockaddr_storage& client_addr){
+  client_address client = client_address::from(client_addr);
+  exec_environment env;
+  env.REQUEST_PATH = request_path;
+  env.SERVER_BASEDIR = options.basedir;
+  env.REMOTE_IP = client.ip_string();
+  if(!env.REMOTE_IP.empty()) env.REMOTE_PORT = std::to_string(ntohs(client.port));
+  return env;
+}
+
+
+//Descriptor del programa en el hijo, que se ejecuta por /proc/self/fd: la ruta lleva al mismo
+//fichero que se ha comprobado, no a lo que haya ahora en su lugar (como fexecve, que no se
+//puede pedir a posix_spawn). Un script lo lee su interprete por esa ruta, asi que el
+//descriptor sigue abierto en el programa
+constexpr int program_fd{3};
+
+
+//Lanza el programa abierto en program (ver check_program), como lider de un grupo de procesos
+//nuevo, con su salida estandar redirigida a una tuberia cuyo extremo de lectura se devuelve.
+//path es su ruta, que recibe como argv[0]. Se usa posix_spawn, que usa vfork y no copia las
+//tablas de paginas del servidor
+std::expected<spawned_program, execute_program_error> spawn_program(const SafeFD& program, const std::string& path, const exec_environment& env){
+  execute_program_error error;
+  error.exit_code = -1;
 
-  //Crear tubería
+  //Crear tubería (que el programa existe y se puede ejecutar ya lo ha comprobado check_program)
   int pipefd[2];
-  int result = pipe(pipefd);
+  int result = pipe2(pipefd, O_CLOEXEC);
   if(result < 0){
     std::cerr << "Error al crear pipe" << std::endl;
     error.error_code = errno;
     return std::unexpected(error);
   }
+  SafeFD read_end(pipefd[0]);
+  SafeFD write_end(pipefd[1]);
+
+  //Redirigir la salida estandar del hijo a la tuberia y pasarle el programa; dup2 quita
+  //O_CLOEXEC a las copias (tambien si program ya es program_fd)
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, write_end.get(), STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, program.get(), program_fd);
+
+  //Grupo de procesos propio, para que al matarlo por tiempo caigan tambien sus descendientes,
+  //que heredan la tuberia y la mantendrian abierta
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attributes, 0);
+
+  std::vector<std::string> variables = make_environment(env);
+  std::vector<char*> envp;
+  for(std::string& var : variables) envp.push_back(var.data());
+  envp.push_back(nullptr);
 
   //Crear proceso hijo
-  pid_t pid_hijo = fork();
-  if(pid_hijo < 0){
+  pid_t pid_hijo;
+  std::array<char*, 2> argv{const_cast<char*>(path.c_str()), nullptr};
+  std::array<char, 32> executable{};
+  std::format_to_n(executable.data(), executable.size() - 1, "/proc/self/fd/{}", program_fd);
+  result = posix_spawn(&pid_hijo, executable.data(), &actions, &attributes, argv.data(), envp.data());
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attributes);
+  if(result != 0){
     std::cerr << "Error al crear el proceso" << std::endl;
-    error.error_code = errno;
+    error.error_code = result;
     return std::unexpected(error);
   }
-  if(pid_hijo == 0){
-    //Bloque proceso hijo
-    if(dup2(pipefd[1], STDOUT_FILENO) < 0){
-      std::cerr << "Error en la redireccion de salida estandar al proceso hijo" << std::endl;
-      error.error_code = errno;
-      return std::unexpected(error);
+  //Al salir se cierra nuestra copia del extremo de escritura, para ver EOF cuando el hijo termine
+  return spawned_program{pid_hijo, std::move(read_end)};
+}
+
+
+//Ejecuta el programa y devuelve todo lo que escribe por su salida estandar (motor bloqueante).
+//La tuberia se lee mientras el hijo se ejecuta: esperar antes a que termine bloquearia a
+//ambos procesos en cuanto la salida llenase la tuberia. Si tarda mas de timeout se mata y el
+//error es ETIMEDOUT
+std::expected<std::string, execute_program_error> execute_program(const SafeFD& executable, const std::string& path, const exec_environment& env,
+                                                                  std::chrono::seconds timeout){
+  std::expected<spawned_program, execute_program_error> program = spawn_program(executable, path, env);
+  if(!program) return std::unexpected(program.error());
+  execute_program_error error;
+  error.exit_code = -1;
+  error.error_code = 0;
+
+  std::string output;
+  char buffer[4096];
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  bool killed{false};
+  while(true){
+    if(!killed){
+      auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      pollfd poll_fd{program.value().output.get(), POLLIN, 0};
+      int ready = poll(&poll_fd, 1, static_cast<int>(std::max<std::chrono::milliseconds::rep>(remaining.count(), 0)));
+      if(ready < 0 && errno == EINTR) continue;
+      if(ready == 0){
+        kill(-program.value().pid, SIGKILL);
+        killed = true;
+      }
     }
-    if(execl(path.c_str(), path.c_str(), NULL) == -1){
-      std::cerr << std::strerror(errno) << std::endl;
+    ssize_t size = read(program.value().output.get(), buffer, sizeof(buffer));
+    if(size < 0){
+      if(errno == EINTR) continue;
       error.error_code = errno;
-      _exit(126);
+      break;
     }
+    if(size == 0) break;
+    output.append(buffer, static_cast<size_t>(size));
   }
-  else{
-    //Esperar a que el proceso hijo termine
-    int status_hijo;
-    waitpid(pid_hijo, &status_hijo, 0);
-    read(pipefd[0], buffer, sizeof(buffer));
+
+  //Recoger al hijo para que no quede zombi. Su codigo de salida no cambia la respuesta: se
+  //envia lo que haya escrito, salvo que haya muerto por una senal
+  int status_hijo;
+  while(waitpid(program.value().pid, &status_hijo, 0) < 0 && errno == EINTR){}
+  if(killed) error.error_code = ETIMEDOUT;
+  if(killed || !WIFEXITED(status_hijo)) return std::unexpected(error);
+  return output;
+}
+
+
+//Cabecera Cache-Control configurada para target, o vacia. Un directorio contiene a target si
+//es un prefijo suyo que termina en una separacion de la ruta
+std::string_view find_cache_control(const program_options& options, std::string_view target){
+  std::string_view found;
+  size_t longest{0};
+  for(const auto& [directory, header] : options.cache_control){
+    bool contains = directory == "/" || (target.starts_with(directory) && (target.size() == directory.size() || target[directory.size()] == '/'));
+    if(contains && directory.size() >= longest){
+      found = header;
+      longest = directory.size();
+    }
   }
-  return buffer;
+  return found;
 }
 
 
-int main(int argc, char* argv[]){
-  std::expected<program_options, parse_args_errors> arguments = parse_args(argc, argv);
-  if(!arguments){
-    if(arguments.error() == parse_args_errors::missing_argument) std::cerr << "Missing argument" << std::endl;
-    else if(arguments.error() == parse_args_errors::wrong_argument) std::cerr << "Wrong argument" << std::endl;
-    else if(arguments.error() == parse_args_errors::unknown_option) std::cerr << "Unknown option" << std::endl;
-    return -1;
+//Comprueba las condiciones de la peticion contra los validadores del fichero (etag es el de
+//la variante que se enviaria). If-None-Match
+//tiene prioridad y, si esta, If-Modified-Since se ignora (RFC 9110, 13.2.2)
+bool not_modified(const http_request& request, std::string_view etag, std::string_view last_modified, time_t mtime){
+  std::string_view if_none_match = request.header("If-None-Match");
+  if(!if_none_match.empty()) return etag_matches(if_none_match, etag);
+  std::string_view if_modified_since = request.header("If-Modified-Since");
+  if(if_modified_since.empty()) return false;
+  //Lo habitual es que el cliente repita el Last-Modified que recibio
+  if(if_modified_since == last_modified) return true;
+  std::optional<time_t> since = parse_http_date(if_modified_since);
+  return since && mtime <= since.value();
+}
+
+
+//If-Range: los rangos solo se atienden si el fichero sigue siendo el que el cliente tiene.
+//Con un ETag la comparacion es fuerte y con una fecha tiene que ser exactamente Last-Modified
+bool range_applies(const http_request& request, std::string_view etag, std::string_view last_modified){
+  std::string_view if_range = request.header("If-Range");
+  return if_range.empty() || if_range == etag || if_range == last_modified;
+}
+
+
+//Los ficheros se pueden enviar comprimidos segun Accept-Encoding, asi que todas sus respuestas
+//lo indican para las caches intermedias
+constexpr std::string_view vary_encoding{"Vary: Accept-Encoding\r\n"};
+
+
+//Da formato a una cabecera en la arena de la respuesta, sin reservar memoria del heap
+template<typename... Args>
+std::pmr::string arena_format(const response& resp, std::format_string<Args...> format, Args&&... args){
+  std::pmr::string text(resp.memory());
+  std::format_to(std::back_inserter(text), format, std::forward<Args>(args)...);
+  return text;
+}
+
+
+//Cabecera de una respuesta simple: "<name>: <size> bytes"
+void build_simple_header(std::string& header, std::string_view name, size_t size){
+  char length[24];
+  auto [end, ec] = std::to_chars(length, length + sizeof(length), size);
+  header.clear();
+  header.append(name).append(": ").append(length, end).append(" bytes\n");
+}
+
+
+//Validadores ("ETag: ...\r\nLast-Modified: ...\r\n") de la variante con codificacion coding
+//de un fichero con ETag etag, en la arena de la respuesta: su ETag es el del fichero con la
+//codificacion al final
+std::pmr::string variant_validators(const response& resp, std::string_view etag, std::string_view coding, std::string_view last_modified){
+  std::pmr::string validators(resp.memory());
+  validators.append("ETag: ").append(etag.substr(0, etag.size() - 1)).append("-").append(coding).append("\"\r\n");
+  validators.append("Last-Modified: ").append(last_modified).append("\r\n");
+  return validators;
+}
+
+
+//El ETag dentro de los validadores de variant_validators
+std::string_view variant_etag(std::string_view validators){
+  validators.remove_prefix(std::string_view("ETag: ").size());
+  return validators.substr(0, validators.find('\r'));
+}
+
+
+//Lo que describe al fichero que se envia, sea de la cache o del archivo de docpack: su tipo,
+//su tamano y sus validadores (validators son las cabeceras ETag y Last-Modified ya formadas)
+struct representation{
+  std::string_view type;
+  size_t size;
+  std::string_view etag;
+  std::string_view last_modified;
+  time_t mtime;
+  std::string_view validators;
+};
+
+
+representation describe_file(const file_entry& file, std::string_view type){
+  return representation{type, file.size, file.etag, file.last_modified, file.mtime.tv_sec, file.validators};
+}
+
+
+//Prepara la cabecera HTTP para enviar file, con sus validadores y cache_control. Si el
+//cliente ya lo tiene se responde 304 sin cuerpo. Con una cabecera Range valida solo se envian
+//los rangos pedidos (206), como multipart/byteranges si son varios: las partes quedan en
+//resp.ranges con sus separadores y quien llama pone el cuerpo segun de donde salga. Las
+//respuestas sin cuerpo (304 y 416) sueltan resp.file
+void build_representation_header(const http_request& request, response& resp, const representation& file, std::string_view cache_control){
+  size_t size = file.size;
+  if(not_modified(request, file.etag, file.last_modified, file.mtime)){
+    resp.status = 304;
+    //Content-Length es el del 200 que se habria enviado; el 304 no lleva cuerpo
+    build_http_header(resp.header, "304 Not Modified", {}, size, resp.keep_alive, {file.validators, vary_encoding, cache_control});
+    resp.file.reset();
+    return;
   }
-  if(arguments.value().show_help){
-    help();
-    return 0;
+
+  std::array<byte_range, max_byte_ranges> ranges;
+  size_t range_count{0};
+  std::string_view range_header = request.header("Range");
+  range_result ranged{range_result::ignored};
+  if(!range_header.empty() && range_applies(request, file.etag, file.last_modified)) ranged = parse_byte_ranges(range_header, size, ranges, range_count);
+
+  if(ranged == range_result::ignored){
+    resp.status = 200;
+    build_http_header(resp.header, "200 OK", file.type, size, resp.keep_alive, {"Accept-Ranges: bytes\r\n", vary_encoding, file.validators, cache_control});
+    return;
+  }
+  if(ranged == range_result::unsatisfiable){
+    resp.status = 416;
+    build_http_header(resp.header, "416 Range Not Satisfiable", {}, 0, resp.keep_alive, {arena_format(resp, "Content-Range: bytes */{0}\r\n", size)});
+    resp.file.reset();
+    return;
   }
 
-  //Crear un socket y asignarle el puerto indicado
-  std::expected<SafeFD, int> socket = make_socket(arguments.value().port);
-  if(!socket){
-    std::cerr << "Error while making socket" << std::endl;
-    return -1;
+  resp.status = 206;
+  if(range_count == 1){
+    const byte_range& range = ranges[0];
+    size_t length = range.last - range.first + 1;
+    resp.ranges.push_back(file_range{range.first, length, {}});
+    build_http_header(resp.header, "206 Partial Content", file.type, length, resp.keep_alive,
+                      {arena_format(resp, "Content-Range: bytes {0}-{1}/{2}\r\n", range.first, range.last, size), vary_encoding, file.validators, cache_control});
+    return;
   }
 
-  if(listen_connection(socket.value()) != EXIT_SUCCESS){
-    std::cerr << "Error while setting socket to listen" << std::endl;
-    return -1;
+  //Cada parte lleva su separador y sus cabeceras delante de los bytes del fichero
+  std::pmr::string boundary = make_boundary(resp.memory());
+  size_t length{0};
+  for(size_t i = 0; i < range_count; i++){
+    const byte_range& range = ranges[i];
+    file_range part{range.first, range.last - range.first + 1, {}};
+    part.prefix = arena_format(resp, "{0}--{1}\r\nContent-Type: {2}\r\nContent-Range: bytes {3}-{4}/{5}\r\n\r\n",
+                               i == 0 ? "" : "\r\n", boundary, file.type, range.first, range.last, size);
+    length += part.prefix.size() + part.length;
+    resp.ranges.push_back(std::move(part));
   }
-  if(arguments.value().verbose) std::cerr << "Listening for incoming connections on port " << arguments.value().port << std::endl;
+  resp.ranges.push_back(file_range{0, 0, arena_format(resp, "\r\n--{0}--\r\n", boundary)});
+  length += resp.ranges.back().prefix.size();
+  build_http_header(resp.header, "206 Partial Content", arena_format(resp, "multipart/byteranges; boundary={0}", boundary), length, resp.keep_alive,
+                    {vary_encoding, file.validators, cache_control});
+}
 
-  sockaddr_in client_addr;
-  std::string header{};
-  std::string body{};
-  exec_environment env_vars;
 
-  while(true){
-    std::expected<SafeFD, int> new_fd = accept_connection(socket.value(), client_addr, arguments.value().verbose);
-    if(!new_fd){
-      std::cerr << "Error accepting connection" << std::endl;
-      return -1;
+//Prepara la cabecera HTTP para enviar el fichero de resp.file de tipo type, desde su
+//descriptor o su proyeccion (ver build_representation_header)
+void build_file_header(const http_request& request, response& resp, std::string_view type, std::string_view cache_control){
+  build_representation_header(request, resp, describe_file(*resp.file, type), cache_control);
+}
+
+
+//Codificacion del hermano precomprimido que se envia en lugar del fichero: zstd antes que
+//gzip, si el cliente la acepta y find(extension) lo encuentra. Vacia si no hay ninguno
+template<typename Find>
+std::string_view negotiate_sibling(std::string_view accept, Find&& find){
+  if(accepts_encoding(accept, "zstd") && find(std::string_view(".zst"))) return "zstd";
+  if(accepts_encoding(accept, "gzip") && find(std::string_view(".gz"))) return "gzip";
+  return {};
+}
+
+
+//Prepara la cabecera HTTP para enviar la variante de file con codificacion coding, de
+//length bytes: 304 si el cliente ya la tiene (y se suelta resp.file) o 200, cuyo cuerpo pone
+//quien llama. Las variantes no admiten Range
+void build_variant_header(const http_request& request, response& resp, const representation& file, std::string_view coding, size_t length,
+                          std::string_view cache_control, worker_metrics& stats){
+  std::pmr::string validators = variant_validators(resp, file.etag, coding, file.last_modified);
+  if(not_modified(request, variant_etag(validators), file.last_modified, file.mtime)){
+    resp.status = 304;
+    build_http_header(resp.header, "304 Not Modified", {}, length, resp.keep_alive, {vary_encoding, validators, cache_control});
+    resp.file.reset();
+    return;
+  }
+  resp.status = 200;
+  build_http_header(resp.header, "200 OK", file.type, length, resp.keep_alive,
+                    {coding == "zstd" ? "Content-Encoding: zstd\r\n" : "Content-Encoding: gzip\r\n", vary_encoding, validators, cache_control});
+  stats.encoded_responses.add();
+  if(file.size > length) stats.encoding_bytes_saved.add(file.size - length);
+}
+
+
+//Si el cliente la acepta, prepara la respuesta con una variante comprimida del fichero de
+//resp.file (de ruta path): el hermano precomprimido path.zst o path.gz si existe o, para los
+//tipos de texto, el fichero comprimido al vuelo con gzip (ver build_variant_header).
+//Devuelve false si hay que enviar el fichero sin codificar
+bool build_encoded_response(const http_request& request, response& resp, std::string_view path, std::string_view type, std::string_view cache_control,
+                            FileCache& cache, EncodingCache& encodings, worker_metrics& stats){
+  std::string_view accept = request.header("Accept-Encoding");
+  if(accept.empty()) return false;
+  const file_entry& file = *resp.file;
+  const encoded_variants& variants = encodings.get(path, file);
+  bool zstd_sibling = variants.zstd_sibling;
+  bool gzip_sibling = variants.gzip_sibling;
+  bool gzip_tried = variants.gzip_tried;
+
+  std::shared_ptr<const file_entry> sibling;
+  std::shared_ptr<const std::string> body;
+  std::string_view coding = negotiate_sibling(accept, [&](std::string_view extension){
+    if(!(extension == ".zst" ? zstd_sibling : gzip_sibling)) return false;
+    std::pmr::string sibling_path(path, resp.memory());
+    std::expected<std::shared_ptr<const file_entry>, int> found = cache.get(sibling_path.append(extension));
+    if(!found) return false;
+    sibling = std::move(found.value());
+    return true;
+  });
+  if(coding.empty()){
+    if(!compressible(type) || !accepts_encoding(accept, "gzip")) return false;
+    auto start = std::chrono::steady_clock::now();
+    body = encodings.gzip(path, file);
+    if(!gzip_tried && body) stats.compress.record(std::chrono::steady_clock::now() - start);
+    if(!body) return false;
+    coding = "gzip";
+  }
+  size_t length = sibling ? sibling->size : body->size();
+
+  build_variant_header(request, resp, describe_file(file, type), coding, length, cache_control, stats);
+  if(resp.status == 200){
+    resp.file = std::move(sibling);
+    resp.shared_body = std::move(body);
+  }
+  return true;
+}
+
+
+//El listado se pide en JSON con Accept: application/json o con format=json en la query
+listing_format choose_listing_format(const http_request& request, bool http){
+  if(!http) return listing_format::text;
+  size_t query = request.target.find('?');
+  if(query != std::string_view::npos){
+    std::string_view parameters = request.target.substr(query + 1);
+    parameters = parameters.substr(0, parameters.find('#'));
+    size_t found = parameters.find("format=json");
+    if(found != std::string_view::npos && (found == 0 || parameters[found - 1] == '&')) return listing_format::json;
+  }
+  if(request.header("Accept").find("application/json") != std::string_view::npos) return listing_format::json;
+  return listing_format::html;
+}
+
+
+//Responde con el listado del directorio relative. Como cambia con cada fichero nuevo solo se
+//valida con su ETag, sin Last-Modified
+std::expected<void, int> build_listing(const http_request& request, response& resp, bool http, std::string_view relative,
+                                       const program_options& options, DirectoryCache& directories, worker_metrics& stats){
+  listing_format format = choose_listing_format(request, http);
+  auto start = std::chrono::steady_clock::now();
+  std::expected<directory_listing, int> listing = directories.get(relative, format);
+  stats.file_open.record(std::chrono::steady_clock::now() - start);
+  if(!listing){
+    int error = listing.error();
+    std::string_view status = error == EACCES || error == EXDEV || error == ELOOP ? "403 Forbidden"
+                            : error == ENOENT || error == ENOTDIR ? "404 Not Found" : "500 Internal Server Error";
+    if(status.starts_with('5')) std::cerr << "Error listing /" << relative << ": " << std::strerror(error) << std::endl;
+    std::from_chars(status.begin(), status.end(), resp.status);
+    if(http) build_http_header(resp.header, status, {}, 0, resp.keep_alive);
+    else resp.header.append(status).append("\n");
+    return {};
+  }
+  const std::string& body = *listing.value().body;
+  if(!http){
+    resp.status = 200;
+    std::pmr::string name("/", resp.memory());
+    build_simple_header(resp.header, name.append(relative), body.size());
+    resp.shared_body = std::move(listing.value().body);
+    return {};
+  }
+  std::pmr::string etag("ETag: ", resp.memory());
+  etag.append(listing.value().etag).append("\r\n");
+  //Las respuestas dependen de Accept, ademas de la ruta
+  constexpr std::string_view vary_accept{"Vary: Accept\r\n"};
+  std::pmr::string directory("/", resp.memory());
+  std::string_view cache_control = find_cache_control(options, directory.append(relative).append("/"));
+  std::string_view type = format == listing_format::json ? "application/json" : "text/html; charset=utf-8";
+  std::string_view if_none_match = request.header("If-None-Match");
+  if(!if_none_match.empty() && etag_matches(if_none_match, listing.value().etag)){
+    resp.status = 304;
+    build_http_header(resp.header, "304 Not Modified", {}, body.size(), resp.keep_alive, {vary_accept, etag, cache_control});
+    return {};
+  }
+  resp.status = 200;
+  build_http_header(resp.header, "200 OK", type, body.size(), resp.keep_alive, {vary_accept, etag, cache_control});
+  resp.shared_body = std::move(listing.value().body);
+  return {};
+}
+
+
+//Responde con un fichero del archivo de docpack: no se abre nada y el cuerpo es un trozo de la
+//proyeccion, asi que tampoco se copia. Los directorios no existen en el archivo; una ruta sin
+//fichero con un indice dentro es un directorio. Las cabeceras son las de build_file_header y
+//los hermanos precomprimidos de build_encoded_response, sin compresion al vuelo ni listados
+std::expected<void, int> build_archive_response(const http_request& request, response& resp, bool http, std::pmr::string relative,
+                                                const program_options& options, const Archive& archive, worker_metrics& stats){
+  auto start = std::chrono::steady_clock::now();
+  std::optional<archived_file> file = archive.find(relative);
+  if(!file && !options.index.empty()){
+    std::pmr::string index(relative, resp.memory());
+    if(!index.empty()) index.append("/");
+    file = archive.find(index.append(options.index));
+    std::string_view path = request.target.substr(0, request.target.find_first_of("?#"));
+    if(file && http && !path.ends_with('/')){
+      resp.status = 301;
+      build_http_header(resp.header, "301 Moved Permanently", {}, 0, resp.keep_alive,
+                        {arena_format(resp, "Location: {0}/{1}\r\n", path, request.target.substr(path.size()))});
+      return {};
     }
-    std::expected<std::string, int> request_str = receive_request(new_fd.value(), 1024);
-    if(!request_str){
-      std::cerr << std::strerror(request_str.error());
-      if(request_str.error() != ECONNRESET) return -1;
+    if(file) relative = std::move(index);
+  }
+  stats.file_open.record(std::chrono::steady_clock::now() - start);
+  if(!file){
+    resp.status = 404;
+    if(http) build_http_header(resp.header, "404 Not Found", {}, 0, resp.keep_alive);
+    else resp.header.append("404 Not Found\n");
+    return {};
+  }
+  if(!http){
+    resp.status = 200;
+    build_simple_header(resp.header, relative, file->data.size());
+    resp.archived = file->data;
+    return {};
+  }
+
+  std::pmr::string file_str("/", resp.memory());
+  std::string_view cache_control = find_cache_control(options, file_str.append(relative));
+  representation described{file->type, file->data.size(), file->etag, file->last_modified, file->mtime, file->validators};
+  std::string_view accept = request.header("Accept-Encoding");
+  if(!accept.empty()){
+    std::optional<archived_file> sibling;
+    std::pmr::string sibling_path(resp.memory());
+    std::string_view coding = negotiate_sibling(accept, [&](std::string_view extension){
+      sibling_path.assign(relative).append(extension);
+      sibling = archive.find(sibling_path);
+      return sibling.has_value();
+    });
+    if(!coding.empty()){
+      build_variant_header(request, resp, described, coding, sibling->data.size(), cache_control, stats);
+      if(resp.status == 200) resp.archived = sibling->data;
+      return {};
     }
+  }
+
+  build_representation_header(request, resp, described, cache_control);
+  std::string_view data = file->data;
+  if(resp.status == 200) resp.archived = data;
+  //Un rango es un trozo de la proyeccion; varios se copian en el buffer con sus separadores
+  else if(resp.status == 206){
+    if(resp.ranges.size() == 1) resp.archived = data.substr(resp.ranges[0].offset, resp.ranges[0].length);
+    else for(const file_range& part : resp.ranges) resp.buffer.append(part.prefix).append(data.substr(part.offset, part.length));
+    resp.ranges.clear();
+  }
+  return {};
+}
+
+
+//Construye la respuesta a una peticion y deja su codigo en resp.status. Devuelve EINPROGRESS
+//si espera a que la reserva de hilos de fs cargue el fichero (ver fetch_file)
+std::expected<void, int> build_response(const request_context& context, response& resp, const program_options& options,
+                                        FileCache& cache, file_loads& loads, EncodingCache& encodings, const Metrics& metrics,
+                                        DirectoryCache& directories, const Archive* archive, const RateLimiter& limiter, worker_metrics& stats){
+  const http_request& request = context.request;
+  //Las peticiones HTTP/1.x (y las que no se entienden) reciben una respuesta HTTP; las
+  //simples, el formato original
+  bool http = context.status != parse_status::complete || request.is_http();
+  resp.keep_alive = context.keep_alive_allowed && request.keep_alive();
+  //Respuesta sin cuerpo, solo con el estado
+  auto status_header = [&](std::string_view status){
+    std::from_chars(status.begin(), status.end(), resp.status);
+    if(http) build_http_header(resp.header, status, {}, 0, resp.keep_alive);
+    else resp.header.append(status).append("\n");
+  };
 
-    bool bad_req{false};
-    std::istringstream iss(request_str.value());
-    std::string first_str, file_str, path_str;
-    iss >> first_str >> file_str;
-    if(first_str != "GET" || file_str[0] != '/' || request_str.value().empty()) bad_req = true;
+  if(context.status == parse_status::too_large){
+    status_header("431 Request Header Fields Too Large");
+    return {};
+  }
+  if(context.status == parse_status::unsupported_version){
+    status_header("505 HTTP Version Not Supported");
+    return {};
+  }
+  //No se leen cuerpos: la conexion se cierra tras responder (ver parse_status::has_body).
+  //Transfer-Encoding, con o sin Content-Length, no se entiende
+  if(context.status == parse_status::has_body){
+    resp.keep_alive = false;
+    resp.discard_input = true;
+    if(request.has_header("Transfer-Encoding")) status_header("400 Bad Request");
+    else status_header("413 Content Too Large");
+    return {};
+  }
+  //Antes de hacer ningun trabajo por la peticion. Una peticion reanudada ya ha pasado
+  std::chrono::nanoseconds retry_after{0};
+  if(!context.resumed && !limiter.take(client_key(context.client_addr), retry_after)){
+    stats.rate_limited.add();
+    resp.status = 429;
+    auto seconds = std::chrono::ceil<std::chrono::seconds>(retry_after).count();
+    if(http) build_http_header(resp.header, "429 Too Many Requests", {}, 0, resp.keep_alive, {arena_format(resp, "Retry-After: {0}\r\n", std::max<decltype(seconds)>(seconds, 1))});
+    else resp.header.append("429 Too Many Requests\n");
+    return {};
+  }
+  //La ruta se decodifica y normaliza: relative no sale nunca del directorio base. Las cadenas
+  //de la peticion se forman en la arena de la respuesta
+  std::pmr::memory_resource* memory = resp.memory();
+  std::optional<std::pmr::string> relative;
+  if(context.status == parse_status::complete && request.method == "GET" && request.target.starts_with('/')) relative = canonical_path(request.target, memory);
+  if(!relative){
+    resp.keep_alive = false;
+    status_header("400 Bad Request");
+    return {};
+  }
+  std::pmr::string file_str("/", memory);
+  file_str.append(relative.value());
+  //Los errores de abrir un fichero: EXDEV es una ruta que sale del directorio base
+  auto open_error = [&](int error){
+    if(error == EACCES || error == EXDEV || error == ELOOP) status_header("403 Forbidden");
+    else if(error == ENOENT || error == ENOTDIR || error == EISDIR) status_header("404 Not Found");
+    else return false;
+    return true;
+  };
 
-    if(bad_req) send_response(new_fd.value(), "400 Bad Request", arguments.value().verbose);
-    else path_str = arguments.value().basedir + file_str;
+  if(!options.metrics_path.empty() && file_str == std::string_view(options.metrics_path)){
+    resp.status = 200;
+    resp.buffer = metrics.render();
+    if(http) build_http_header(resp.header, "200 OK", "text/plain; version=0.0.4; charset=utf-8", resp.buffer.size(), resp.keep_alive);
+    else build_simple_header(resp.header, "metrics", resp.buffer.size());
+    return {};
+  }
 
-    if(file_str.starts_with("/bin")){
-      std::expected<std::string, execute_program_error> output = execute_program(path_str);
-      std::cout << output.value() << std::endl;
+  if(relative.value() == "bin" || relative.value().starts_with("bin/")){
+    auto program_error = [&](const execute_program_error& error){
+      if(error.error_code == ETIMEDOUT) status_header("504 Gateway Timeout");
+      else if(!open_error(error.error_code)) status_header("500 Internal Server Error");
+    };
+    //Antes de lanzarlo se comprueba, en la reserva de hilos de fs si la hay, que el programa
+    //esta dentro del directorio base sin seguir enlaces hacia fuera y se puede ejecutar. Se
+    //lanza desde el descriptor de esa comprobacion
+    std::expected<SafeFD, int> checked = fetch_program_check(relative.value(), context, loads);
+    if(!checked && checked.error() == EINPROGRESS) return std::unexpected(EINPROGRESS);
+    if(!checked){
+      program_error(execute_program_error{-1, checked.error()});
+      return {};
     }
+    std::string path_str = options.basedir;
+    path_str.append(file_str);
+    exec_environment env = make_exec_environment(file_str, options, context.client_addr);
 
-    else{
-      std::expected<SafeMap, int> map = read_all(path_str, arguments.value().verbose);
-      if(!map){
-        std::cerr << std::strerror(map.error()) << std::endl;
-        if(map.error() == 13) send_response(new_fd.value(), "403 Forbidden", arguments.value().verbose);
-        else if(map.error() == 2) send_response(new_fd.value(), "404 Not Found", arguments.value().verbose);
-        else return -1;
-      }
-      else{
-        file_str.erase(0, 1);
-        int response = send_response(new_fd.value(), std::format("{0}: {1} bytes", file_str, map.value().get().size()), arguments.value().verbose, map.value().get());
-        if(response != 0){
-          std::cerr << "Error sending response" << std::endl;
-          if(response != ECONNRESET) return -1;
+    //El motor bloqueante espera a que termine; los demas reenvian la salida segun se produce
+    if(options.engine == server_engine::blocking){
+      auto start = std::chrono::steady_clock::now();
+      std::expected<std::string, execute_program_error> output = execute_program(checked.value(), path_str, env, options.cgi_timeout);
+      stats.cgi.record(std::chrono::steady_clock::now() - start);
+      if(!output){
+        program_error(output.error());
+        return {};
+      }
+      resp.status = 200;
+      resp.buffer = std::move(output.value());
+      file_str.erase(0, 1);
+      if(http) build_http_header(resp.header, "200 OK", "text/plain; charset=utf-8", resp.buffer.size(), resp.keep_alive);
+      else build_simple_header(resp.header, file_str, resp.buffer.size());
+      return {};
+    }
+
+    std::expected<spawned_program, execute_program_error> program = spawn_program(checked.value(), path_str, env);
+    if(!program){
+      program_error(program.error());
+      return {};
+    }
+    //Con io_uring la tuberia la lee un hilo del kernel que puede bloquearse
+    if(options.engine == server_engine::epoll){
+      int result = set_nonblocking(program.value().output);
+      if(result != EXIT_SUCCESS){
+        std::cerr << "Error preparing program output: " << std::strerror(result) << std::endl;
+        kill(-program.value().pid, SIGKILL);
+        status_header("500 Internal Server Error");
+        return {};
+      }
+    }
+    resp.status = 200;
+    resp.pipe = std::move(program.value().output);
+    resp.child = program.value().pid;
+    resp.started = std::chrono::steady_clock::now();
+    resp.deadline = resp.started + options.cgi_timeout;
+    resp.keep_alive = false;
+    file_str.erase(0, 1);
+    if(http) build_http_header(resp.header, "200 OK", "text/plain; charset=utf-8", unknown_content_length, false);
+    else resp.header.assign(file_str).append(": output follows\n");
+    return {};
+  }
+
+  if(archive != nullptr) return build_archive_response(request, resp, http, std::move(relative.value()), options, *archive, stats);
+
+  size_t misses = cache.stats().misses;
+  auto start = std::chrono::steady_clock::now();
+  std::expected<std::shared_ptr<const file_entry>, int> file = fetch_file(relative.value(), context, loads);
+  if(!file && file.error() == EINPROGRESS) return std::unexpected(EINPROGRESS);
+  stats.file_open.record(std::chrono::steady_clock::now() - start);
+  stats.cache_hits.set(cache.stats().hits);
+  stats.cache_misses.set(cache.stats().misses);
+  stats.cache_evictions.set(cache.stats().evictions);
+  if(!file && file.error() == EISDIR && (!options.index.empty() || options.listing)){
+    //Los enlaces relativos del indice o del listado necesitan que la ruta acabe en "/"
+    std::string_view path = request.target.substr(0, request.target.find_first_of("?#"));
+    if(http && !path.ends_with('/')){
+      resp.status = 301;
+      build_http_header(resp.header, "301 Moved Permanently", {}, 0, resp.keep_alive,
+                        {arena_format(resp, "Location: {0}/{1}\r\n", path, request.target.substr(path.size()))});
+      return {};
+    }
+    if(!options.index.empty()){
+      std::pmr::string index(relative.value(), memory);
+      if(!index.empty()) index.append("/");
+      std::expected<std::shared_ptr<const file_entry>, int> index_file = fetch_file(index.append(options.index), context, loads);
+      if(!index_file && index_file.error() == EINPROGRESS) return std::unexpected(EINPROGRESS);
+      if(index_file || index_file.error() != ENOENT){
+        file = std::move(index_file);
+        relative = std::move(index);
+        file_str.assign("/").append(relative.value());
+      }
+    }
+    if(!file && file.error() == ENOENT) file = std::unexpected(EISDIR);
+    if(!file && file.error() == EISDIR && options.listing) return build_listing(request, resp, http, relative.value(), options, directories, stats);
+  }
+  if(!file){
+    if(options.verbose) std::cerr << std::strerror(file.error()) << std::endl;
+    //Un fallo inesperado solo afecta a esta peticion
+    if(!open_error(file.error())){
+      std::cerr << "Error opening " << file_str << ": " << std::strerror(file.error()) << std::endl;
+      status_header("500 Internal Server Error");
+    }
+    return {};
+  }
+  if(options.verbose && cache.stats().misses != misses){
+    const file_cache_stats& cache_stats = cache.stats();
+    std::cerr << "cache: " << cache_stats.hits << " hits, " << cache_stats.misses << " misses, " << cache_stats.evictions << " evictions, "
+              << cache_stats.invalidations << " invalidations, " << cache_stats.negative_hits << " negative hits, " << cache.used() << " bytes" << std::endl;
+  }
+  resp.file = std::move(file.value());
+  if(http){
+    std::string_view type = content_type(file_str);
+    std::string_view cache_control = find_cache_control(options, file_str);
+    if(!build_encoded_response(request, resp, relative.value(), type, cache_control, cache, encodings, stats)) build_file_header(request, resp, type, cache_control);
+  }
+  else{
+    resp.status = 200;
+    file_str.erase(0, 1);
+    build_simple_header(resp.header, file_str, resp.file->size);
+  }
+  return {};
+}
+
+
+//Construye la respuesta a una peticion. Es comun a todos los motores; un error indica
+//un fallo inesperado tras el que se cierra la conexion. Anota lo que hace en las metricas
+//del trabajador worker; una peticion que espera a la reserva de hilos de fs se cuenta al
+//reanudarla
+std::expected<void, int> handle_request(const request_context& context, response& resp, const program_options& options,
+                                        FileCache& cache, file_loads& loads, EncodingCache& encodings, const Metrics& metrics,
+                                        DirectoryCache& directories, const Archive* archive, const RateLimiter& limiter, size_t worker){
+  worker_metrics& stats = metrics.worker(worker);
+#ifdef DOCSERVER_COUNT_ALLOCATIONS
+  stats.heap_allocations.set(allocation_count());
+#endif
+  std::expected<void, int> built = build_response(context, resp, options, cache, loads, encodings, metrics, directories, archive, limiter, stats);
+  if(!built && built.error() == EINPROGRESS) return built;
+  stats.requests.add();
+  if(built) stats.count_status(resp.status);
+  return built;
+}
+
+
+//Acepta una conexion de alguno de los sockets de escucha. Con uno solo accept se bloquea en
+//el; con varios, que son no bloqueantes, se prueban empezando por next, para no dar
+//preferencia a ninguno, y EAGAIN indica que ninguno tiene conexiones pendientes
+std::expected<SafeFD, int> accept_any(const std::vector<SafeFD>& sockets, sockaddr_storage& client_addr, bool verbose, size_t& next){
+  if(sockets.size() == 1) return accept_connection(sockets[0], client_addr, verbose);
+  for(size_t i = 0; i < sockets.size(); i++){
+    const SafeFD& socket = sockets[(next + i) % sockets.size()];
+    std::expected<SafeFD, int> new_fd = accept_connection(socket, client_addr, verbose);
+    if(new_fd || new_fd.error() != EAGAIN){
+      next = (next + i + 1) % sockets.size();
+      return new_fd;
+    }
+  }
+  return std::unexpected(EAGAIN);
+}
+
+
+//Motor original: atiende una conexion detras de otra con llamadas bloqueantes. Tras
+//stop_serving termina la conexion en curso y devuelve 0; los errores solo cierran la conexion.
+//Los plazos de recepcion y envio evitan que un cliente que no envia o no lee bloquee al
+//resto; con una sola conexion a la vez no hace falta limitar cuantas tiene cada cliente
+int serve_blocking(const std::vector<SafeFD>& sockets, const program_options& options, const PathResolver& resolver, FileCache& cache,
+                   EncodingCache& encodings, DirectoryCache& directories, const Archive* archive, const Metrics& metrics, const RateLimiter& limiter,
+                   const TlsContext* tls, size_t worker, AccessLog* access_log){
+  sockaddr_storage client_addr;
+  //La respuesta, su arena y el buffer de la peticion se reutilizan de una conexion a otra
+  response resp;
+  resp.arena = std::make_unique<RequestArena>();
+  std::string request_str;
+  //Con una sola conexion a la vez no hay a quien atender mientras se abre un fichero: sin
+  //reserva de hilos de fs
+  file_loads loads{nullptr, resolver, options, cache};
+  worker_metrics& stats = metrics.worker(worker);
+  std::vector<pollfd> listeners;
+  for(const SafeFD& socket : sockets){
+    listeners.push_back({socket.get(), POLLIN, 0});
+    if(sockets.size() > 1){
+      int result = set_nonblocking(socket);
+      if(result != EXIT_SUCCESS) return result;
+    }
+  }
+  size_t next{0};
+
+  while(!stop_serving.load()){
+    auto start = std::chrono::steady_clock::now();
+    std::expected<SafeFD, int> new_fd = accept_any(sockets, client_addr, options.verbose, next);
+    if(!new_fd){
+      //Con un solo socket, este es no bloqueante si antes lo ha usado un trabajador de otro motor
+      if(new_fd.error() == EAGAIN) poll(listeners.data(), listeners.size(), 1000);
+      else if(new_fd.error() != EINTR) std::cerr << "Error accepting connection: " << std::strerror(new_fd.error()) << std::endl;
+      continue;
+    }
+    //Con llamadas bloqueantes incluye la espera hasta que llega el cliente
+    auto accepted_at = std::chrono::steady_clock::now();
+    stats.accept.record(accepted_at - start);
+    stats.connections.add();
+    int timeouts = set_timeouts(new_fd.value(), options.request_timeout, options.send_timeout);
+    if(timeouts != EXIT_SUCCESS) std::cerr << "Error setting socket timeouts: " << std::strerror(timeouts) << std::endl;
+    //El handshake tambien esta sujeto a los plazos del socket
+    std::unique_ptr<TlsSession> session;
+    if(tls != nullptr){
+      std::expected<std::unique_ptr<TlsSession>, int> accepted = tls->accept(new_fd.value());
+      if(!accepted){
+        std::cerr << "Error creating TLS session: " << std::strerror(accepted.error()) << std::endl;
+        continue;
+      }
+      session = std::move(accepted.value());
+      std::expected<bool, int> established = session->handshake();
+      if(!established || !established.value()){
+        stats.tls_failed_handshakes.add();
+        if(options.verbose) std::cerr << "TLS handshake failed: " << tls_error_string() << std::endl;
+        continue;
+      }
+      stats.tls_handshake.record(std::chrono::steady_clock::now() - accepted_at);
+      stats.tls_handshakes.add();
+      if(session->resumed()) stats.tls_resumed.add();
+      if(session->kernel_send()) stats.tls_kernel_send.add();
+    }
+    request_str.clear();
+    HttpParser parser(options.max_header_size);
+    http_request request;
+    parse_status status{parse_status::incomplete};
+    while(status == parse_status::incomplete){
+      std::expected<size_t, int> received = receive_request(new_fd.value(), session.get(), request_str, 4096);
+      if(!received){
+        if(received.error() == EINTR) continue;
+        //EAGAIN: ha vencido el plazo de recepcion
+        if(received.error() != ECONNRESET && received.error() != EAGAIN){
+          std::cerr << "Error receiving request: " << std::strerror(received.error()) << std::endl;
         }
+        break;
       }
+      auto parse_start = std::chrono::steady_clock::now();
+      status = parser.parse(request_str, request, received.value() == 0);
+      if(status != parse_status::incomplete) stats.parse.record(std::chrono::steady_clock::now() - parse_start);
+      //Un cliente que envia la peticion poco a poco tampoco puede retener la conexion
+      else if(std::chrono::steady_clock::now() - accepted_at > options.request_timeout) break;
+    }
+    if(status == parse_status::incomplete || request_str.empty()) continue;
+
+    //El motor bloqueante no mantiene conexiones: bloquearia al resto de clientes
+    auto parsed_at = std::chrono::steady_clock::now();
+    resp.clear();
+    request_context context{status, request, client_addr, false};
+    std::expected<void, int> handled = handle_request(context, resp, options, cache, loads, encodings, metrics, directories, archive, limiter, worker);
+    if(!handled){
+      std::cerr << "Error serving connection: " << std::strerror(handled.error()) << std::endl;
+      continue;
+    }
+    if(resp.header.empty()) continue;
+
+    auto sending_at = std::chrono::steady_clock::now();
+    int result = send_response(new_fd.value(), session.get(), resp.header, options.verbose, resp.body(), resp.use_sendfile());
+    if(result == 0 && resp.use_sendfile()){
+      size_t part{0};
+      size_t offset{0};
+      std::expected<bool, int> sent = send_file_segments(new_fd.value(), session.get(), resp, part, offset);
+      if(!sent) result = sent.error();
+      else if(!sent.value()) result = ETIMEDOUT;
+    }
+    if(result == ETIMEDOUT) set_reset_on_close(new_fd.value());
+    else if(resp.discard_input) discard_unread(new_fd.value());
+    auto sent_at = std::chrono::steady_clock::now();
+    stats.send.record(sent_at - sending_at);
+    stats.request.record(sent_at - parsed_at);
+    if(access_log != nullptr){
+      access_entry entry;
+      entry.time = std::chrono::system_clock::now();
+      entry.duration = std::chrono::duration_cast<std::chrono::microseconds>(sent_at - parsed_at);
+      entry.bytes = resp.header.size() + (resp.use_sendfile() ? resp.file_body_size() : resp.body().size());
+      entry.client = client_address::from(client_addr);
+      entry.status = resp.status;
+      entry.set_path(request.target);
+      if(!access_log->push(entry)) stats.access_log_dropped.add();
+    }
+    if(result != 0 && result != ECONNRESET && result != EPIPE && result != ETIMEDOUT){
+      std::cerr << "Error sending response: " << std::strerror(result) << std::endl;
     }
   }
   return 0;
-}
\ No newline at end of file
+}
+
+
+//Atiende conexiones de sockets, uno por direccion de escucha, con el motor elegido (proceso
+//trabajador). Cada trabajador tiene sus propios sockets TCP con SO_REUSEPORT y el kernel
+//reparte; los sockets Unix los comparten todos. worker es su indice, que elige sus metricas.
+//Devuelve 0 si se ha parado con stop_serving
+int serve(const program_options& options, const std::vector<SafeFD>& sockets, const Metrics& metrics, const RateLimiter& limiter, const TlsContext* tls, size_t worker){
+  //Las rutas se resuelven relativas al directorio base, abierto una vez por trabajador
+  std::expected<PathResolver, int> resolver = PathResolver::open(options.basedir);
+  if(!resolver){
+    std::cerr << "Error opening base directory: " << std::strerror(resolver.error()) << std::endl;
+    return -1;
+  }
+  //Cada trabajador tiene su propia cache de ficheros abiertos y de variantes comprimidas
+  FileCache cache(options.cache_size, 4096, options.cache_valid, [&](const std::string& path){
+    return load_file(resolver.value(), path, options);
+  }, [&](const std::string& path, struct stat& file_stat){
+    return resolver.value().stat(path, file_stat);
+  });
+  EncodingCache encodings(options.compress_cache_size, options.compress_min, Z_DEFAULT_COMPRESSION, [&](const std::string& path){
+    struct stat file_stat;
+    return resolver.value().stat(path, file_stat) == EXIT_SUCCESS && S_ISREG(file_stat.st_mode);
+  });
+  //Y de listados de directorio, que vigila con su propio descriptor de inotify
+  DirectoryCache directories(resolver.value(), 256);
+  //El archivo se proyecta una vez por trabajador; las paginas las comparten todos en la cache
+  //de paginas del kernel
+  std::optional<Archive> archive;
+  if(!options.archive.empty()){
+    std::expected<Archive, int> opened = Archive::open(options.archive);
+    if(!opened){
+      std::cerr << "Error opening archive: " << std::strerror(opened.error()) << std::endl;
+      return -1;
+    }
+    archive = std::move(opened.value());
+  }
+  const Archive* archive_ptr = archive ? &archive.value() : nullptr;
+
+  //Cada trabajador tiene su propio hilo escritor del registro, creado despues del fork
+  std::unique_ptr<AccessLog> access_log;
+  if(!options.access_log.empty()){
+    std::expected<std::unique_ptr<AccessLog>, int> opened = AccessLog::open(options.access_log, options.log_full);
+    if(!opened){
+      std::cerr << "Error opening access log: " << std::strerror(opened.error()) << std::endl;
+      return -1;
+    }
+    access_log = std::move(opened.value());
+  }
+
+  if(options.engine == server_engine::blocking) return serve_blocking(sockets, options, resolver.value(), cache, encodings, directories, archive_ptr, metrics, limiter, tls, worker,
+                                                                     access_log.get());
+
+  //Los ficheros que faltan en la cache se abren en otros hilos; con un archivo no se abre
+  //ninguno. La reserva se destruye antes que las cargas que estan haciendo sus hilos
+  file_loads loads{nullptr, resolver.value(), options, cache};
+  std::unique_ptr<FsPool> fs_pool;
+  if(options.fs_threads > 0 && !archive){
+    std::expected<std::unique_ptr<FsPool>, int> created = FsPool::create(options.fs_threads, options.fs_queue, metrics.worker(worker));
+    if(!created){
+      std::cerr << "Error creating filesystem thread pool: " << std::strerror(created.error()) << std::endl;
+      return -1;
+    }
+    fs_pool = std::move(created.value());
+    loads.pool = fs_pool.get();
+  }
+
+  ConnectionLimits limits(options.max_connections, options.max_client_connections);
+  event_loop_options loop_options;
+  loop_options.max_header_size = options.max_header_size;
+  loop_options.idle_timeout = options.keepalive_timeout;
+  loop_options.max_requests = options.max_requests;
+  loop_options.request_timeout = options.request_timeout;
+  loop_options.send_timeout = options.send_timeout;
+  loop_options.drain_timeout = options.drain_timeout;
+  loop_options.verbose = options.verbose;
+  loop_options.tls = tls;
+  loop_options.fs_pool = fs_pool.get();
+  request_handler handler = [&](const request_context& context, response& resp){
+    return handle_request(context, resp, options, cache, loads, encodings, metrics, directories, archive_ptr, limiter, worker);
+  };
+  if(options.engine == server_engine::io_uring){
+    int result = run_uring_loop(sockets, loop_options, metrics.worker(worker), limits, access_log.get(), handler);
+    if(result == EXIT_SUCCESS) return 0;
+    std::cerr << "Error in io_uring loop: " << std::strerror(result) << std::endl;
+    return -1;
+  }
+  int result = run_event_loop(sockets, loop_options, metrics.worker(worker), limits, access_log.get(), handler);
+  if(result == EXIT_SUCCESS) return 0;
+  std::cerr << "Error in event loop: " << std::strerror(result) << std::endl;
+  return -1;
+}
+
+
+
+
+void request_log_reopen(int){
+  reopen_access_log.store(true);
+}
+
+
+void request_stop(int){
+  stop_serving.store(true);
+}
+
+
+//Senales que atiende el proceso principal con sigwaitinfo. Se bloquean antes de crear ningun
+//proceso y los trabajadores las desbloquean
+sigset_t master_signals(){
+  sigset_t signals;
+  sigemptyset(&signals);
+  for(int signal : {SIGTERM, SIGINT, SIGHUP, SIGUSR2, SIGCHLD}) sigaddset(&signals, signal);
+  return signals;
+}
+
+
+//En un trabajador SIGHUP pide reabrir el registro de accesos y SIGTERM o SIGINT pararlo. Sin
+//SA_RESTART las esperas de los motores se interrumpen con EINTR y ven stop_serving
+int handle_worker_signals(){
+  struct sigaction action{};
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = request_log_reopen;
+  action.sa_flags = SA_RESTART;
+  if(sigaction(SIGHUP, &action, nullptr) < 0) return errno;
+  action.sa_handler = request_stop;
+  action.sa_flags = 0;
+  if(sigaction(SIGTERM, &action, nullptr) < 0 || sigaction(SIGINT, &action, nullptr) < 0) return errno;
+  sigset_t signals = master_signals();
+  if(sigprocmask(SIG_UNBLOCK, &signals, nullptr) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+int pin_to_cpu(size_t cpu){
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(sched_setaffinity(0, sizeof(set), &set) < 0) return errno;
+  return EXIT_SUCCESS;
+}
+
+
+//Sockets de escucha de una direccion: uno por trabajador si es TCP, con SO_REUSEPORT para
+//que el kernel reparta las conexiones, y uno solo, compartido por todos, si es un socket Unix
+struct listener{
+  listen_address address;
+  std::vector<SafeFD> sockets;
+};
+
+
+//Direcciones de escucha separadas por comas, para los mensajes
+std::string describe_listeners(const program_options& options){
+  std::string text;
+  for(const listen_address& address : options.listen) text += (text.empty() ? "" : ", ") + address.to_string();
+  return text;
+}
+
+
+//Completa listeners hasta tener los sockets de cada direccion de options y, si lo consigue,
+//cierra los que sobran y los de direcciones que ya no estan. Si falla, listeners puede
+//tener sockets de mas: volver a llamarla con las opciones anteriores los quita. El primer
+//socket TCP de una direccion se enlaza sin SO_REUSEPORT para que falle si la usa otro programa
+int open_listeners(const program_options& options, std::vector<listener>& listeners){
+  for(const listen_address& address : options.listen){
+    auto found = std::ranges::find_if(listeners, [&](const listener& l){ return l.address == address; });
+    listener& current = found != listeners.end() ? *found : listeners.emplace_back(listener{address, {}});
+    size_t wanted = address.family() == AF_UNIX ? 1 : options.workers;
+    while(current.sockets.size() < wanted){
+      bool first = current.sockets.empty();
+      std::expected<SafeFD, int> socket = make_socket(address, !first);
+      if(!socket) return socket.error();
+      if(first && address.family() != AF_UNIX){
+        int result = enable_reuseport(socket.value());
+        if(result != EXIT_SUCCESS) return result;
+      }
+      current.sockets.push_back(std::move(socket.value()));
+    }
+  }
+  std::erase_if(listeners, [&](const listener& l){ return std::ranges::find(options.listen, l.address) == options.listen.end(); });
+  for(listener& current : listeners){
+    size_t wanted = current.address.family() == AF_UNIX ? 1 : options.workers;
+    current.sockets.erase(current.sockets.begin() + static_cast<std::ptrdiff_t>(wanted), current.sockets.end());
+    //Repetir listen en un socket que ya escucha solo cambia la longitud de su cola
+    for(const SafeFD& socket : current.sockets){
+      int result = listen_connection(socket, options.backlog);
+      if(result != EXIT_SUCCESS) return result;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+
+//Sockets de escucha heredados del proceso principal anterior al actualizar el programa con
+//SIGUSR2 (ver start_upgrade). Solo se usan los que escuchan en alguna de addresses; el resto
+//se cierran
+std::vector<listener> inherited_listeners(const std::vector<listen_address>& addresses){
+  std::string fds = Getenv("DOCSERVER_LISTEN_FDS");
+  unsetenv("DOCSERVER_LISTEN_FDS");
+  std::vector<listener> listeners;
+  std::string_view rest = fds;
+  while(!rest.empty()){
+    size_t comma = rest.find(',');
+    int fd{-1};
+    if(parse_number(rest.substr(0, comma), fd) && fd > STDERR_FILENO){
+      SafeFD socket(fd);
+      std::expected<listen_address, int> address = listening_address(socket);
+      if(address && std::ranges::find(addresses, address.value()) != addresses.end() && set_inheritable(socket, false) == EXIT_SUCCESS){
+        auto found = std::ranges::find_if(listeners, [&](const listener& l){ return l.address == address.value(); });
+        listener& current = found != listeners.end() ? *found : listeners.emplace_back(listener{address.value(), {}});
+        current.sockets.push_back(std::move(socket));
+      }
+    }
+    rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+  }
+  return listeners;
+}
+
+
+//Proceso trabajador lanzado por el principal y la generacion a la que pertenece
+struct worker_process{
+  size_t index;
+  unsigned generation;
+  std::chrono::steady_clock::time_point started;
+};
+
+
+//Estado del proceso principal: las opciones en vigor, los sockets de escucha de cada
+//direccion, que no se cierran al cambiar de trabajadores, y los trabajadores de la generacion
+//actual y de las anteriores que aun estan terminando sus respuestas
+struct master_state{
+  program_options options;
+  std::vector<listener> listeners;
+  Metrics metrics;
+  RateLimiter limiter;
+  //Contexto TLS comun a los trabajadores, si las conexiones son TLS
+  std::optional<TlsContext> tls;
+  unsigned generation{0};
+  std::unordered_map<pid_t, worker_process> workers;
+  //Proceso lanzado con SIGUSR2 que todavia no ha tomado el relevo, o -1
+  pid_t upgrade{-1};
+  bool stopping{false};
+};
+
+
+//Contexto TLS de las opciones, o nada si no hay certificado
+std::expected<std::optional<TlsContext>, std::string> make_tls_context(const program_options& options){
+  if(options.tls_certificate.empty()){
+    if(!options.tls_key.empty()) return std::unexpected("--tls-key needs --tls-cert");
+    return std::nullopt;
+  }
+  //El motor io_uring recibe y envia con operaciones del kernel, sin pasar por OpenSSL
+  if(options.engine == server_engine::io_uring) return std::unexpected("not supported by the io_uring engine");
+  std::expected<TlsContext, std::string> context = TlsContext::create(options.tls_certificate, options.tls_key);
+  if(!context) return std::unexpected(context.error());
+  return std::optional<TlsContext>(std::move(context.value()));
+}
+
+
+//Lanza el trabajador index de la generacion actual
+int spawn_worker(master_state& state, size_t index){
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  pid_t pid = fork();
+  if(pid < 0) return errno;
+  if(pid == 0){
+    int result = handle_worker_signals();
+    if(result != EXIT_SUCCESS) std::cerr << "Error setting signal handlers: " << std::strerror(result) << std::endl;
+    if(state.options.pin_cpus && cores > 0){
+      result = pin_to_cpu(index % static_cast<size_t>(cores));
+      if(result != EXIT_SUCCESS) std::cerr << "Error pinning worker: " << std::strerror(result) << std::endl;
+    }
+    //El trabajador solo se queda con su socket de cada direccion TCP y con los Unix
+    std::vector<SafeFD> sockets;
+    for(listener& current : state.listeners) sockets.push_back(std::move(current.sockets[current.address.family() == AF_UNIX ? 0 : index]));
+    state.listeners.clear();
+    const TlsContext* tls = state.tls ? &state.tls.value() : nullptr;
+    _exit(serve(state.options, sockets, state.metrics, state.limiter, tls, index) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  state.workers.emplace(pid, worker_process{index, state.generation, std::chrono::steady_clock::now()});
+  return EXIT_SUCCESS;
+}
+
+
+void start_generation(master_state& state){
+  state.generation++;
+  for(size_t i = 0; i < state.options.workers; i++){
+    int result = spawn_worker(state, i);
+    if(result != EXIT_SUCCESS) std::cerr << "Error al crear el proceso trabajador: " << std::strerror(result) << std::endl;
+  }
+  if(state.options.verbose) std::cerr << "Started " << state.options.workers << " workers" << std::endl;
+}
+
+
+//Pide que terminen a los trabajadores de las generaciones anteriores o, con all, a todos
+void stop_workers(const master_state& state, bool all){
+  for(const auto& [pid, worker] : state.workers){
+    if(all || worker.generation != state.generation) kill(pid, SIGTERM);
+  }
+}
+
+
+//SIGHUP: vuelve a leer las opciones y, si son validas, lanza con ellas una generacion nueva
+//de trabajadores y para la anterior, que termina sus respuestas en curso. Si no cambia el
+//puerto los sockets de escucha son los mismos y no se pierde ninguna conexion
+void reload(master_state& state, const std::vector<std::string>& command){
+  std::expected<program_options, parse_args_errors> options = parse_args(std::vector<std::string>(command.begin() + 1, command.end()));
+  if(!options || options.value().show_help){
+    std::cerr << "Reload failed: wrong options" << std::endl;
+    return;
+  }
+  std::expected<PathResolver, int> resolver = PathResolver::open(options.value().basedir);
+  if(!resolver){
+    std::cerr << "Reload failed: base directory: " << std::strerror(resolver.error()) << std::endl;
+    return;
+  }
+  if(!options.value().archive.empty()){
+    std::expected<Archive, int> archive = Archive::open(options.value().archive);
+    if(!archive){
+      std::cerr << "Reload failed: archive: " << std::strerror(archive.error()) << std::endl;
+      return;
+    }
+  }
+  //Las metricas empiezan de cero: cada trabajador escribe las suyas sin sincronizarse
+  std::expected<Metrics, int> metrics = Metrics::create(options.value().workers);
+  if(!metrics){
+    std::cerr << "Reload failed: metrics: " << std::strerror(metrics.error()) << std::endl;
+    return;
+  }
+  std::expected<RateLimiter, int> limiter = RateLimiter::create(options.value().rate_limit, options.value().rate_burst);
+  if(!limiter){
+    std::cerr << "Reload failed: rate limiter: " << std::strerror(limiter.error()) << std::endl;
+    return;
+  }
+  //Tambien vuelve a leer el certificado, p.ej. tras renovarlo
+  std::expected<std::optional<TlsContext>, std::string> tls = make_tls_context(options.value());
+  if(!tls){
+    std::cerr << "Reload failed: TLS: " << tls.error() << std::endl;
+    return;
+  }
+  //Las direcciones que siguen conservan sus sockets, con sus colas de conexiones
+  int result = open_listeners(options.value(), state.listeners);
+  if(result != EXIT_SUCCESS){
+    std::cerr << "Reload failed: listening socket: " << std::strerror(result) << std::endl;
+    open_listeners(state.options, state.listeners);
+    return;
+  }
+  state.options = std::move(options.value());
+  state.metrics = std::move(metrics.value());
+  state.limiter = std::move(limiter.value());
+  state.tls = std::move(tls.value());
+  start_generation(state);
+  stop_workers(state, false);
+  if(state.options.verbose) std::cerr << "Reloaded, listening on " << describe_listeners(state.options) << std::endl;
+}
+
+
+//SIGUSR2: ejecuta de nuevo el programa, quiza actualizado, con los mismos argumentos. Hereda
+//los sockets de escucha, cuyos numeros recibe en DOCSERVER_LISTEN_FDS, asi que las
+//conexiones se siguen encolando mientras arranca y esta generacion las atiende hasta que el
+//proceso nuevo, con sus trabajadores ya lanzados, pide a este que termine
+pid_t start_upgrade(const master_state& state, const std::vector<std::string>& command){
+  std::string fds;
+  for(const listener& current : state.listeners){
+    for(const SafeFD& socket : current.sockets) fds += std::format("{0}{1}", fds.empty() ? "" : ",", socket.get());
+  }
+  pid_t pid = fork();
+  if(pid < 0) std::cerr << "Upgrade failed: " << std::strerror(errno) << std::endl;
+  if(pid != 0) return pid;
+
+  for(const listener& current : state.listeners){
+    for(const SafeFD& socket : current.sockets) set_inheritable(socket, true);
+  }
+  setenv("DOCSERVER_LISTEN_FDS", fds.c_str(), 1);
+  setenv("DOCSERVER_UPGRADE_PARENT", std::to_string(getppid()).c_str(), 1);
+  std::vector<char*> argv;
+  for(const std::string& arg : command) argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+  execvp(argv[0], argv.data());
+  std::cerr << "Error executing " << command[0] << ": " << std::strerror(errno) << std::endl;
+  _exit(127);
+}
+
+
+//Recoge los trabajadores que han terminado y relanza los de la generacion actual que fallan,
+//salvo si lo hacen nada mas arrancar: relanzarlos no lo arreglaria
+void reap_workers(master_state& state, int& exit_code){
+  int status{0};
+  pid_t pid;
+  while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+    if(pid == state.upgrade){
+      std::cerr << "Upgrade failed: the new process has exited" << std::endl;
+      state.upgrade = -1;
+      continue;
+    }
+    auto it = state.workers.find(pid);
+    if(it == state.workers.end()) continue;
+    worker_process worker = it->second;
+    state.workers.erase(it);
+    bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    if(!failed || worker.generation != state.generation) continue;
+    if(state.stopping || std::chrono::steady_clock::now() - worker.started < std::chrono::seconds(1)){
+      exit_code = -1;
+      continue;
+    }
+    std::cerr << "Worker " << worker.index << " failed, restarting it" << std::endl;
+    int result = spawn_worker(state, worker.index);
+    if(result != EXIT_SUCCESS) std::cerr << "Error al crear el proceso trabajador: " << std::strerror(result) << std::endl;
+  }
+}
+
+
+//Bucle del proceso principal, que no atiende conexiones: espera senales con sigwaitinfo y
+//retorna cuando no queda ningun trabajador, tras pararlos o si todos han fallado
+int run_master(master_state& state, const std::vector<std::string>& command){
+  sigset_t signals = master_signals();
+  int exit_code{0};
+  while(!state.workers.empty()){
+    siginfo_t info;
+    int signal = sigwaitinfo(&signals, &info);
+    if(signal == SIGTERM || signal == SIGINT){
+      state.stopping = true;
+      stop_workers(state, true);
+    }
+    else if(signal == SIGHUP && !state.stopping) reload(state, command);
+    else if(signal == SIGUSR2 && !state.stopping && state.upgrade < 0) state.upgrade = start_upgrade(state, command);
+    else if(signal == SIGCHLD) reap_workers(state, exit_code);
+  }
+  return state.stopping ? exit_code : -1;
+}
+
+
+int main(int argc, char* argv[]){
+  std::vector<std::string> command(argv, argv + argc);
+  std::expected<program_options, parse_args_errors> arguments = parse_args(std::vector<std::string>(command.begin() + 1, command.end()));
+  if(!arguments){
+    if(arguments.error() == parse_args_errors::missing_argument) std::cerr << "Missing argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::wrong_argument) std::cerr << "Wrong argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::unknown_option) std::cerr << "Unknown option" << std::endl;
+    else if(arguments.error() == parse_args_errors::unreadable_config) std::cerr << "Error reading config file" << std::endl;
+    return -1;
+  }
+  if(arguments.value().show_help){
+    help();
+    return 0;
+  }
+
+  //sendfile no admite MSG_NOSIGNAL: un cliente que cierra no debe matar al servidor
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t signals = master_signals();
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+
+  //Un archivo que no vale se detecta aqui y no en cada trabajador
+  if(!arguments.value().archive.empty()){
+    std::expected<Archive, int> archive = Archive::open(arguments.value().archive);
+    if(!archive){
+      std::cerr << "Error opening archive: " << std::strerror(archive.error()) << std::endl;
+      return -1;
+    }
+  }
+
+  //Las metricas se crean antes de lanzar los trabajadores para que todos las compartan
+  std::expected<Metrics, int> metrics = Metrics::create(arguments.value().workers);
+  if(!metrics){
+    std::cerr << "Error creating metrics: " << std::strerror(metrics.error()) << std::endl;
+    return -1;
+  }
+  //El limite de peticiones por IP tambien es comun a todos los trabajadores
+  std::expected<RateLimiter, int> limiter = RateLimiter::create(arguments.value().rate_limit, arguments.value().rate_burst);
+  if(!limiter){
+    std::cerr << "Error creating rate limiter: " << std::strerror(limiter.error()) << std::endl;
+    return -1;
+  }
+  std::expected<std::optional<TlsContext>, std::string> tls = make_tls_context(arguments.value());
+  if(!tls){
+    std::cerr << "Error setting up TLS: " << tls.error() << std::endl;
+    return -1;
+  }
+
+  //Los sockets los crea (o los hereda al actualizarse) el proceso principal, y sobreviven
+  //a los trabajadores
+  std::vector<listener> listeners = inherited_listeners(arguments.value().listen);
+  int result = open_listeners(arguments.value(), listeners);
+  if(result != EXIT_SUCCESS){
+    std::cerr << "Error while making socket: " << std::strerror(result) << std::endl;
+    return -1;
+  }
+  if(arguments.value().verbose) std::cerr << "Listening for incoming connections on " << describe_listeners(arguments.value()) << std::endl;
+
+  master_state state{std::move(arguments.value()), std::move(listeners), std::move(metrics.value()), std::move(limiter.value()), std::move(tls.value()), 0, {}, -1, false};
+  start_generation(state);
+  //Al actualizar el programa el proceso anterior termina cuando este ya tiene trabajadores
+  pid_t parent{0};
+  if(parse_number(Getenv("DOCSERVER_UPGRADE_PARENT"), parent) && parent == getppid()) kill(parent, SIGTERM);
+  unsetenv("DOCSERVER_UPGRADE_PARENT");
+  return run_master(state, command);
+}
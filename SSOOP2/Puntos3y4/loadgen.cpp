@@ -0,0 +1,522 @@
+//Generador de carga para docserver: abre conexiones concurrentes contra el servidor, pide
+//documentos de una mezcla ponderada y mide peticiones por segundo, latencias y, si se le
+//indica el proceso del servidor, su tiempo de CPU por peticion
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <expected>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <filesystem>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "SafeFD.h"
+#include "Socket.h"
+
+
+enum class parse_args_errors{
+  missing_argument,
+  wrong_argument,
+  unknown_option,
+  unreadable_mix,
+};
+
+
+enum class request_protocol{
+  //Peticion simple "GET ruta", con una conexion por peticion
+  simple,
+  //HTTP/1.1 con Connection: close
+  http,
+  //HTTP/1.1 reutilizando cada conexion para todas las peticiones que admita el servidor
+  keepalive,
+};
+
+
+//Documento de la mezcla: se pide con probabilidad proporcional a weight
+struct mix_entry{
+  std::string path;
+  double weight{1};
+};
+
+
+struct loadgen_options{
+  bool show_help{false};
+  uint16_t port{8080};
+  //Direccion del servidor; sin --address, 127.0.0.1 en port
+  std::optional<listen_address> address;
+  size_t connections{64};
+  size_t requests{10000};
+  size_t warmup{0};
+  std::vector<mix_entry> mix;
+  request_protocol protocol{request_protocol::simple};
+  //Cabeceras adicionales de las peticiones HTTP, ya terminadas en "\r\n"
+  std::string headers;
+  uint64_t seed{1};
+  //Proceso principal del servidor, para medir su CPU (0 no la mide)
+  pid_t server_pid{0};
+  bool tsv{false};
+};
+
+
+struct worker_result{
+  std::vector<double> latencies_us;
+  //Fallos de conexion o respuestas incompletas
+  size_t errors{0};
+  //Respuestas con codigo 4xx o 5xx
+  size_t http_errors{0};
+  size_t bytes{0};
+  size_t connects{0};
+};
+
+
+void help(){
+  std::cout << "Modo de empleo: loadgen [OPCION]..." << std::endl;
+  std::cout << "Generar carga contra un docserver local" << std::endl;
+  std::cout << "  -h, --help               mostrar unicamente un mensaje de ayuda" << std::endl;
+  std::cout << "  -p, --port <puerto>      puerto del servidor (por defecto 8080)" << std::endl;
+  std::cout << "  -a, --address <direccion> direccion del servidor, como en su --listen: ipv4:puerto, [ipv6]:puerto o" << std::endl;
+  std::cout << "                           unix:ruta (por defecto 127.0.0.1 en el puerto de -p)" << std::endl;
+  std::cout << "  -c, --connections <n>    conexiones concurrentes (por defecto 64)" << std::endl;
+  std::cout << "  -n, --requests <n>       peticiones totales (por defecto 10000)" << std::endl;
+  std::cout << "  -u, --path <ruta>        documento a pedir (por defecto /foo.txt); se puede repetir y se" << std::endl;
+  std::cout << "                           piden todos con la misma probabilidad" << std::endl;
+  std::cout << "  -m, --mix <fichero>      mezcla de documentos: una linea \"peso ruta\" por documento (# comenta)" << std::endl;
+  std::cout << "      --http               enviar peticiones HTTP/1.1 con una conexion por peticion" << std::endl;
+  std::cout << "  -k, --keepalive          enviar peticiones HTTP/1.1 reutilizando las conexiones" << std::endl;
+  std::cout << "  -H, --header <cabecera>  anadir una cabecera a las peticiones HTTP (p.ej. \"Accept-Encoding: gzip\")" << std::endl;
+  std::cout << "      --warmup <n>         peticiones previas que no se miden, p.ej. para llenar las caches" << std::endl;
+  std::cout << "      --seed <n>           semilla para elegir los documentos de la mezcla (por defecto 1)" << std::endl;
+  std::cout << "      --server-pid <pid>   medir la CPU por peticion del servidor (el proceso y sus trabajadores)" << std::endl;
+  std::cout << "      --tsv                escribir solo una linea de resultados separados por tabuladores" << std::endl;
+  std::cout << "Sin --http ni -k se envian peticiones simples, como las de los scripts originales" << std::endl;
+}
+
+
+template <typename T>
+bool parse_number(std::string_view str, T& value){
+  auto [ptr, ec] = std::from_chars(str.begin(), str.end(), value);
+  return ec == std::errc() && ptr == str.end();
+}
+
+
+//Lineas "peso ruta"; el peso puede tener decimales
+std::expected<std::vector<mix_entry>, parse_args_errors> read_mix(const std::string& file){
+  std::ifstream input(file);
+  if(!input) return std::unexpected(parse_args_errors::unreadable_mix);
+  std::vector<mix_entry> mix;
+  std::string line;
+  while(std::getline(input, line)){
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    mix_entry entry;
+    if(!(fields >> entry.weight)){
+      if(line.find_first_not_of(" \t\r") == std::string::npos) continue;
+      return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    if(!(fields >> entry.path) || !entry.path.starts_with('/') || entry.weight <= 0) return std::unexpected(parse_args_errors::wrong_argument);
+    mix.push_back(std::move(entry));
+  }
+  if(mix.empty()) return std::unexpected(parse_args_errors::wrong_argument);
+  return mix;
+}
+
+
+std::expected<loadgen_options, parse_args_errors> parse_args(int argc, char* argv[]){
+  std::vector<std::string_view> args(argv + 1, argv + argc);
+  loadgen_options options;
+
+  for(auto it = args.begin(), end = args.end(); it != end; it++){
+    if(*it == "-h" || *it == "--help"){
+      options.show_help = true;
+      return options;
+    }
+    //Opciones sin argumento
+    if(*it == "--http"){
+      options.protocol = request_protocol::http;
+      continue;
+    }
+    if(*it == "-k" || *it == "--keepalive"){
+      options.protocol = request_protocol::keepalive;
+      continue;
+    }
+    if(*it == "--tsv"){
+      options.tsv = true;
+      continue;
+    }
+    if(it == end - 1) return std::unexpected(parse_args_errors::missing_argument);
+    std::string_view option = *it;
+    it++;
+    if(option == "-p" || option == "--port"){
+      if(!parse_number(*it, options.port)) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else if(option == "-a" || option == "--address"){
+      std::expected<listen_address, int> address = parse_listen_address(*it);
+      if(!address) return std::unexpected(parse_args_errors::wrong_argument);
+      options.address = address.value();
+    }
+    else if(option == "-c" || option == "--connections"){
+      if(!parse_number(*it, options.connections) || options.connections == 0) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else if(option == "-n" || option == "--requests"){
+      if(!parse_number(*it, options.requests)) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else if(option == "-u" || option == "--path"){
+      if(!it->starts_with('/')) return std::unexpected(parse_args_errors::wrong_argument);
+      options.mix.push_back(mix_entry{std::string(*it), 1});
+    }
+    else if(option == "-m" || option == "--mix"){
+      std::expected<std::vector<mix_entry>, parse_args_errors> mix = read_mix(std::string(*it));
+      if(!mix) return std::unexpected(mix.error());
+      options.mix.insert(options.mix.end(), mix.value().begin(), mix.value().end());
+    }
+    else if(option == "-H" || option == "--header"){
+      if(it->find(':') == std::string_view::npos || it->find_first_of("\r\n") != std::string_view::npos) return std::unexpected(parse_args_errors::wrong_argument);
+      options.headers.append(*it).append("\r\n");
+    }
+    else if(option == "--warmup"){
+      if(!parse_number(*it, options.warmup)) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else if(option == "--seed"){
+      if(!parse_number(*it, options.seed)) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else if(option == "--server-pid"){
+      if(!parse_number(*it, options.server_pid) || options.server_pid <= 0) return std::unexpected(parse_args_errors::wrong_argument);
+    }
+    else return std::unexpected(parse_args_errors::unknown_option);
+  }
+  if(options.mix.empty()) options.mix.push_back(mix_entry{"/foo.txt", 1});
+  if(!options.address) options.address = parse_listen_address("127.0.0.1:" + std::to_string(options.port)).value();
+  return options;
+}
+
+
+std::expected<SafeFD, int> connect_to(const listen_address& address){
+  SafeFD fd(socket(address.family(), SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if(!fd.is_valid()) return std::unexpected(errno);
+
+  if(connect(fd.get(), address.get(), address.length) < 0) return std::unexpected(errno);
+  //Las peticiones son pequenas y se espera la respuesta: Nagle solo anadiria retardo
+  int enable{1};
+  if(address.family() != AF_UNIX) setsockopt(fd.get(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  return fd;
+}
+
+
+std::string make_request(const loadgen_options& options, std::string_view path){
+  if(options.protocol == request_protocol::simple) return "GET " + std::string(path) + "\r\n\r\n";
+  std::string request = "GET " + std::string(path) + " HTTP/1.1\r\nHost: localhost\r\n";
+  if(options.protocol == request_protocol::http) request.append("Connection: close\r\n");
+  return request.append(options.headers).append("\r\n");
+}
+
+
+//Respuesta leida de una conexion
+struct reply{
+  size_t bytes{0};
+  //0 en las respuestas simples, que no llevan codigo
+  unsigned status{0};
+  //El servidor cierra la conexion tras esta respuesta
+  bool closed{true};
+};
+
+
+//Lee hasta que el servidor cierre la conexion
+std::expected<reply, int> read_until_close(const SafeFD& fd, std::string& buffer, reply result){
+  char chunk[16384];
+  result.bytes += buffer.size();
+  buffer.clear();
+  while(true){
+    ssize_t size = recv(fd.get(), chunk, sizeof(chunk), 0);
+    if(size < 0){
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    if(size == 0) break;
+    result.bytes += static_cast<size_t>(size);
+  }
+  result.closed = true;
+  return result;
+}
+
+
+bool iequals(std::string_view a, std::string_view b){
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y){
+    return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+  });
+}
+
+
+//Lee una respuesta HTTP/1.1: la cabecera y tantos bytes de cuerpo como diga Content-Length o,
+//sin el, hasta que se cierre la conexion. buffer conserva lo recibido de mas entre llamadas
+std::expected<reply, int> read_http_response(const SafeFD& fd, std::string& buffer){
+  char chunk[16384];
+  size_t header_end;
+  while((header_end = buffer.find("\r\n\r\n")) == std::string::npos){
+    ssize_t size = recv(fd.get(), chunk, sizeof(chunk), 0);
+    if(size < 0){
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    //El servidor ha cerrado antes de responder, p.ej. una conexion persistente que ha caducado
+    if(size == 0) return std::unexpected(buffer.empty() ? ECONNRESET : EPROTO);
+    buffer.append(chunk, static_cast<size_t>(size));
+  }
+
+  reply result;
+  result.closed = false;
+  std::string_view header(buffer.data(), header_end);
+  //"HTTP/1.1 200 OK"
+  if(header.size() < 12 || !parse_number(header.substr(9, 3), result.status)) return std::unexpected(EPROTO);
+  size_t length{0};
+  bool has_length{false};
+  size_t pos = header.find("\r\n");
+  while(pos != std::string_view::npos && pos < header.size()){
+    size_t next = header.find("\r\n", pos + 2);
+    std::string_view line = header.substr(pos + 2, next == std::string_view::npos ? std::string_view::npos : next - pos - 2);
+    size_t colon = line.find(':');
+    if(colon != std::string_view::npos){
+      std::string_view name = line.substr(0, colon);
+      std::string_view value = line.substr(colon + 1);
+      value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+      if(iequals(name, "Content-Length")) has_length = parse_number(value, length);
+      else if(iequals(name, "Connection") && iequals(value, "close")) result.closed = true;
+    }
+    pos = next;
+  }
+  //Las respuestas 304, 204 y 1xx no llevan cuerpo aunque indiquen su longitud
+  if(result.status == 304 || result.status == 204 || result.status < 200) length = 0;
+  else if(!has_length){
+    buffer.erase(0, header_end + 4);
+    result.bytes = header_end + 4;
+    return read_until_close(fd, buffer, result);
+  }
+
+  size_t total = header_end + 4 + length;
+  while(buffer.size() < total){
+    ssize_t size = recv(fd.get(), chunk, sizeof(chunk), 0);
+    if(size < 0){
+      if(errno == EINTR) continue;
+      return std::unexpected(errno);
+    }
+    if(size == 0) return std::unexpected(EPROTO);
+    buffer.append(chunk, static_cast<size_t>(size));
+  }
+  buffer.erase(0, total);
+  result.bytes = total;
+  return result;
+}
+
+
+//Conexion de un hilo del generador. Con keep-alive se reutiliza mientras el servidor no la cierre
+class client_connection{
+ public:
+  explicit client_connection(const loadgen_options& options) : options_{options} {}
+
+  std::expected<reply, int> request(const std::string& request, worker_result& result){
+    //Una conexion persistente puede haberla cerrado el servidor (tiempo de espera o numero
+    //maximo de peticiones) justo antes de reutilizarla: se reintenta una vez con una nueva
+    bool reused = fd_.is_valid();
+    std::expected<reply, int> response = attempt(request, result);
+    if(!response && reused && (response.error() == ECONNRESET || response.error() == EPIPE)){
+      response = attempt(request, result);
+    }
+    if(!response || response.value().closed) fd_ = SafeFD();
+    return response;
+  }
+
+ private:
+  std::expected<reply, int> attempt(const std::string& request, worker_result& result){
+    if(!fd_.is_valid()){
+      std::expected<SafeFD, int> fd = connect_to(options_.address.value());
+      if(!fd) return std::unexpected(fd.error());
+      fd_ = std::move(fd.value());
+      buffer_.clear();
+      result.connects++;
+    }
+    if(send(fd_.get(), request.data(), request.size(), MSG_NOSIGNAL) < 0){
+      int error = errno;
+      fd_ = SafeFD();
+      return std::unexpected(error);
+    }
+    std::expected<reply, int> response = options_.protocol == request_protocol::simple ? read_until_close(fd_, buffer_, reply{}) : read_http_response(fd_, buffer_);
+    if(!response) fd_ = SafeFD();
+    return response;
+  }
+
+  const loadgen_options& options_;
+  SafeFD fd_;
+  std::string buffer_;
+};
+
+
+void run_worker(const loadgen_options& options, size_t index, size_t requests, bool record, worker_result& result){
+  std::vector<std::string> request_strs;
+  std::vector<double> weights;
+  for(const mix_entry& entry : options.mix){
+    request_strs.push_back(make_request(options, entry.path));
+    weights.push_back(entry.weight);
+  }
+  //Cada hilo tiene su propia secuencia, asi que con la misma semilla se repiten las peticiones
+  std::mt19937_64 random(options.seed + index);
+  std::discrete_distribution<size_t> choose(weights.begin(), weights.end());
+  client_connection connection(options);
+  if(record) result.latencies_us.reserve(requests);
+  for(size_t i = 0; i < requests; i++){
+    const std::string& request = request_strs[choose(random)];
+    auto start = std::chrono::steady_clock::now();
+    std::expected<reply, int> response = connection.request(request, result);
+    auto end = std::chrono::steady_clock::now();
+    if(!response || response.value().bytes == 0){
+      result.errors++;
+      continue;
+    }
+    if(response.value().status >= 400) result.http_errors++;
+    result.bytes += response.value().bytes;
+    if(record) result.latencies_us.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+  }
+}
+
+
+//Reparte las peticiones entre los hilos (los primeros se llevan el resto) y espera a que acaben
+std::vector<worker_result> run_workers(const loadgen_options& options, size_t requests, bool record){
+  std::vector<worker_result> results(options.connections);
+  std::vector<std::thread> workers;
+  for(size_t i = 0; i < options.connections; i++){
+    size_t share = requests / options.connections + (i < requests % options.connections ? 1 : 0);
+    workers.emplace_back(run_worker, std::cref(options), i, share, record, std::ref(results[i]));
+  }
+  for(std::thread& worker : workers) worker.join();
+  return results;
+}
+
+
+//Ticks de CPU (usuario y sistema) del proceso pid y de sus hijos vivos: el servidor con varios
+//trabajadores es un proceso principal y un hijo por trabajador. Se suman tambien los hijos ya
+//esperados de cada uno, que son los programas de /bin que han terminado
+uint64_t process_tree_ticks(pid_t pid){
+  uint64_t ticks{0};
+  std::error_code error;
+  for(const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator("/proc", error)){
+    std::ifstream stat_file(entry.path() / "stat");
+    std::string stat;
+    if(!std::getline(stat_file, stat)) continue;
+    //El nombre del programa va entre parentesis y puede tener espacios
+    size_t name_end = stat.rfind(')');
+    if(name_end == std::string::npos) continue;
+    std::istringstream fields(stat.substr(name_end + 2));
+    //Campos desde el 3 (estado): ppid es el 4, utime y stime el 14 y el 15 y cutime y cstime
+    //el 16 y el 17
+    std::string state;
+    pid_t ppid{0};
+    fields >> state >> ppid;
+    pid_t own{0};
+    if(!parse_number(entry.path().filename().string(), own) || (own != pid && ppid != pid)) continue;
+    std::string skipped;
+    for(int field = 5; field < 14; field++) fields >> skipped;
+    uint64_t user{0};
+    uint64_t system{0};
+    uint64_t children_user{0};
+    uint64_t children_system{0};
+    fields >> user >> system >> children_user >> children_system;
+    ticks += user + system + children_user + children_system;
+  }
+  return ticks;
+}
+
+
+double percentile(const std::vector<double>& sorted, double p){
+  if(sorted.empty()) return 0;
+  size_t index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+  return sorted[index];
+}
+
+
+double cpu_seconds(const timeval& time){
+  return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) / 1e6;
+}
+
+
+int main(int argc, char* argv[]){
+  std::expected<loadgen_options, parse_args_errors> arguments = parse_args(argc, argv);
+  if(!arguments){
+    if(arguments.error() == parse_args_errors::missing_argument) std::cerr << "Missing argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::wrong_argument) std::cerr << "Wrong argument" << std::endl;
+    else if(arguments.error() == parse_args_errors::unknown_option) std::cerr << "Unknown option" << std::endl;
+    else if(arguments.error() == parse_args_errors::unreadable_mix) std::cerr << "Cannot read request mix" << std::endl;
+    return -1;
+  }
+  const loadgen_options& options = arguments.value();
+  if(options.show_help){
+    help();
+    return 0;
+  }
+
+  if(options.warmup > 0) run_workers(options, options.warmup, false);
+
+  double tick_seconds = 1.0 / static_cast<double>(sysconf(_SC_CLK_TCK));
+  uint64_t server_ticks = options.server_pid > 0 ? process_tree_ticks(options.server_pid) : 0;
+  rusage usage_before;
+  getrusage(RUSAGE_SELF, &usage_before);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<worker_result> results = run_workers(options, options.requests, true);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  rusage usage_after;
+  getrusage(RUSAGE_SELF, &usage_after);
+  if(options.server_pid > 0) server_ticks = process_tree_ticks(options.server_pid) - server_ticks;
+
+  std::vector<double> latencies;
+  size_t errors{0};
+  size_t http_errors{0};
+  size_t bytes{0};
+  size_t connects{0};
+  for(const worker_result& result : results){
+    latencies.insert(latencies.end(), result.latencies_us.begin(), result.latencies_us.end());
+    errors += result.errors;
+    http_errors += result.http_errors;
+    bytes += result.bytes;
+    connects += result.connects;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  double completed = static_cast<double>(std::max<size_t>(latencies.size(), 1));
+  double client_cpu = cpu_seconds(usage_after.ru_utime) + cpu_seconds(usage_after.ru_stime) - cpu_seconds(usage_before.ru_utime) - cpu_seconds(usage_before.ru_stime);
+  double server_cpu = static_cast<double>(server_ticks) * tick_seconds;
+  double throughput = static_cast<double>(latencies.size()) / seconds;
+
+  if(options.tsv){
+    //ok errors http_errors s req/s MB/s p50 p90 p99 p99.9 max (us) CPU del servidor (us/peticion)
+    std::cout << latencies.size() << '\t' << errors << '\t' << http_errors << '\t' << seconds << '\t' << throughput << '\t';
+    std::cout << static_cast<double>(bytes) / seconds / 1e6 << '\t';
+    for(double p : {0.50, 0.90, 0.99, 0.999, 1.0}) std::cout << percentile(latencies, p) << '\t';
+    std::cout << server_cpu * 1e6 / completed << std::endl;
+    return errors == 0 ? 0 : 1;
+  }
+  std::cout << "requests:     " << latencies.size() << " ok, " << errors << " errors, " << http_errors << " http errors" << std::endl;
+  std::cout << "connections:  " << connects << " opened" << std::endl;
+  std::cout << "duration:     " << seconds << " s" << std::endl;
+  std::cout << "throughput:   " << throughput << " req/s, " << static_cast<double>(bytes) / seconds / 1e6 << " MB/s" << std::endl;
+  std::cout << "latency p50:  " << percentile(latencies, 0.50) << " us" << std::endl;
+  std::cout << "latency p90:  " << percentile(latencies, 0.90) << " us" << std::endl;
+  std::cout << "latency p99:  " << percentile(latencies, 0.99) << " us" << std::endl;
+  std::cout << "latency p99.9: " << percentile(latencies, 0.999) << " us" << std::endl;
+  std::cout << "latency max:  " << percentile(latencies, 1.0) << " us" << std::endl;
+  //El tiempo de CPU de /proc se cuenta en ticks (normalmente 10 ms): hacen falta bastantes peticiones
+  if(options.server_pid > 0) std::cout << "server cpu:   " << server_cpu * 1e6 / completed << " us/request" << std::endl;
+  std::cout << "client cpu:   " << client_cpu * 1e6 / completed << " us/request" << std::endl;
+  return errors == 0 ? 0 : 1;
+}